@@ -0,0 +1,550 @@
+/*
+    Headless benchmark for the synth engine.
+
+    Measures the voice mix across polyphony, harmonics, waveforms and
+    fastmath accuracy tiers, unison stacks, the cost of the fastmath kernels
+    themselves, multitimbral bus mixing with and without worker threads, the
+    throughput of the delays, RBJ filters, convolution reverb and the master
+    meters, fft_magnitude across power of two, mixed radix and Bluestein sizes
+    (with its error against a naive DFT up to 8192 points), and startup with
+    and without the table cache. Results are written as JSON, to stdout or to
+    the file given as the first argument.
+
+    Each result is in ns per unit of work, named in its field: ns_per_frame
+    for anything rendering all channels (one stereo frame), ns_per_sample for
+    single channel processing and the fft input, ns_per_call for the kernels
+    and ns_per_startup for the table cache.
+
+    Pass --quick to run a reduced sweep.
+*/
+#include "synth.h"
+#include "render.h"
+#include "golden.h"
+#include "sfx.h"
+#include "Iir.h"
+#include "fft.h"
+#include "fastmath.h"
+#include "bus.h"
+#include "meter.h"
+#include "tablecache.h"
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// constants
+const int nChannels = 2;
+const int nSampleRate = 44100;
+const double dMinSeconds = 0.05;
+
+
+struct result
+{
+    std::string group;
+    std::string name;
+    std::vector<std::pair<std::string, std::string>> params;
+    double dNs;
+    std::string unit = "frame";     // what dNs is per
+};
+
+std::vector<result> vResults;
+volatile FTYPE dSink = 0.0;     // keeps results alive so nothing is optimised away
+
+
+// runs fn(nSamples) repeatedly until at least dMinSeconds has elapsed and
+// returns the ns per unit of the fastest run
+template<class F>
+double measure(int nSamples, F fn)
+{
+    using clock = std::chrono::steady_clock;
+    double dBest = 1e30;
+    double dTotal = 0.0;
+    fn(nSamples);   // warm up
+    while (dTotal < dMinSeconds)
+    {
+        auto t0 = clock::now();
+        fn(nSamples);
+        double d = std::chrono::duration<double>(clock::now() - t0).count();
+        dBest = std::min(dBest, d);
+        dTotal += d;
+    }
+    return dBest * 1e9 / nSamples;
+}
+
+
+// same locking as ProcessChannel in olcSynthVisualizer.cpp
+std::mutex muxNotes;
+FTYPE ProcessChannel(std::vector<synth::note>& vNotes, FTYPE dTime)
+{
+    unique_lock<mutex> lm(muxNotes);
+    return render::mix_notes(vNotes, dTime);
+}
+
+
+void bench_voices(bool bQuick)
+{
+    using wf = wavegen::WaveFunction;
+    std::vector<std::pair<wf, std::string>> vWaves = { { wf::SINE, "sine" }, { wf::SAWTOOTH, "sawtooth" }, { wf::SQUARE, "square" }, { wf::TRIANGLE, "triangle" } };
+    std::vector<int> vVoices = bQuick ? std::vector<int>{ 1, 16, 128 } : std::vector<int>{ 1, 2, 4, 8, 16, 32, 64, 128, 256, 512 };
+    std::vector<int> vHarmonics = bQuick ? std::vector<int>{ 8 } : std::vector<int>{ 1, 8, 32 };
+    std::vector<fastmath::accuracy> vTiers = { fastmath::accuracy::exact, fastmath::accuracy::high, fastmath::accuracy::fast };
+
+    for (auto eAccuracy : vTiers)
+    for (auto& w : vWaves)
+    for (int nHarmonics : vHarmonics)
+    {
+        // harmonics only apply to the non-sine waveforms
+        if (w.first == wf::SINE && nHarmonics != vHarmonics.front()) continue;
+
+        for (int nVoices : vVoices)
+        {
+            synth::instrument_single_osc instrument;
+            instrument.function = w.first;
+            instrument.nHarmonics = nHarmonics;
+            instrument.eAccuracy = eAccuracy;
+
+            std::vector<synth::note> vNotes(nVoices);
+            for (int v = 0; v < nVoices; v++)
+            {
+                vNotes[v].id = 4 + (v * 7) % 120;
+                vNotes[v].on = 0.0;
+                vNotes[v].off = -1.0;   // held
+                vNotes[v].active = true;
+                vNotes[v].channel = &instrument;
+            }
+
+            // the mix is per sample, as in the app, so there is no block size to sweep
+            const int nBlock = 256;
+            std::vector<FTYPE> vBlock(nBlock * nChannels);
+            FTYPE dTime = 1.0;
+            double ns = measure(nBlock, [&](int nFrames)
+            {
+                instrument.begin(dTime, nFrames);
+                for (int n = 0; n < nFrames; n++)
+                {
+                    for (int c = 0; c < nChannels; c++)
+                        vBlock[n * nChannels + c] = ProcessChannel(vNotes, dTime);
+                    dTime += 1.0 / nSampleRate;
+                }
+                dSink = vBlock[0];
+            });
+
+            vResults.push_back({ "voices", w.second,
+                { { "voices", std::to_string(nVoices) }, { "harmonics", std::to_string(nHarmonics) },
+                  { "accuracy", "\"" + std::string(fastmath::accuracy_name(eAccuracy)) + "\"" } }, ns });
+        }
+    }
+}
+
+
+// unison stacks, one stereo voice mix per frame against the plain oscillator
+void bench_unison(bool bQuick)
+{
+    const int nBlock = 256;
+    const int nVoices = 16;
+    std::vector<int> vStacks = bQuick ? std::vector<int>{ 1, 16 } : std::vector<int>{ 1, 2, 4, 8, 16 };
+
+    for (auto eAccuracy : { fastmath::accuracy::high, fastmath::accuracy::fast })
+    for (int nUnison : vStacks)
+    {
+        synth::instrument_single_osc instrument;
+        instrument.function = wavegen::WaveFunction::SAWTOOTH;
+        instrument.nHarmonics = 8;
+        instrument.eAccuracy = eAccuracy;
+        instrument.nUnison = nUnison;
+
+        std::vector<synth::note> vNotes(nVoices);
+        for (int v = 0; v < nVoices; v++)
+        {
+            vNotes[v].id = 28 + v * 3;
+            vNotes[v].on = 0.0;
+            vNotes[v].off = -1.0;   // held
+            vNotes[v].active = true;
+            vNotes[v].channel = &instrument;
+        }
+
+        FTYPE dTime = 1.0;
+        double ns = measure(nBlock, [&](int nFrames)
+        {
+            FTYPE dLeft, dRight;
+            instrument.begin(dTime, nFrames);
+            for (int n = 0; n < nFrames; n++)
+            {
+                render::mix_notes_stereo(vNotes, dTime, dLeft, dRight);
+                dTime += 1.0 / nSampleRate;
+            }
+            dSink = dLeft + dRight;
+        });
+        vResults.push_back({ "unison", "sawtooth", { { "voices", std::to_string(nVoices) }, { "unison", std::to_string(nUnison) },
+            { "accuracy", "\"" + std::string(fastmath::accuracy_name(eAccuracy)) + "\"" } }, ns });
+    }
+}
+
+
+// oversampled oscillators, the resampler on its own and a bus of voices rendered at each factor
+void bench_oversampling(bool bQuick)
+{
+    const int nBlock = 256;
+    const int nVoices = 8;
+    std::vector<int> vFactors = bQuick ? std::vector<int>{ 1, 4 } : std::vector<int>{ 1, 2, 4, 8 };
+
+    for (int nFactor : vFactors)
+    {
+        if (nFactor == 1) continue;
+        oversample::oversampler resampler(nChannels, nBlock);
+        resampler.set_factor(nFactor);
+        std::vector<FTYPE> vIn(nBlock * nChannels), vUp(nBlock * nChannels * nFactor);
+        for (int i = 0; i < nBlock * nChannels; i++)
+            vIn[i] = sin(i * 0.01) * 0.5;
+        double ns = measure(nBlock, [&](int nFrames)
+        {
+            resampler.upsample(vIn.data(), nFrames, vUp.data());
+            resampler.downsample(vUp.data(), nFrames, vIn.data());
+            dSink = vIn[0];
+        });
+        vResults.push_back({ "oversampling", "roundtrip", { { "factor", std::to_string(nFactor) }, { "channels", std::to_string(nChannels) } }, ns });
+    }
+
+    for (int nFactor : vFactors)
+    {
+        synth::instrument_single_osc instrument;
+        instrument.function = wavegen::WaveFunction::SAWTOOTH;
+        bus::mixer mixer(nChannels, nBlock, 0);
+        bus::bus& target = mixer.add(&instrument, nSampleRate);
+        target.set_oversampling(nFactor);
+        for (int v = 0; v < nVoices; v++)
+        {
+            synth::note n;
+            n.id = 40 + v * 5;
+            n.on = 0.0;
+            n.off = -1.0;   // held
+            n.active = true;
+            n.channel = &instrument;
+            target.vNotes.push_back(n);
+        }
+
+        FTYPE dTime = 1.0;
+        double ns = measure(nBlock, [&](int nFrames)
+        {
+            target.render(nFrames, dTime);
+            dTime += nFrames / (FTYPE)nSampleRate;
+            dSink = target.vOutput.data()[0];
+        });
+        vResults.push_back({ "oversampling", "voices", { { "factor", std::to_string(nFactor) }, { "voices", std::to_string(nVoices) } }, ns });
+    }
+}
+
+
+void bench_kernels()
+{
+    using fa = fastmath::accuracy;
+    const int nBlock = 4096;
+    std::vector<FTYPE> vIn(nBlock), vOut(nBlock);
+    for (int i = 0; i < nBlock; i++)
+        vIn[i] = (i - nBlock / 2) * 0.37;
+
+    auto run = [&](const char* sName, const char* sTier, auto fn)
+    {
+        double ns = measure(nBlock, [&](int nFrames)
+        {
+            for (int n = 0; n < nFrames; n++)
+                vOut[n] = fn(vIn[n]);
+            dSink = vOut[nFrames / 2];
+        });
+        vResults.push_back({ "kernels", sName, { { "accuracy", "\"" + std::string(sTier) + "\"" } }, ns, "call" });
+    };
+
+    // lambdas rather than function pointers so the kernels inline into the loop
+    run("sin_poly", "Exact", [](FTYPE x) { return fastmath::sin_poly<fa::exact>(x); });
+    run("sin_poly", "High", [](FTYPE x) { return fastmath::sin_poly<fa::high>(x); });
+    run("sin_poly", "Fast", [](FTYPE x) { return fastmath::sin_poly<fa::fast>(x); });
+    run("sin_poly_positive", "High", [](FTYPE x) { return fastmath::sin_poly_positive<fa::high>(x + 2000.0); });
+    run("sin_poly_positive", "Fast", [](FTYPE x) { return fastmath::sin_poly_positive<fa::fast>(x + 2000.0); });
+    run("sin_table", "High", [](FTYPE x) { return fastmath::sin_table<fa::high>(x); });
+    run("sin_table", "Fast", [](FTYPE x) { return fastmath::sin_table<fa::fast>(x); });
+    run("exp2", "Exact", [](FTYPE x) { return fastmath::exp2<fa::exact>(x); });
+    run("exp2", "High", [](FTYPE x) { return fastmath::exp2<fa::high>(x); });
+    run("exp2", "Fast", [](FTYPE x) { return fastmath::exp2<fa::fast>(x); });
+}
+
+
+// multitimbral mix, every bus holding 32 voices, rendered in turn and on worker threads
+void bench_buses(bool bQuick)
+{
+    const int nBlock = 256;
+    const int nVoices = 32;
+    int nHardware = std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<int> vBusCounts = bQuick ? std::vector<int>{ 4 } : std::vector<int>{ 1, 2, 4, 8 };
+
+    for (int nBuses : vBusCounts)
+    {
+        // serial, and with as many workers as the machine allows
+        std::vector<int> vThreads = { 0 };
+        if (std::min(nBuses, nHardware) > 1)
+            vThreads.push_back(std::min(nBuses, nHardware) - 1);
+
+        for (int nThreads : vThreads)
+        {
+            std::vector<synth::instrument_single_osc> vInstruments(nBuses);
+            bus::mixer mixer(nChannels, nBlock, 1, nThreads);
+            for (int b = 0; b < nBuses; b++)
+            {
+                vInstruments[b].function = wavegen::WaveFunction::SAWTOOTH;
+                bus::bus& target = mixer.add(&vInstruments[b], nSampleRate);
+                target.paramSends[0].reset(0.5);
+                for (int v = 0; v < nVoices; v++)
+                {
+                    synth::note n;
+                    n.id = 4 + (v * 7 + b) % 120;
+                    n.on = 0.0;
+                    n.off = -1.0;   // held
+                    n.active = true;
+                    n.channel = &vInstruments[b];
+                    target.vNotes.push_back(n);
+                }
+            }
+
+            FTYPE dTime = 1.0;
+            double ns = measure(nBlock, [&](int nFrames)
+            {
+                mixer.render(nFrames, dTime);
+                dTime += nFrames / (FTYPE)nSampleRate;
+                dSink = mixer.output(0)[0];
+            });
+            vResults.push_back({ "buses", "mixer", { { "buses", std::to_string(nBuses) }, { "voices_per_bus", std::to_string(nVoices) }, { "threads", std::to_string(nThreads) } }, ns });
+        }
+    }
+}
+
+
+void bench_effects()
+{
+    const int nBlock = 4096;
+    std::vector<FTYPE> vIn(nBlock * nChannels);
+    for (int i = 0; i < nBlock * nChannels; i++)
+        vIn[i] = sin(i * 0.01) * 0.5;
+
+    {
+        sfx::monodelay d(nSampleRate, 4.0);
+        double ns = measure(nBlock, [&](int nFrames)
+        {
+            for (int n = 0; n < nFrames; n++)
+            {
+                FTYPE s = vIn[n * nChannels];
+                d.process(s, 1.0, 0.6, 0.5f);
+                dSink = s;
+            }
+        });
+        vResults.push_back({ "effects", "monodelay", {}, ns, "sample" });
+    }
+
+    {
+        sfx::pingpongdelay d(nSampleRate, 4.0);
+        sfx::pingpongdelay::stereo_sample time(0.3, 0.5);
+        sfx::pingpongdelay::stereo_sample fb(0.75, 0.75);
+        double ns = measure(nBlock, [&](int nFrames)
+        {
+            FTYPE s[2];
+            for (int n = 0; n < nFrames; n++)
+            {
+                s[0] = vIn[n * nChannels];
+                s[1] = vIn[n * nChannels + 1];
+                d.process(nChannels, s, time, fb, 0.5f);
+                dSink = s[0] + s[1];
+            }
+        });
+        vResults.push_back({ "effects", "pingpongdelay", {}, ns });
+    }
+
+    {
+        Iir::RBJ::HighPass f;
+        f.setup((FTYPE)nSampleRate, 100.0, 0.3);
+        double ns = measure(nBlock, [&](int nFrames)
+        {
+            for (int n = 0; n < nFrames; n++)
+                dSink = f.filter(vIn[n * nChannels]);
+        });
+        vResults.push_back({ "effects", "rbj_highpass", {}, ns, "sample" });
+    }
+
+    {
+        Iir::RBJ::LowPass f;
+        f.setup((FTYPE)nSampleRate, 1500.0, 0.7);
+        double ns = measure(nBlock, [&](int nFrames)
+        {
+            for (int n = 0; n < nFrames; n++)
+                dSink = f.filter(vIn[n * nChannels]);
+        });
+        vResults.push_back({ "effects", "rbj_lowpass", {}, ns, "sample" });
+    }
+
+    // cutoff held in an exponential ramp the whole time, coefficients recomputed every control period
+    {
+        Iir::RBJ::LowPass f[nChannels];
+        param::parameter frequency{ 1500.0, 20.0, 20000.0, param::ramp::exponential, 1.0 };
+        param::parameter q{ 0.7, 0.1, 10.0 };
+        frequency.prepare(nSampleRate);
+        q.prepare(nSampleRate);
+        graph::filter_node<Iir::RBJ::LowPass> node(f, nChannels, nSampleRate, frequency, q);
+        std::vector<FTYPE> vBlock(vIn);
+        FTYPE* pIn = vBlock.data();
+        FTYPE dTime = 0.0;
+        double ns = measure(nBlock, [&](int nFrames)
+        {
+            frequency.set(frequency.get() > 1000.0 ? 500.0 : 4000.0);
+            node.process(nChannels, nFrames, dTime, &pIn, 1, vBlock.data());
+            dTime += nFrames / (FTYPE)nSampleRate;
+            dSink = vBlock[0];
+        });
+        vResults.push_back({ "effects", "rbj_lowpass_sweep", { { "channels", std::to_string(nChannels) } }, ns });
+    }
+
+    // 3 second impulse response, partitioned convolution of one channel
+    {
+        std::vector<FTYPE> vImpulse(3 * nSampleRate);
+        for (size_t i = 0; i < vImpulse.size(); i++)
+            vImpulse[i] = sin(i * 0.7) * exp(-2.0 * i / nSampleRate) * 0.01;
+        sfx::convolver r;
+        r.load(vImpulse);
+        std::vector<FTYPE> vBlock(vIn.begin(), vIn.begin() + nBlock);
+        double ns = measure(nBlock, [&](int nFrames)
+        {
+            r.process(vBlock.data(), nFrames, 1, 0.3f);
+            dSink = vBlock[nFrames - 1];
+        });
+        vResults.push_back({ "effects", "convolver", { { "ir_seconds", "3" } }, ns, "sample" });
+    }
+
+    // peak, true peak, rms and loudness over all channels, per frame
+    {
+        meter::meter m(nChannels, nSampleRate, nBlock);
+        meter::snapshot s;
+        double ns = measure(nBlock, [&](int nFrames)
+        {
+            m.process(vIn.data(), nFrames);
+            m.read(s);
+            dSink = s.dMomentary;
+        });
+        vResults.push_back({ "effects", "meter", { { "channels", std::to_string(nChannels) } }, ns });
+    }
+}
+
+
+void bench_fft(bool bQuick)
+{
+    std::vector<int> vSizes;
+    for (int nSize = 256; nSize <= (bQuick ? 4096 : 65536); nSize *= 2)
+        vSizes.push_back(nSize);
+
+    // sizes that follow the screen width go through the mixed radix path, a prime through bluestein
+    for (int nSize : { 1280, 2560, 3000, 4801 })
+        vSizes.push_back(nSize);
+
+    for (int nSize : vSizes)
+    {
+        std::vector<double> vIn(nSize), vOut(nSize / 2);
+        for (int i = 0; i < nSize; i++)
+            vIn[i] = sin(i * 0.1) + 0.25 * sin(i * 0.37);
+
+        // one transform per call, reported per input sample
+        double ns = measure(1, [&](int) { fft_magnitude(vIn.data(), vOut.data(), nSize); });
+        std::vector<std::pair<std::string, std::string>> vParams = { { "size", std::to_string(nSize) },
+            { "algorithm", "\"" + std::string(fft_algorithm_name(fft_get_plan(nSize).eAlgorithm)) + "\"" } };
+        if (nSize <= 8192)
+        {
+            char sError[32];
+            snprintf(sError, sizeof(sError), "%.3e", golden::check_fft_magnitude(nSize));
+            vParams.push_back({ "max_rel_error", sError });
+        }
+        vResults.push_back({ "fft", "fft_magnitude", vParams, ns / nSize, "sample" });
+    }
+}
+
+
+// the app's table set built from scratch, against mapping and validating the file holding it
+void bench_tables()
+{
+    const char* sPath = "synth_bench.tables";
+    auto build = [](tablecache::builder& b)
+    {
+        fastmath::cache_tables(b);
+        synth::cache_tables(b);
+        oversample::cache_tables(b);
+        fft_cache_tables(b, { 512, 1024, 2048, 2560, 4096, 8192 });
+    };
+
+    double nsBuild = measure(1, [&](int)
+    {
+        tablecache::builder b;
+        build(b);
+        dSink = b.count();
+    });
+
+    tablecache::builder b;
+    build(b);
+    if (!b.write(sPath, "synth_bench", sizeof(FTYPE)))
+        return;
+    size_t nBytes = 0;
+    double nsOpen = measure(1, [&](int)
+    {
+        tablecache::cache c;
+        c.open(sPath, "synth_bench", sizeof(FTYPE));
+        nBytes = c.bytes();
+    });
+    remove(sPath);
+
+    vResults.push_back({ "startup", "tables_build", { { "sections", std::to_string(b.count()) } }, nsBuild, "startup" });
+    vResults.push_back({ "startup", "tables_open", { { "bytes", std::to_string(nBytes) } }, nsOpen, "startup" });
+}
+
+
+void write_json(FILE* f)
+{
+    fprintf(f, "{\n  \"benchmark\": \"synth_bench\",\n  \"sample_rate\": %d,\n  \"channels\": %d,\n  \"results\": [\n", nSampleRate, nChannels);
+    for (size_t i = 0; i < vResults.size(); i++)
+    {
+        const result& r = vResults[i];
+        fprintf(f, "    { \"group\": \"%s\", \"name\": \"%s\"", r.group.c_str(), r.name.c_str());
+        for (auto& p : r.params)
+            fprintf(f, ", \"%s\": %s", p.first.c_str(), p.second.c_str());
+        fprintf(f, ", \"ns_per_%s\": %.3f }%s\n", r.unit.c_str(), r.dNs, i + 1 < vResults.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    bool bQuick = false;
+    const char* sOutput = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string(argv[i]) == "--quick")
+            bQuick = true;
+        else
+            sOutput = argv[i];
+    }
+
+    bench_voices(bQuick);
+    bench_kernels();
+    bench_unison(bQuick);
+    bench_buses(bQuick);
+    bench_oversampling(bQuick);
+    bench_effects();
+    bench_fft(bQuick);
+    bench_tables();
+
+    FILE* f = sOutput != nullptr ? fopen(sOutput, "w") : stdout;
+    if (f == nullptr)
+    {
+        fprintf(stderr, "could not open %s\n", sOutput);
+        return 1;
+    }
+    write_json(f);
+    if (f != stdout)
+        fclose(f);
+    return 0;
+}
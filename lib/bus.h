@@ -0,0 +1,357 @@
+#pragma once
+#ifndef BUS_H
+#define BUS_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "synth.h"
+#include "render.h"
+#include "graph.h"
+#include "param.h"
+#include "oversample.h"
+
+/**
+ * Multitimbral mixing. Each bus is an instrument slot with its own voices and
+ * insert chain (a graph whose first node is the voice mix). The mixer renders
+ * every bus for a block, on worker threads when it has them, joins, then sums
+ * the buses into the dry output and the effect sends.
+ */
+namespace bus
+{
+
+    const int MAX_SENDS = 4;
+
+
+    // the voices of one bus, mixed once per frame in stereo, even channels get the left mix and odd channels the right
+    // (a single channel gets both). With oversampling the voices are evaluated at 2x/4x/8x the rate and decimated,
+    // which keeps the aliasing of the naive waveforms out of the audio band.
+    class voices_node : public graph::node
+    {
+    private:
+        synth::instrument_base* instrument;
+        std::vector<synth::note>& vNotes;
+        std::mutex& muxNotes;
+        FTYPE dTimeStep;
+        std::atomic<int> nOversampling{ 1 };
+        oversample::oversampler resampler;
+        sfx::aligned_buffer<FTYPE> vOversampled;
+
+    public:
+        voices_node(synth::instrument_base* pInstrument, std::vector<synth::note>& notes, std::mutex& mux, int nSampleRate, int nChans, int nMaxFrames)
+            : instrument(pInstrument), vNotes(notes), muxNotes(mux), resampler(nChans, nMaxFrames)
+        {
+            dTimeStep = 1.0 / (FTYPE)nSampleRate;
+            vOversampled.allocate((size_t)nChans * nMaxFrames * oversample::MAX_FACTOR);
+        }
+
+        // any thread, applied at the next block
+        void set_oversampling(int nFactor)
+        {
+            nOversampling.store(nFactor, std::memory_order_relaxed);
+        }
+
+        int oversampling() const
+        {
+            return nOversampling.load(std::memory_order_relaxed);
+        }
+
+        void process(int nChans, int nFrames, FTYPE dTime, FTYPE* const* ppIn, int nInputs, FTYPE* pOut) override
+        {
+            resampler.set_factor(nOversampling.load(std::memory_order_relaxed));
+            int nFactor = resampler.factor();
+            FTYPE* pRender = nFactor == 1 ? pOut : vOversampled.data();
+            FTYPE dStep = dTimeStep / nFactor;
+
+            std::unique_lock<std::mutex> lm(muxNotes);
+            if (instrument != nullptr)
+                instrument->begin(dTime, nFrames);
+            for (int n = 0; n < nFrames * nFactor; n++)
+            {
+                FTYPE dLeft, dRight;
+                render::mix_notes_stereo(vNotes, dTime + n * dStep, dLeft, dRight);
+                if (nChans == 1)
+                    pRender[n] = 0.5 * (dLeft + dRight);
+                else
+                    for (int c = 0; c < nChans; c++)
+                        pRender[n * nChans + c] = (c & 1) ? dRight : dLeft;
+            }
+            lm.unlock();
+
+            if (nFactor > 1)
+                resampler.downsample(pRender, nFrames, pOut);
+        }
+
+        void reset() override
+        {
+            resampler.reset();
+        }
+    };
+
+
+    class bus
+    {
+    public:
+        synth::instrument_base* instrument;
+        std::vector<synth::note> vNotes;
+        std::mutex muxNotes;
+
+        // insert chain, add effects after voices() and point set_output() at the last one
+        graph::graph inserts;
+
+        // smoothed per sample by the mixer, set them from any thread
+        param::parameter paramGain{ 1.0, 0.0, 2.0 };
+        param::parameter paramSends[MAX_SENDS];
+
+        sfx::aligned_buffer<FTYPE> vOutput;
+
+    private:
+        int nVoices;
+        voices_node* pVoices;
+
+    public:
+        bus(synth::instrument_base* pInstrument, int nChans, int nMaxFrames, int nSampleRate)
+            : inserts(nChans, nMaxFrames, nSampleRate)
+        {
+            instrument = pInstrument;
+            if (instrument != nullptr)
+                instrument->prepare(nSampleRate);
+            paramGain.prepare(nSampleRate);
+            for (auto& s : paramSends)
+            {
+                s.range(0.0, 4.0);
+                s.prepare(nSampleRate);
+            }
+            vOutput.allocate((size_t)nChans * nMaxFrames);
+            pVoices = new voices_node(instrument, vNotes, muxNotes, nSampleRate, nChans, nMaxFrames);
+            nVoices = inserts.add(pVoices);
+            inserts.set_output(nVoices);
+            inserts.commit();
+        }
+
+        int voices() const
+        {
+            return nVoices;
+        }
+
+        // 1, 2, 4 or 8 times the sample rate for the oscillators
+        void set_oversampling(int nFactor)
+        {
+            pVoices->set_oversampling(nFactor);
+        }
+
+        int oversampling() const
+        {
+            return pVoices->oversampling();
+        }
+
+        void render(int nFrames, FTYPE dTime)
+        {
+            inserts.process(nFrames, vOutput.data(), dTime);
+        }
+    };
+
+
+    class mixer
+    {
+    private:
+        int nChans;
+        int nMaxFrames;
+        int nSends;
+        std::vector<std::unique_ptr<bus>> vBuses;
+
+        // outputs: 0 is dry, then one per send
+        std::vector<sfx::aligned_buffer<FTYPE>> vReturns;
+        sfx::aligned_buffer<FTYPE> vGainCurve;
+        sfx::aligned_buffer<FTYPE> vSendCurve;
+        FTYPE dRenderedTime = -1.0;
+
+        // the block being rendered, shared with the workers
+        int nBlockFrames = 0;
+        FTYPE dBlockTime = 0.0;
+        std::atomic<int> nNextBus{ 0 };
+        std::atomic<int> nBusesLeft{ 0 };
+
+        std::vector<std::thread> vWorkers;
+        std::mutex muxWake;
+        std::condition_variable cvWake;
+        uint64_t nGeneration = 0;
+        bool bQuit = false;
+
+    public:
+        // nThreads extra threads render buses alongside the caller, 0 renders them in turn
+        mixer(int nChannels, int nMaxBlockFrames, int nSendCount, int nThreads = 0)
+        {
+            nChans = nChannels;
+            nMaxFrames = nMaxBlockFrames;
+            nSends = std::min(nSendCount, MAX_SENDS);
+            vReturns = std::vector<sfx::aligned_buffer<FTYPE>>(nSends + 1);
+            for (auto& r : vReturns)
+                r.allocate((size_t)nChans * nMaxFrames);
+            vGainCurve.allocate(nMaxFrames);
+            vSendCurve.allocate(nMaxFrames);
+            for (int t = 0; t < nThreads; t++)
+                vWorkers.emplace_back(&mixer::worker, this);
+        }
+
+        mixer(const mixer&) = delete;
+        mixer& operator=(const mixer&) = delete;
+
+        ~mixer()
+        {
+            {
+                std::unique_lock<std::mutex> lk(muxWake);
+                bQuit = true;
+            }
+            cvWake.notify_all();
+            for (auto& t : vWorkers)
+                t.join();
+        }
+
+        // set up buses before audio starts, the bus list is not changed while rendering
+        bus& add(synth::instrument_base* pInstrument, int nSampleRate)
+        {
+            vBuses.emplace_back(new bus(pInstrument, nChans, nMaxFrames, nSampleRate));
+            return *vBuses.back();
+        }
+
+        int count() const
+        {
+            return (int)vBuses.size();
+        }
+
+        bus& operator[](int i)
+        {
+            return *vBuses[i];
+        }
+
+        int sends() const
+        {
+            return nSends;
+        }
+
+        /**
+         * Renders every bus for the block starting at dTime and mixes the
+         * returns. Only the first call for a given block does any work, so
+         * each return node can ask for it.
+         */
+        void render(int nFrames, FTYPE dTime)
+        {
+            if (dTime == dRenderedTime) return;
+            dRenderedTime = dTime;
+
+            nBlockFrames = nFrames;
+            dBlockTime = dTime;
+            nBusesLeft.store((int)vBuses.size(), std::memory_order_relaxed);
+            nNextBus.store(0, std::memory_order_release);
+            if (!vWorkers.empty() && vBuses.size() > 1)
+            {
+                {
+                    std::unique_lock<std::mutex> lk(muxWake);
+                    nGeneration++;
+                }
+                cvWake.notify_all();
+            }
+
+            // the caller takes buses too, then waits for the rest
+            run_buses();
+            while (nBusesLeft.load(std::memory_order_acquire) > 0)
+                std::this_thread::yield();
+
+            size_t nSamples = (size_t)nChans * nFrames;
+            for (auto& r : vReturns)
+                std::fill(r.data(), r.data() + nSamples, 0.0);
+            FTYPE* gain = vGainCurve.data();
+            FTYPE* send = vSendCurve.data();
+            for (auto& b : vBuses)
+            {
+                const FTYPE* in = b->vOutput.data();
+                b->paramGain.begin(dTime);
+                for (int n = 0; n < nFrames; n++)
+                    gain[n] = b->paramGain.next();
+                accumulate(vReturns[0].data(), in, gain, nFrames);
+
+                for (int s = 0; s < nSends; s++)
+                {
+                    // a send resting at zero only has to keep its clock running
+                    param::parameter& p = b->paramSends[s];
+                    p.begin(dTime);
+                    if (p.value() == 0.0 && p.get() == 0.0 && !p.ramping())
+                    {
+                        p.advance(nFrames);
+                        continue;
+                    }
+                    for (int n = 0; n < nFrames; n++)
+                        send[n] = gain[n] * p.next();
+                    accumulate(vReturns[s + 1].data(), in, send, nFrames);
+                }
+            }
+        }
+
+        // 0 is the dry mix, 1 + s is send s
+        const FTYPE* output(int nReturn) const
+        {
+            return vReturns[nReturn].data();
+        }
+
+    private:
+        void accumulate(FTYPE* out, const FTYPE* in, const FTYPE* gain, int nFrames)
+        {
+            for (int n = 0; n < nFrames; n++)
+                for (int c = 0; c < nChans; c++)
+                    out[n * nChans + c] += gain[n] * in[n * nChans + c];
+        }
+
+        void run_buses()
+        {
+            int i;
+            while ((i = nNextBus.fetch_add(1, std::memory_order_acq_rel)) < (int)vBuses.size())
+            {
+                vBuses[i]->render(nBlockFrames, dBlockTime);
+                nBusesLeft.fetch_sub(1, std::memory_order_acq_rel);
+            }
+        }
+
+        void worker()
+        {
+            EnableFlushToZero();    // the modes are per thread, the audio thread's do not carry over
+            uint64_t nSeen = 0;
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lk(muxWake);
+                    cvWake.wait(lk, [&] { return bQuit || nGeneration != nSeen; });
+                    if (bQuit) return;
+                    nSeen = nGeneration;
+                }
+                run_buses();
+            }
+        }
+    };
+
+
+    // one of the mixer outputs as a graph source, 0 is dry and 1 + s is send s
+    class return_node : public graph::node
+    {
+    private:
+        mixer& mix;
+        int nReturn;
+
+    public:
+        return_node(mixer& m, int nOutput)
+            : mix(m), nReturn(nOutput) {}
+
+        void process(int nChans, int nFrames, FTYPE dTime, FTYPE* const* ppIn, int nInputs, FTYPE* pOut) override
+        {
+            mix.render(nFrames, dTime);
+            memcpy(pOut, mix.output(nReturn), sizeof(FTYPE) * nChans * nFrames);
+        }
+    };
+
+}
+
+#endif /* ifndef BUS_H */
@@ -0,0 +1,213 @@
+#pragma once
+#ifndef FASTMATH_H
+#define FASTMATH_H
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "tablecache.h"
+
+/**
+ * Approximations for the oscillator inner loop. Every kernel comes in three
+ * accuracy tiers:
+ *   exact - the standard library call
+ *   high  - error below -120dB
+ *   fast  - roughly -80dB, fewest operations
+ * Kernels are branch free so loops over them vectorise. The default tier for
+ * new instruments is chosen at build time with FASTMATH_ACCURACY.
+ */
+
+#ifndef FASTMATH_ACCURACY
+#define FASTMATH_ACCURACY exact
+#endif
+
+namespace fastmath
+{
+
+    enum class accuracy
+    {
+        exact,
+        high,
+        fast
+    };
+
+    const accuracy default_accuracy = accuracy::FASTMATH_ACCURACY;
+
+    const char* accuracy_name(accuracy a)
+    {
+        switch (a)
+        {
+        case accuracy::exact: return "Exact";
+        case accuracy::high: return "High";
+        case accuracy::fast: return "Fast";
+        }
+        return "";
+    }
+
+    const FTYPE TWO_PI = 6.283185307179586476925286766559;
+    const FTYPE INV_TWO_PI = 0.15915494309189533576888376337251;
+    const FTYPE HALF_PI = 1.5707963267948966192313216916398;
+    const FTYPE ONE_PI = 3.1415926535897932384626433832795;
+    const FTYPE INV_PI = 0.31830988618379067153776526745;
+
+
+    // reduce to [-pi, pi] then fold into [-pi/2, pi/2] where sin is odd and monotonic
+    inline FTYPE reduce_half_pi(FTYPE x)
+    {
+        FTYPE r = x - TWO_PI * std::floor(x * INV_TWO_PI + 0.5);
+        FTYPE f = std::copysign(TWO_PI * 0.5, r) - r;
+        return std::fabs(r) > HALF_PI ? f : r;
+    }
+
+    // minimax odd polynomials on [-pi/2, pi/2]
+    template<accuracy A>
+    inline FTYPE sin_poly_reduced(FTYPE r)
+    {
+        FTYPE r2 = r * r;
+        if (A == accuracy::high)    // degree 7, max error 5.9e-7 (-124.6dB)
+            return r * (0.99999661591637323 + r2 * (-0.1666482838411146 + r2 * (0.0083063252433030858 + r2 * -0.00018363654326580573)));
+        else                        // degree 5, max error 6.8e-5 (-83.4dB)
+            return r * (0.99969677366319476 + r2 * (-0.16567308003999676 + r2 * 0.0075143773930780814));
+    }
+
+    template<accuracy A>
+    inline FTYPE sin_poly(FTYPE x)
+    {
+        if (A == accuracy::exact)
+            return std::sin(x);
+        return sin_poly_reduced<A>(reduce_half_pi(x));
+    }
+
+    /**
+     * sin_poly for 0 <= x < 2^31 pi, e.g. a phase wrapped to one turn times a
+     * harmonic number. Reduces by whole half turns with an integer conversion
+     * rather than floor and a select, which compilers will not vectorise
+     * under default floating point flags.
+     */
+    template<accuracy A>
+    inline FTYPE sin_poly_positive(FTYPE x)
+    {
+        if (A == accuracy::exact)
+            return std::sin(x);
+        int32_t n = (int32_t)(x * INV_PI + 0.5);
+        FTYPE r = x - n * ONE_PI;
+        return (1.0 - 2.0 * (n & 1)) * sin_poly_reduced<A>(r);
+    }
+
+
+    // table of one sine cycle (plus a guard point) for linear interpolation
+    template<int N>
+    std::vector<FTYPE> build_sine_table()
+    {
+        std::vector<FTYPE> v(N + 1);
+        for (int i = 0; i <= N; i++)
+            v[i] = std::sin(TWO_PI * i / N);
+        return v;
+    }
+
+    // from the table cache when one is installed
+    template<int N>
+    const FTYPE* sine_table()
+    {
+        static std::vector<FTYPE> vTable;
+        static const FTYPE* pTable = []()
+        {
+            const FTYPE* p = tablecache::lookup<FTYPE>(("fastmath.sine." + std::to_string(N)).c_str(), N + 1);
+            if (p != nullptr) return p;
+            vTable = build_sine_table<N>();
+            return (const FTYPE*)vTable.data();
+        }();
+        return pTable;
+    }
+
+    void cache_tables(tablecache::builder& b)
+    {
+        b.add("fastmath.sine.256", build_sine_table<256>());
+        b.add("fastmath.sine.4096", build_sine_table<4096>());
+    }
+
+    template<int N>
+    inline FTYPE sin_table_lerp(const FTYPE* table, FTYPE x)
+    {
+        static_assert((N & (N - 1)) == 0, "table sizes are powers of two");
+        FTYPE p = x * INV_TWO_PI;
+        p = (p - std::floor(p)) * N;
+        int i = (int)p;
+        FTYPE f = p - i;
+        i &= N - 1;     // p - floor(p) rounds up to exactly 1 for tiny negative x
+        return table[i] + f * (table[i + 1] - table[i]);
+    }
+
+    // high: 4096 points, max error 2.9e-7 (-130dB), fast: 256 points, 7.5e-5 (-82dB)
+    template<accuracy A>
+    inline FTYPE sin_table(FTYPE x)
+    {
+        if (A == accuracy::exact)
+            return std::sin(x);
+        if (A == accuracy::high)
+            return sin_table_lerp<4096>(sine_table<4096>(), x);
+        return sin_table_lerp<256>(sine_table<256>(), x);
+    }
+
+
+    // 2^x from an exact power of two and a minimax polynomial for the fraction
+    template<accuracy A>
+    inline FTYPE exp2(FTYPE x)
+    {
+        if (A == accuracy::exact)
+            return std::exp2(x);
+
+        FTYPE fi = std::floor(x);
+        FTYPE f = x - fi;
+        FTYPE p;
+        if (A == accuracy::high)    // relative error 7.5e-8
+            p = 0.99999992506305868 + f * (0.69315307322776565 + f * (0.24015361679602443 + f * (0.055826318810484464 + f * (0.0089893391679764772 + f * 0.0018775770629643812))));
+        else                        // relative error 7.5e-5 (0.13 cents)
+            p = 0.99992521810464885 + f * (0.69583355110712042 + f * (0.22606712297076281 + f * 0.078024546109767057));
+
+        // build 2^fi directly in the exponent bits, valid for normal results
+        int64_t bits = (int64_t)(fi + 1023.0) << 52;
+        FTYPE scale;
+        memcpy(&scale, &bits, sizeof(scale));
+        return p * scale;
+    }
+
+
+    // runtime dispatch for callers that hold an accuracy value
+    inline FTYPE sine(FTYPE x, accuracy a)
+    {
+        switch (a)
+        {
+        case accuracy::high: return sin_poly<accuracy::high>(x);
+        case accuracy::fast: return sin_poly<accuracy::fast>(x);
+        default: return std::sin(x);
+        }
+    }
+
+    inline FTYPE exp2(FTYPE x, accuracy a)
+    {
+        switch (a)
+        {
+        case accuracy::high: return exp2<accuracy::high>(x);
+        case accuracy::fast: return exp2<accuracy::fast>(x);
+        default: return std::exp2(x);
+        }
+    }
+
+    // block form, the loop body is branch free so it vectorises
+    template<accuracy A>
+    void sin_poly_block(const FTYPE* in, FTYPE* out, int n)
+    {
+        for (int i = 0; i < n; i++)
+            out[i] = sin_poly<A>(in[i]);
+    }
+
+}
+
+#endif /* ifndef FASTMATH_H */
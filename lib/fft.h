@@ -2,10 +2,78 @@
 #ifndef FFT_H
 #define FFT_H
 
+#include <algorithm>
+#include <cmath>
 #include <complex>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "tablecache.h"
 
 // declarations
 const double FFT_PI = std::atan(1.0) * 4;
+
+enum class fft_algorithm
+{
+    radix2,         // powers of two, in place
+    mixed,          // products of 2, 3, 4 and 5
+    bluestein       // anything else, as a convolution through a mixed radix plan
+};
+
+/**
+ * Precomputed tables for an fft of any size. Powers of two use the in-place
+ * radix-2 butterflies and never allocate. Other sizes run out of a per thread
+ * workspace, which grows once on the first call from each thread.
+ *
+ * The transforms read the tables through the p* pointers, which point into
+ * the table cache when one is installed and has the size, and into the
+ * vectors otherwise.
+ */
+struct fft_plan
+{
+    int nSize;
+    fft_algorithm eAlgorithm;
+
+    // radix-2
+    std::vector<std::complex<double>> vTwiddles;
+    std::vector<int> vBitReverse;
+
+    // mixed radix, stage s combines vRadices[s] transforms, input is read in vPermutation order
+    std::vector<int> vRadices;
+    std::vector<int> vPermutation;
+    std::vector<std::complex<double>> vStageTwiddles;
+
+    // bluestein
+    std::vector<std::complex<double>> vChirp;
+    std::vector<std::complex<double>> vChirpSpectrum;
+    std::unique_ptr<fft_plan> pInner;
+
+    const std::complex<double>* pTwiddles = nullptr;
+    const int* pBitReverse = nullptr;
+    const int* pPermutation = nullptr;
+    const std::complex<double>* pStageTwiddles = nullptr;
+    const std::complex<double>* pChirp = nullptr;
+    const std::complex<double>* pChirpSpectrum = nullptr;
+
+    fft_plan(int nBufSize);
+    void forward(std::complex<double> *x) const;
+    void inverse(std::complex<double> *x) const;    // includes the 1/n scaling
+    size_t stage_twiddle_count() const;
+
+private:
+    void forward_radix2(std::complex<double> *x) const;
+    void forward_mixed(std::complex<double> *x, std::complex<double> *work) const;
+    void forward_bluestein(std::complex<double> *x, std::complex<double> *work) const;
+};
+
+const fft_plan& fft_get_plan(int nBufSize);
+bool fft_is_pow2(int nBufSize);
+int fft_good_size(int nMinSize);
+const char* fft_algorithm_name(fft_algorithm a);
+void fft_cache_tables(tablecache::builder& b, const std::vector<int>& vSizes);
 void fft(double *x_in, std::complex<double> *x_out, int nBufSize);
 void fft_rec(std::complex<double> *x, int nBufSize);
 void fft_magnitude(double *in, double *out, const int nBufSize);
@@ -22,32 +90,372 @@ void fft(double *x_in, std::complex<double> *x_out, int nBufSize)
     fft_rec(x_out, nBufSize);
 }
 
+// kept for callers of the old recursive version, any size now goes through a cached plan
 void fft_rec(std::complex<double> *x, int nBufSize)
 {
     if (nBufSize <= 1) return;
+    fft_get_plan(nBufSize).forward(x);
+}
 
-    // fft
-    std::complex<double> *odd = new std::complex<double>[nBufSize / 2];
-    std::complex<double> *even = new std::complex<double>[nBufSize / 2];
-    for (int i = 0; i < nBufSize / 2; i++)
+bool fft_is_pow2(int nBufSize)
+{
+    return nBufSize > 0 && (nBufSize & (nBufSize - 1)) == 0;
+}
+
+// the smallest size of at least nMinSize that runs on the mixed radix path
+int fft_good_size(int nMinSize)
+{
+    for (int n = std::max(1, nMinSize); ; n++)
+    {
+        int m = n;
+        for (int r : { 2, 3, 5 })
+            while (m % r == 0)
+                m /= r;
+        if (m == 1)
+            return n;
+    }
+}
+
+const char* fft_algorithm_name(fft_algorithm a)
+{
+    switch (a)
+    {
+    case fft_algorithm::radix2: return "Radix-2";
+    case fft_algorithm::mixed: return "Mixed Radix";
+    case fft_algorithm::bluestein: return "Bluestein";
+    }
+    return "";
+}
+
+// plain complex multiply, std::complex operator* adds inf/nan recovery on every call
+inline std::complex<double> fft_mul(const std::complex<double>& a, const std::complex<double>& b)
+{
+    return std::complex<double>(a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real());
+}
+
+// scratch for the sizes that cannot work in place, per thread, slot 1 is bluestein's so its inner plan can use slot 0
+std::complex<double>* fft_workspace(size_t nSize, int nSlot = 0)
+{
+    thread_local std::vector<std::complex<double>> vWork[2];
+    if (vWork[nSlot].size() < nSize)
+        vWork[nSlot].resize(nSize);
+    return vWork[nSlot].data();
+}
+
+// fft.<size>.<table>
+std::string fft_table_name(int nSize, const char* sTable)
+{
+    return "fft." + std::to_string(nSize) + "." + sTable;
+}
+
+// the tables of the plans for vSizes, and of the inner plans bluestein sizes use
+void fft_cache_tables(tablecache::builder& b, const std::vector<int>& vSizes)
+{
+    std::set<int> sDone;
+    for (int nSize : vSizes)
+    {
+        fft_plan plan(nSize);
+        for (const fft_plan* p = &plan; p != nullptr && sDone.insert(p->nSize).second; p = p->pInner.get())
+        {
+            int n = p->nSize;
+            switch (p->eAlgorithm)
+            {
+            case fft_algorithm::radix2:
+                b.add(fft_table_name(n, "bit_reverse"), p->pBitReverse, sizeof(int) * n);
+                b.add(fft_table_name(n, "twiddles"), p->pTwiddles, sizeof(std::complex<double>) * (n / 2));
+                break;
+            case fft_algorithm::mixed:
+                b.add(fft_table_name(n, "permutation"), p->pPermutation, sizeof(int) * n);
+                b.add(fft_table_name(n, "stage_twiddles"), p->pStageTwiddles, sizeof(std::complex<double>) * p->stage_twiddle_count());
+                break;
+            case fft_algorithm::bluestein:
+                b.add(fft_table_name(n, "chirp"), p->pChirp, sizeof(std::complex<double>) * n);
+                b.add(fft_table_name(n, "chirp_spectrum"), p->pChirpSpectrum, sizeof(std::complex<double>) * p->pInner->nSize);
+                break;
+            }
+        }
+    }
+}
+
+fft_plan::fft_plan(int nBufSize)
+{
+    nSize = nBufSize;
+
+    int nRemaining = nSize;
+    for (int r : { 4, 2, 3, 5 })
+        while (nRemaining % r == 0 && nRemaining > 1)
+        {
+            vRadices.push_back(r);
+            nRemaining /= r;
+        }
+
+    if (fft_is_pow2(nSize))
+    {
+        eAlgorithm = fft_algorithm::radix2;
+        vRadices.clear();
+
+        pBitReverse = tablecache::lookup<int>(fft_table_name(nSize, "bit_reverse").c_str(), nSize);
+        pTwiddles = tablecache::lookup<std::complex<double>>(fft_table_name(nSize, "twiddles").c_str(), nSize / 2);
+        if (pBitReverse != nullptr && pTwiddles != nullptr)
+            return;
+
+        int nBits = 0;
+        while ((1 << nBits) < nSize)
+            nBits++;
+
+        vBitReverse.resize(nSize);
+        for (int i = 0; i < nSize; i++)
+        {
+            int r = 0;
+            for (int b = 0; b < nBits; b++)
+                if (i & (1 << b))
+                    r |= 1 << (nBits - 1 - b);
+            vBitReverse[i] = r;
+        }
+
+        vTwiddles.resize(nSize / 2);
+        for (int k = 0; k < nSize / 2; k++)
+            vTwiddles[k] = std::polar(1.0, -2 * FFT_PI * k / nSize);
+        pBitReverse = vBitReverse.data();
+        pTwiddles = vTwiddles.data();
+    }
+    else if (nRemaining == 1)
     {
-        even[i] = x[i * 2];
-        odd[i] = x[i * 2 + 1];
+        eAlgorithm = fft_algorithm::mixed;
+
+        pPermutation = tablecache::lookup<int>(fft_table_name(nSize, "permutation").c_str(), nSize);
+        pStageTwiddles = tablecache::lookup<std::complex<double>>(fft_table_name(nSize, "stage_twiddles").c_str(), stage_twiddle_count());
+        if (pPermutation != nullptr && pStageTwiddles != nullptr)
+            return;
+
+        // decimation in time: the last stage combines sub-transforms of every r-th input, each
+        // stored contiguously, so position p reads input digit-reversed in the mixed radix
+        vPermutation.resize(nSize);
+        for (int p = 0; p < nSize; p++)
+        {
+            int nIndex = 0;
+            int nStride = 1;
+            int q = p;
+            int nLength = nSize;
+            for (int s = (int)vRadices.size() - 1; s >= 0; s--)
+            {
+                int r = vRadices[s];
+                nLength /= r;
+                nIndex += (q / nLength) * nStride;
+                q %= nLength;
+                nStride *= r;
+            }
+            vPermutation[p] = nIndex;
+        }
+
+        // twiddles w_L^(j*k) for each stage, laid out [k][j - 1]
+        int nLength = 1;
+        for (int r : vRadices)
+        {
+            int nPrev = nLength;
+            nLength *= r;
+            for (int k = 0; k < nPrev; k++)
+                for (int j = 1; j < r; j++)
+                    vStageTwiddles.push_back(std::polar(1.0, -2 * FFT_PI * j * k / nLength));
+        }
+        pPermutation = vPermutation.data();
+        pStageTwiddles = vStageTwiddles.data();
     }
-    fft_rec(even, nBufSize / 2);
-    fft_rec(odd, nBufSize / 2);
+    else
+    {
+        eAlgorithm = fft_algorithm::bluestein;
+        vRadices.clear();
+
+        int nInner = fft_good_size(2 * nSize - 1);
+        pInner.reset(new fft_plan(nInner));
 
-    // dft
-    for (int k = 0; k < nBufSize / 2; k++)
+        pChirp = tablecache::lookup<std::complex<double>>(fft_table_name(nSize, "chirp").c_str(), nSize);
+        pChirpSpectrum = tablecache::lookup<std::complex<double>>(fft_table_name(nSize, "chirp_spectrum").c_str(), nInner);
+        if (pChirp != nullptr && pChirpSpectrum != nullptr)
+            return;
+
+        // chirp exp(-i pi n^2 / N), with n^2 taken mod 2N so large sizes keep their precision
+        vChirp.resize(nSize);
+        for (int n = 0; n < nSize; n++)
+        {
+            long long nSquare = ((long long)n * n) % (2ll * nSize);
+            vChirp[n] = std::polar(1.0, -FFT_PI * nSquare / nSize);
+        }
+
+        vChirpSpectrum.assign(nInner, std::complex<double>(0.0, 0.0));
+        vChirpSpectrum[0] = std::conj(vChirp[0]);
+        for (int n = 1; n < nSize; n++)
+            vChirpSpectrum[n] = vChirpSpectrum[nInner - n] = std::conj(vChirp[n]);
+        pInner->forward(vChirpSpectrum.data());
+        pChirp = vChirp.data();
+        pChirpSpectrum = vChirpSpectrum.data();
+    }
+}
+
+// entries of the mixed radix twiddle table, radix r at stage length L needs (r - 1) * L / r
+size_t fft_plan::stage_twiddle_count() const
+{
+    size_t nCount = 0;
+    int nPrev = 1;
+    for (int r : vRadices)
     {
-        std::complex<double> t = odd[k] * exp(std::complex<double>(0, -2 * FFT_PI * k / nBufSize));
-        x[k] = even[k] + t;
-        x[nBufSize / 2 + k] = even[k] - t;
+        nCount += (size_t)nPrev * (r - 1);
+        nPrev *= r;
     }
+    return nCount;
+}
+
+void fft_plan::forward(std::complex<double> *x) const
+{
+    switch (eAlgorithm)
+    {
+    case fft_algorithm::radix2: forward_radix2(x); break;
+    case fft_algorithm::mixed: forward_mixed(x, fft_workspace(nSize)); break;
+    case fft_algorithm::bluestein: forward_bluestein(x, fft_workspace(pInner->nSize, 1)); break;
+    }
+}
+
+void fft_plan::forward_radix2(std::complex<double> *x) const
+{
+    for (int i = 0; i < nSize; i++)
+        if (i < pBitReverse[i])
+            std::swap(x[i], x[pBitReverse[i]]);
 
-    // cleanup
-    delete[] odd;
-    delete[] even;
+    for (int nLen = 2; nLen <= nSize; nLen <<= 1)
+    {
+        int nHalf = nLen / 2;
+        int nStride = nSize / nLen;
+        for (int i = 0; i < nSize; i += nLen)
+        {
+            for (int k = 0; k < nHalf; k++)
+            {
+                std::complex<double> t = fft_mul(x[i + k + nHalf], pTwiddles[k * nStride]);
+                x[i + k + nHalf] = x[i + k] - t;
+                x[i + k] += t;
+            }
+        }
+    }
+}
+
+void fft_plan::forward_mixed(std::complex<double> *x, std::complex<double> *work) const
+{
+    typedef std::complex<double> cd;
+    for (int p = 0; p < nSize; p++)
+        work[p] = x[pPermutation[p]];
+
+    const double S3 = std::sqrt(3.0) / 2.0;
+    const double C51 = std::cos(2 * FFT_PI / 5), C52 = std::cos(4 * FFT_PI / 5);
+    const double S51 = std::sin(2 * FFT_PI / 5), S52 = std::sin(4 * FFT_PI / 5);
+
+    // -i * z
+    auto rot = [](const cd& z) { return cd(z.imag(), -z.real()); };
+
+    const cd* tw = pStageTwiddles;
+    int nPrev = 1;
+    for (int r : vRadices)
+    {
+        int nLength = nPrev * r;
+        for (int i = 0; i < nSize; i += nLength)
+        {
+            cd* b = work + i;
+            for (int k = 0; k < nPrev; k++)
+            {
+                const cd* w = tw + k * (r - 1);
+                cd a0 = b[k];
+                cd a1 = k == 0 ? b[k + nPrev] : fft_mul(b[k + nPrev], w[0]);
+                switch (r)
+                {
+                case 2:
+                    b[k] = a0 + a1;
+                    b[k + nPrev] = a0 - a1;
+                    break;
+                case 3:
+                {
+                    cd a2 = k == 0 ? b[k + 2 * nPrev] : fft_mul(b[k + 2 * nPrev], w[1]);
+                    cd t1 = a1 + a2;
+                    cd t2 = a0 - 0.5 * t1;
+                    cd t3 = rot(S3 * (a1 - a2));
+                    b[k] = a0 + t1;
+                    b[k + nPrev] = t2 + t3;
+                    b[k + 2 * nPrev] = t2 - t3;
+                    break;
+                }
+                case 4:
+                {
+                    cd a2 = k == 0 ? b[k + 2 * nPrev] : fft_mul(b[k + 2 * nPrev], w[1]);
+                    cd a3 = k == 0 ? b[k + 3 * nPrev] : fft_mul(b[k + 3 * nPrev], w[2]);
+                    cd t0 = a0 + a2, t1 = a0 - a2;
+                    cd t2 = a1 + a3, t3 = rot(a1 - a3);
+                    b[k] = t0 + t2;
+                    b[k + nPrev] = t1 + t3;
+                    b[k + 2 * nPrev] = t0 - t2;
+                    b[k + 3 * nPrev] = t1 - t3;
+                    break;
+                }
+                case 5:
+                {
+                    cd a2 = k == 0 ? b[k + 2 * nPrev] : fft_mul(b[k + 2 * nPrev], w[1]);
+                    cd a3 = k == 0 ? b[k + 3 * nPrev] : fft_mul(b[k + 3 * nPrev], w[2]);
+                    cd a4 = k == 0 ? b[k + 4 * nPrev] : fft_mul(b[k + 4 * nPrev], w[3]);
+                    cd b1 = a1 + a4, b2 = a2 + a3;
+                    cd d1 = a1 - a4, d2 = a2 - a3;
+                    cd t1 = a0 + C51 * b1 + C52 * b2;
+                    cd t2 = a0 + C52 * b1 + C51 * b2;
+                    cd u1 = rot(S51 * d1 + S52 * d2);
+                    cd u2 = rot(S52 * d1 - S51 * d2);
+                    b[k] = a0 + b1 + b2;
+                    b[k + nPrev] = t1 + u1;
+                    b[k + 4 * nPrev] = t1 - u1;
+                    b[k + 2 * nPrev] = t2 + u2;
+                    b[k + 3 * nPrev] = t2 - u2;
+                    break;
+                }
+                }
+            }
+        }
+        tw += nPrev * (r - 1);
+        nPrev = nLength;
+    }
+
+    std::copy(work, work + nSize, x);
+}
+
+void fft_plan::forward_bluestein(std::complex<double> *x, std::complex<double> *work) const
+{
+    int nInner = pInner->nSize;
+    for (int n = 0; n < nSize; n++)
+        work[n] = fft_mul(x[n], pChirp[n]);
+    std::fill(work + nSize, work + nInner, std::complex<double>(0.0, 0.0));
+
+    pInner->forward(work);
+    for (int k = 0; k < nInner; k++)
+        work[k] = fft_mul(work[k], pChirpSpectrum[k]);
+    pInner->inverse(work);
+
+    for (int k = 0; k < nSize; k++)
+        x[k] = fft_mul(work[k], pChirp[k]);
+}
+
+void fft_plan::inverse(std::complex<double> *x) const
+{
+    for (int i = 0; i < nSize; i++)
+        x[i] = std::conj(x[i]);
+    forward(x);
+    double dScale = 1.0 / nSize;
+    for (int i = 0; i < nSize; i++)
+        x[i] = std::conj(x[i]) * dScale;
+}
+
+// plans are built once per size and live for the rest of the program
+const fft_plan& fft_get_plan(int nBufSize)
+{
+    static std::map<int, std::unique_ptr<fft_plan>> mPlans;
+    static std::mutex muxPlans;
+    std::unique_lock<std::mutex> lm(muxPlans);
+    auto& p = mPlans[nBufSize];
+    if (p == nullptr)
+        p.reset(new fft_plan(nBufSize));
+    return *p;
 }
 
 void fft_magnitude(double *in, double *out, const int nBufSize)
@@ -0,0 +1,254 @@
+#pragma once
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "spectrum.h"
+
+/**
+ * Visualiser drawing that does not need a window. The oscilloscope and
+ * spectrum traces are written against any target with line() and fill(), so
+ * the live app draws them on the PGE screen and offline exports draw the same
+ * pictures into a canvas, an RGB pixel buffer that is written out as PPM
+ * images or raw rgb24 video.
+ *
+ * render_parallel() spreads frames across threads. Each frame only depends on
+ * its own audio window, so workers render into a ring of canvases while the
+ * calling thread writes them out in order.
+ */
+namespace frames
+{
+
+    struct color
+    {
+        uint8_t r = 0, g = 0, b = 0;
+    };
+
+    const color BLACK = { 0, 0, 0 };
+    const color RED = { 255, 0, 0 };
+    const color YELLOW = { 255, 255, 0 };
+
+
+    // 24 bit RGB, rows top to bottom, clipped drawing
+    class canvas
+    {
+    private:
+        int nWidth = 0;
+        int nHeight = 0;
+        std::vector<uint8_t> vPixels;
+
+    public:
+        canvas() {}
+        canvas(int w, int h)
+        {
+            resize(w, h);
+        }
+
+        void resize(int w, int h)
+        {
+            nWidth = w;
+            nHeight = h;
+            vPixels.assign((size_t)w * h * 3, 0);
+        }
+
+        int width() const { return nWidth; }
+        int height() const { return nHeight; }
+        const uint8_t* data() const { return vPixels.data(); }
+        size_t bytes() const { return vPixels.size(); }
+
+        void clear(color c)
+        {
+            for (size_t i = 0; i < vPixels.size(); i += 3)
+            {
+                vPixels[i] = c.r;
+                vPixels[i + 1] = c.g;
+                vPixels[i + 2] = c.b;
+            }
+        }
+
+        void pixel(int x, int y, color c)
+        {
+            if (x < 0 || y < 0 || x >= nWidth || y >= nHeight) return;
+            uint8_t* p = &vPixels[((size_t)y * nWidth + x) * 3];
+            p[0] = c.r;
+            p[1] = c.g;
+            p[2] = c.b;
+        }
+
+        // bresenham, both ends included like olc::PixelGameEngine::DrawLine
+        void line(int x0, int y0, int x1, int y1, color c)
+        {
+            int dx = std::abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+            int dy = -std::abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+            int e = dx + dy;
+            while (true)
+            {
+                pixel(x0, y0, c);
+                if (x0 == x1 && y0 == y1) break;
+                int e2 = 2 * e;
+                if (e2 >= dy) { e += dy; x0 += sx; }
+                if (e2 <= dx) { e += dx; y0 += sy; }
+            }
+        }
+
+        void fill(int x, int y, int w, int h, color c)
+        {
+            int x0 = std::max(0, x), x1 = std::min(nWidth, x + w);
+            int y0 = std::max(0, y), y1 = std::min(nHeight, y + h);
+            for (int j = y0; j < y1; j++)
+                for (int i = x0; i < x1; i++)
+                    pixel(i, j, c);
+        }
+    };
+
+
+    // binary PPM (P6), readable by ffmpeg and most image tools
+    bool write_ppm(const std::string& sPath, const canvas& img)
+    {
+        FILE* f = fopen(sPath.c_str(), "wb");
+        if (f == nullptr) return false;
+        bool bOk = fprintf(f, "P6\n%d %d\n255\n", img.width(), img.height()) > 0;
+        bOk = bOk && fwrite(img.data(), 1, img.bytes(), f) == img.bytes();
+        return fclose(f) == 0 && bOk;
+    }
+
+    // one rgb24 frame to a stream, for piping into ffmpeg -f rawvideo
+    bool write_raw(FILE* f, const canvas& img)
+    {
+        return fwrite(img.data(), 1, img.bytes(), f) == img.bytes();
+    }
+
+
+    // one min/max column per pixel, widened to meet the previous column so the trace stays connected
+    template <class Target>
+    void draw_scope(Target& target, const float* pMin, const float* pMax, int nWidth, int yOffset, int yScale, color c)
+    {
+        for (int x = 0; x < nWidth; x++)
+        {
+            float lo = pMin[x];
+            float hi = pMax[x];
+            if (x != 0)
+            {
+                lo = std::min(lo, pMax[x - 1]);
+                hi = std::max(hi, pMin[x - 1]);
+            }
+            target.line(x, (int)(lo * yScale) + yOffset, x, (int)(hi * yScale) + yOffset, c);
+        }
+    }
+
+    /**
+     * Magnitude spectrum on a log frequency axis, as a trace or as fractional
+     * octave bars. The maps are rebuilt when the width or fft size change and
+     * vValues is scratch, so each thread drawing spectra needs its own.
+     */
+    template <class Target>
+    void draw_spectrum(Target& target, const double* mag, int nFFTSize, double dSampleRate, int nWidth, int yOffset, int yScale, color c,
+        spectrum::aggregate eAggregate, spectrum::bands eBands, spectrum::column_map& columns, spectrum::band_map& bandMap, std::vector<double>& vValues)
+    {
+        columns.rebuild(nWidth, nFFTSize, dSampleRate);
+        bandMap.rebuild(eBands, nFFTSize, dSampleRate);
+
+        if (eBands != spectrum::bands::none)
+        {
+            vValues.resize(bandMap.count());
+            bandMap.apply(mag, vValues.data(), eAggregate);
+            for (int b = 0; b < bandMap.count(); b++)
+            {
+                int x0 = (int)columns.column_of(bandMap.lower(b));
+                int x1 = (int)columns.column_of(bandMap.upper(b));
+                int y = (int)(-vValues[b] * 0.005 * yScale + yOffset);
+                target.fill(x0 + 1, y, std::max(1, x1 - x0 - 1), yOffset - y, c);
+            }
+            return;
+        }
+
+        vValues.resize(columns.columns());
+        columns.apply(mag, vValues.data(), eAggregate);
+        int xPrev = 0, yPrev = 0;
+        for (int x = 0; x < nWidth; x++)
+        {
+            int y = (int)(-vValues[x] * 0.005 * yScale + yOffset);
+            if (x != 0)
+                target.line(xPrev, yPrev, x, y, c);
+            xPrev = x;
+            yPrev = y;
+        }
+    }
+
+
+    /**
+     * Renders nFrames frames of nWidth x nHeight on nThreads workers and hands
+     * them to write() in order on the calling thread. render(frame, worker,
+     * canvas) must only touch state of its own worker index. Stops early and
+     * returns false when write() does.
+     */
+    template <class Render, class Write>
+    bool render_parallel(int nFrames, int nWidth, int nHeight, int nThreads, Render render, Write write)
+    {
+        nThreads = std::max(1, nThreads);
+        const int nSlots = 2 * nThreads;
+        std::vector<canvas> vSlots(nSlots);
+        for (auto& s : vSlots)
+            s.resize(nWidth, nHeight);
+        std::vector<int> vReady(nSlots, -1);   // frame in each slot once rendered
+
+        std::mutex mux;
+        std::condition_variable cv;
+        int nNext = 0;
+        int nWritten = 0;
+        bool bAbort = false;
+
+        auto worker = [&](int nWorker)
+        {
+            while (true)
+            {
+                int f;
+                {
+                    std::unique_lock<std::mutex> lm(mux);
+                    cv.wait(lm, [&] { return bAbort || nNext >= nFrames || nNext < nWritten + nSlots; });
+                    if (bAbort || nNext >= nFrames) return;
+                    f = nNext++;
+                }
+                render(f, nWorker, vSlots[f % nSlots]);
+                {
+                    std::unique_lock<std::mutex> lm(mux);
+                    vReady[f % nSlots] = f;
+                }
+                cv.notify_all();
+            }
+        };
+
+        std::vector<std::thread> vWorkers;
+        for (int t = 0; t < nThreads; t++)
+            vWorkers.emplace_back(worker, t);
+
+        for (int f = 0; f < nFrames && !bAbort; f++)
+        {
+            {
+                std::unique_lock<std::mutex> lm(mux);
+                cv.wait(lm, [&] { return vReady[f % nSlots] == f; });
+            }
+            bool bOk = write(f, (const canvas&)vSlots[f % nSlots]);
+            {
+                std::unique_lock<std::mutex> lm(mux);
+                nWritten = f + 1;
+                bAbort = !bOk;
+            }
+            cv.notify_all();
+        }
+
+        for (auto& t : vWorkers)
+            t.join();
+        return !bAbort;
+    }
+
+}
+
+#endif /* ifndef FRAMES_H */
@@ -0,0 +1,177 @@
+#pragma once
+#ifndef GOLDEN_H
+#define GOLDEN_H
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "fft.h"
+
+namespace golden
+{
+
+    /**
+     * Tolerances for comparing a render against its reference buffer. A zero
+     * dMaxAbsError asks for a bit exact match.
+     */
+    struct tolerance
+    {
+        double dMaxAbsError = 1e-9;
+        double dMinSnrDb = 120.0;
+        double dMaxSpectralDb = 0.5;    // largest magnitude difference in any band above the floor
+        double dSpectralFloorDb = -90.0;
+    };
+
+    struct report
+    {
+        double dMaxAbsError = 0.0;
+        double dSnrDb = 0.0;
+        double dSpectralDb = 0.0;
+        bool bLengthMatch = true;
+        bool bPass = false;
+    };
+
+
+    // magnitude spectrum (dB re full scale) of frame sized chunks, averaged
+    void average_spectrum(const double* in, int nCount, int nFrame, std::vector<double>& vOut)
+    {
+        const fft_plan& plan = fft_get_plan(nFrame);
+        std::vector<std::complex<double>> c(nFrame);
+        std::vector<double> vPower(nFrame / 2, 0.0);
+        int nFrames = 0;
+        for (int start = 0; start + nFrame <= nCount; start += nFrame, nFrames++)
+        {
+            for (int i = 0; i < nFrame; i++)
+                c[i] = std::complex<double>(in[start + i] * (0.5 - 0.5 * cos(2.0 * FFT_PI * i / nFrame)), 0.0);
+            plan.forward(c.data());
+            for (int i = 0; i < nFrame / 2; i++)
+                vPower[i] += std::norm(c[i]);
+        }
+        vOut.resize(nFrame / 2);
+        for (int i = 0; i < nFrame / 2; i++)
+            vOut[i] = 10.0 * log10(vPower[i] / std::max(1, nFrames) * 16.0 / ((double)nFrame * nFrame) + 1e-30);
+    }
+
+    report compare(const std::vector<double>& vReference, const std::vector<double>& vOutput, const tolerance& tol = tolerance())
+    {
+        report r;
+        r.bLengthMatch = vReference.size() == vOutput.size();
+        size_t n = std::min(vReference.size(), vOutput.size());
+
+        double dSignal = 0.0;
+        double dNoise = 0.0;
+        for (size_t i = 0; i < n; i++)
+        {
+            double e = vOutput[i] - vReference[i];
+            r.dMaxAbsError = std::max(r.dMaxAbsError, fabs(e));
+            dSignal += vReference[i] * vReference[i];
+            dNoise += e * e;
+        }
+        r.dSnrDb = dNoise > 0.0 ? 10.0 * log10(dSignal / dNoise) : 999.0;
+
+        const int nFrame = 4096;
+        if (n >= (size_t)nFrame)
+        {
+            std::vector<double> a, b;
+            average_spectrum(vReference.data(), (int)n, nFrame, a);
+            average_spectrum(vOutput.data(), (int)n, nFrame, b);
+            for (int i = 0; i < nFrame / 2; i++)
+                if (a[i] > tol.dSpectralFloorDb || b[i] > tol.dSpectralFloorDb)
+                    r.dSpectralDb = std::max(r.dSpectralDb, fabs(a[i] - b[i]));
+        }
+
+        r.bPass = r.bLengthMatch
+            && r.dMaxAbsError <= tol.dMaxAbsError
+            && (r.dMaxAbsError == 0.0 || r.dSnrDb >= tol.dMinSnrDb)
+            && r.dSpectralDb <= tol.dMaxSpectralDb;
+        return r;
+    }
+
+
+    // O(n^2) reference transform the fft implementations are checked against
+    void naive_dft(const double* in, std::complex<double>* out, int nSize)
+    {
+        for (int k = 0; k < nSize; k++)
+        {
+            std::complex<double> s = 0.0;
+            for (int n = 0; n < nSize; n++)
+                s += in[n] * std::polar(1.0, -2.0 * FFT_PI * (double)((int64_t)k * n % nSize) / nSize);
+            out[k] = s;
+        }
+    }
+
+    // largest error of fft_magnitude against the naive dft, relative to the peak bin
+    double check_fft_magnitude(int nSize)
+    {
+        std::vector<double> vIn(nSize), vFast(nSize / 2);
+        std::vector<std::complex<double>> vSlow(nSize);
+        uint32_t seed = 12345;
+        for (int i = 0; i < nSize; i++)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            vIn[i] = sin(i * 0.3) + 0.5 * ((seed >> 8) / (double)(1 << 24) - 0.5);
+        }
+        fft_magnitude(vIn.data(), vFast.data(), nSize);
+        naive_dft(vIn.data(), vSlow.data(), nSize);
+
+        double dPeak = 0.0, dError = 0.0;
+        for (int i = 0; i < nSize / 2; i++)
+        {
+            dPeak = std::max(dPeak, std::abs(vSlow[i]));
+            dError = std::max(dError, fabs(vFast[i] - std::abs(vSlow[i])));
+        }
+        return dError / std::max(dPeak, 1e-30);
+    }
+
+
+    // reference buffers are stored as a small header followed by raw little endian doubles
+    struct header
+    {
+        char magic[4];
+        uint32_t nVersion;
+        uint32_t nSampleRate;
+        uint32_t nChannels;
+        uint64_t nSamples;
+    };
+
+    bool save(const std::string& sPath, const std::vector<double>& vBuffer, int nSampleRate, int nChannels = 1)
+    {
+        FILE* f = fopen(sPath.c_str(), "wb");
+        if (f == nullptr) return false;
+        header h;
+        memcpy(h.magic, "GOLD", 4);
+        h.nVersion = 1;
+        h.nSampleRate = nSampleRate;
+        h.nChannels = nChannels;
+        h.nSamples = vBuffer.size();
+        bool bOk = fwrite(&h, sizeof(h), 1, f) == 1
+            && fwrite(vBuffer.data(), sizeof(double), vBuffer.size(), f) == vBuffer.size();
+        fclose(f);
+        return bOk;
+    }
+
+    bool load(const std::string& sPath, std::vector<double>& vBuffer, int& nSampleRate, int& nChannels)
+    {
+        FILE* f = fopen(sPath.c_str(), "rb");
+        if (f == nullptr) return false;
+        header h;
+        bool bOk = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, "GOLD", 4) == 0 && h.nVersion == 1;
+        if (bOk)
+        {
+            vBuffer.resize((size_t)h.nSamples);
+            bOk = fread(vBuffer.data(), sizeof(double), vBuffer.size(), f) == vBuffer.size();
+            nSampleRate = (int)h.nSampleRate;
+            nChannels = (int)h.nChannels;
+        }
+        fclose(f);
+        return bOk;
+    }
+
+}
+
+#endif /* ifndef GOLDEN_H */
@@ -0,0 +1,730 @@
+#pragma once
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "sfx.h"
+#include "param.h"
+#include "oversample.h"
+
+/**
+ * Block based signal graph. Nodes are described on the ui thread, compiled
+ * into a flat plan (topological order, disabled nodes folded away, unused
+ * nodes dropped, intermediate buffers shared from a pool by liveness) and
+ * handed to the audio thread by swapping a pointer. The audio thread never
+ * locks, allocates or frees.
+ *
+ * Every buffer is one block of nFrames interleaved frames of nChans samples.
+ */
+namespace graph
+{
+
+    class node
+    {
+    public:
+        virtual ~node() {}
+
+        // pOut may alias ppIn[0] when in_place() is true
+        virtual void process(int nChans, int nFrames, FTYPE dTime, FTYPE* const* ppIn, int nInputs, FTYPE* pOut) = 0;
+
+        // whether the node can write its output over its first input
+        virtual bool in_place() const { return true; }
+
+        // called on the audio thread when a plan without this node goes live
+        virtual void reset() {}
+    };
+
+
+    // copies the first input to the output unless they are already the same buffer
+    void pass_through(int nChans, int nFrames, FTYPE* const* ppIn, int nInputs, FTYPE* pOut)
+    {
+        if (nInputs == 0)
+            std::fill(pOut, pOut + nChans * nFrames, 0.0);
+        else if (ppIn[0] != pOut)
+            memcpy(pOut, ppIn[0], sizeof(FTYPE) * nChans * nFrames);
+    }
+
+
+    struct step
+    {
+        node* pNode;
+        FTYPE* pOut;
+        int nFirstInput;
+        int nInputs;
+    };
+
+    class plan
+    {
+    public:
+        int nChans = 0;
+        int nMaxFrames = 0;
+        int nBuffers = 0;
+        sfx::aligned_buffer<FTYPE> vMemory;
+        std::vector<step> vSteps;
+        std::vector<FTYPE*> vInputs;
+        std::vector<node*> vReset;      // nodes this plan does not run
+        FTYPE* pOutput = nullptr;       // nullptr when the output is silent
+        bool bStarted = false;
+
+        void process(int nFrames, FTYPE* samples, FTYPE dTime)
+        {
+            if (!bStarted)
+            {
+                for (auto p : vReset)
+                    p->reset();
+                bStarted = true;
+            }
+
+            for (auto& s : vSteps)
+                s.pNode->process(nChans, nFrames, dTime, vInputs.data() + s.nFirstInput, s.nInputs, s.pOut);
+
+            if (pOutput != nullptr)
+                memcpy(samples, pOutput, sizeof(FTYPE) * nChans * nFrames);
+            else
+                std::fill(samples, samples + nChans * nFrames, 0.0);
+        }
+    };
+
+
+    class graph
+    {
+    private:
+        struct entry
+        {
+            std::unique_ptr<node> pNode;
+            std::vector<int> vInputs;
+            bool bEnabled = true;
+            bool bSink = false;
+        };
+
+        int nChans;
+        int nMaxFrames;
+        FTYPE dTimeStep;
+        std::vector<entry> vNodes;
+        int nOutput = -1;
+        bool bDirty = true;
+
+        // audio thread only
+        plan* pCurrent = nullptr;
+
+        // hand over between the threads, the ui thread owns anything in these
+        static const int RETIRE_SLOTS = 8;
+        std::atomic<plan*> pPending{ nullptr };
+        std::atomic<plan*> vRetired[RETIRE_SLOTS];
+
+    public:
+        graph(int nChannels, int nMaxBlockFrames, int nSampleRate)
+        {
+            nChans = nChannels;
+            nMaxFrames = nMaxBlockFrames;
+            dTimeStep = 1.0 / (FTYPE)nSampleRate;
+            for (auto& r : vRetired)
+                r.store(nullptr);
+        }
+
+        graph(const graph&) = delete;
+        graph& operator=(const graph&) = delete;
+
+        // only safe once the audio thread has stopped calling process()
+        ~graph()
+        {
+            collect();
+            delete pPending.exchange(nullptr);
+            delete pCurrent;
+        }
+
+
+        // ui thread: describing the graph, nothing takes effect until commit()
+
+        // takes ownership of pNode, returns its id
+        int add(node* pNode, const std::vector<int>& vInputs = {})
+        {
+            entry e;
+            e.pNode.reset(pNode);
+            e.vInputs = vInputs;
+            vNodes.push_back(std::move(e));
+            bDirty = true;
+            return (int)vNodes.size() - 1;
+        }
+
+        void set_inputs(int id, const std::vector<int>& vInputs)
+        {
+            vNodes[id].vInputs = vInputs;
+            bDirty = true;
+        }
+
+        // a disabled node passes its first input through, or is silent if it has none
+        void set_enabled(int id, bool bEnabled)
+        {
+            if (vNodes[id].bEnabled == bEnabled) return;
+            vNodes[id].bEnabled = bEnabled;
+            bDirty = true;
+        }
+
+        bool enabled(int id) const
+        {
+            return vNodes[id].bEnabled;
+        }
+
+        // sinks run even when nothing reads their output (meters, taps on a branch)
+        void set_sink(int id, bool bSink)
+        {
+            vNodes[id].bSink = bSink;
+            bDirty = true;
+        }
+
+        void set_output(int id)
+        {
+            nOutput = id;
+            bDirty = true;
+        }
+
+        node* get(int id)
+        {
+            return vNodes[id].pNode.get();
+        }
+
+
+        /**
+         * Builds an execution plan from the current description. Returns
+         * nullptr if the graph has a cycle.
+         */
+        plan* compile() const
+        {
+            int n = (int)vNodes.size();
+
+            // a disabled node only reads its first input
+            auto used_inputs = [&](int k) -> int
+            {
+                const entry& e = vNodes[k];
+                return e.bEnabled ? (int)e.vInputs.size() : std::min(1, (int)e.vInputs.size());
+            };
+
+            // live nodes are the ones the output or a sink depends on
+            std::vector<bool> vLive(n, false);
+            std::vector<int> vStack;
+            for (int k = 0; k < n; k++)
+                if (k == nOutput || vNodes[k].bSink)
+                    vStack.push_back(k);
+            while (!vStack.empty())
+            {
+                int k = vStack.back();
+                vStack.pop_back();
+                if (vLive[k]) continue;
+                vLive[k] = true;
+                for (int i = 0; i < used_inputs(k); i++)
+                    vStack.push_back(vNodes[k].vInputs[i]);
+            }
+
+            // topological order of the live nodes, ties broken by id so plans are stable
+            std::vector<int> vPending(n, 0);
+            std::vector<std::vector<int>> vReaders(n);
+            for (int k = 0; k < n; k++)
+            {
+                if (!vLive[k]) continue;
+                for (int i = 0; i < used_inputs(k); i++)
+                {
+                    vPending[k]++;
+                    vReaders[vNodes[k].vInputs[i]].push_back(k);
+                }
+            }
+            std::vector<int> vOrder;
+            std::vector<int> vReady;
+            for (int k = n - 1; k >= 0; k--)
+                if (vLive[k] && vPending[k] == 0)
+                    vReady.push_back(k);
+            while (!vReady.empty())
+            {
+                int k = vReady.back();
+                vReady.pop_back();
+                vOrder.push_back(k);
+                for (int r : vReaders[k])
+                    if (--vPending[r] == 0)
+                    {
+                        vReady.push_back(r);
+                        std::sort(vReady.begin(), vReady.end(), std::greater<int>());
+                    }
+            }
+            if ((int)vOrder.size() != (int)std::count(vLive.begin(), vLive.end(), true))
+                return nullptr;
+
+            // disabled nodes are folded into whatever they pass through, -1 is silence
+            std::vector<int> vSource(n, -1);
+            for (int k : vOrder)
+            {
+                const entry& e = vNodes[k];
+                if (e.bEnabled)
+                    vSource[k] = k;
+                else if (!e.vInputs.empty())
+                    vSource[k] = vSource[e.vInputs[0]];
+            }
+
+            // position in vOrder of the last step reading each value, n for the output
+            std::vector<int> vLastUse(n, -1);
+            for (int s = 0; s < (int)vOrder.size(); s++)
+            {
+                int k = vOrder[s];
+                if (!vNodes[k].bEnabled) continue;
+                for (int in : vNodes[k].vInputs)
+                    if (vSource[in] >= 0)
+                        vLastUse[vSource[in]] = s;
+            }
+            if (nOutput >= 0 && vSource[nOutput] >= 0)
+                vLastUse[vSource[nOutput]] = n;
+
+            // assign buffers, reusing any whose value is dead
+            plan* p = new plan();
+            p->nChans = nChans;
+            p->nMaxFrames = nMaxFrames;
+            std::vector<int> vBuffer(n, -1);
+            std::vector<int> vFree;
+            const int ZERO = 0;     // shared silent input, never written
+            bool bNeedZero = false;
+            int nBuffers = 1;
+            std::vector<std::pair<int, std::vector<int>>> vStepBuffers;
+
+            for (int s = 0; s < (int)vOrder.size(); s++)
+            {
+                int k = vOrder[s];
+                const entry& e = vNodes[k];
+                if (!e.bEnabled) continue;
+
+                std::vector<int> vIn;
+                for (int in : e.vInputs)
+                {
+                    int src = vSource[in];
+                    vIn.push_back(src >= 0 ? vBuffer[src] : ZERO);
+                    bNeedZero |= src < 0;
+                }
+
+                // write over the first input if this is its last reader and it is not read twice
+                int nOut = -1;
+                if (!vIn.empty() && vIn[0] != ZERO && e.pNode->in_place() && vLastUse[vSource[e.vInputs[0]]] == s
+                    && std::count(vIn.begin(), vIn.end(), vIn[0]) == 1)
+                    nOut = vIn[0];
+                else if (!vFree.empty())
+                {
+                    nOut = vFree.back();
+                    vFree.pop_back();
+                }
+                else
+                    nOut = nBuffers++;
+                vBuffer[k] = nOut;
+
+                for (int in : e.vInputs)
+                {
+                    int src = vSource[in];
+                    if (src >= 0 && vLastUse[src] == s && vBuffer[src] != nOut
+                        && std::find(vFree.begin(), vFree.end(), vBuffer[src]) == vFree.end())
+                        vFree.push_back(vBuffer[src]);
+                }
+                if (vLastUse[k] < 0 && nOut != ZERO)
+                    vFree.push_back(nOut);      // nobody reads it, a sink
+
+                vStepBuffers.push_back({ k, vIn });
+            }
+
+            size_t nStride = (size_t)nChans * nMaxFrames;
+            p->nBuffers = nBuffers - (bNeedZero ? 0 : 1);
+            p->vMemory.allocate(nStride * nBuffers);     // the zero buffer is always there, it costs one block
+            FTYPE* pBase = p->vMemory.data();
+            for (auto& sb : vStepBuffers)
+            {
+                step st;
+                st.pNode = vNodes[sb.first].pNode.get();
+                st.pOut = pBase + nStride * vBuffer[sb.first];
+                st.nFirstInput = (int)p->vInputs.size();
+                st.nInputs = (int)sb.second.size();
+                for (int b : sb.second)
+                    p->vInputs.push_back(pBase + nStride * b);
+                p->vSteps.push_back(st);
+            }
+            if (nOutput >= 0 && vSource[nOutput] >= 0)
+                p->pOutput = pBase + nStride * vBuffer[vSource[nOutput]];
+
+            for (int k = 0; k < n; k++)
+                if (!vLive[k] || !vNodes[k].bEnabled)
+                    p->vReset.push_back(vNodes[k].pNode.get());
+            return p;
+        }
+
+
+        /**
+         * Compiles and publishes the description if it changed. The audio
+         * thread picks the plan up at its next block. Returns false if the
+         * graph could not be compiled, the previous plan stays live.
+         */
+        bool commit()
+        {
+            collect();
+            if (!bDirty) return true;
+            plan* p = compile();
+            if (p == nullptr) return false;
+            delete pPending.exchange(p);    // a plan never picked up is still ours
+            bDirty = false;
+            return true;
+        }
+
+        // frees plans the audio thread has finished with
+        void collect()
+        {
+            for (auto& r : vRetired)
+                delete r.exchange(nullptr);
+        }
+
+
+        // audio thread: renders nFrames interleaved frames into samples
+        void process(int nFrames, FTYPE* samples, FTYPE dTime)
+        {
+            // swap in a new plan only when there is somewhere to retire the old one
+            if (pPending.load(std::memory_order_acquire) != nullptr)
+            {
+                std::atomic<plan*>* pSlot = nullptr;
+                for (auto& r : vRetired)
+                    if (r.load(std::memory_order_acquire) == nullptr)
+                    {
+                        pSlot = &r;
+                        break;
+                    }
+                if (pSlot != nullptr)
+                {
+                    plan* p = pPending.exchange(nullptr, std::memory_order_acq_rel);
+                    if (p != nullptr)
+                    {
+                        pSlot->store(pCurrent, std::memory_order_release);
+                        pCurrent = p;
+                    }
+                }
+            }
+
+            if (pCurrent == nullptr)
+            {
+                std::fill(samples, samples + nChans * nFrames, 0.0);
+                return;
+            }
+
+            for (int nDone = 0; nDone < nFrames; nDone += nMaxFrames)
+            {
+                int nChunk = std::min(nMaxFrames, nFrames - nDone);
+                pCurrent->process(nChunk, samples + nDone * nChans, dTime + nDone * dTimeStep);
+            }
+        }
+    };
+
+
+    // nodes wrapping the existing building blocks
+
+    // per sample source with the olcNoiseMaker user function signature
+    class source_node : public node
+    {
+    private:
+        FTYPE(*func)(int, FTYPE);
+        FTYPE dTimeStep;
+
+    public:
+        source_node(FTYPE(*function)(int, FTYPE), int nSampleRate)
+        {
+            func = function;
+            dTimeStep = 1.0 / (FTYPE)nSampleRate;
+        }
+
+        void process(int nChans, int nFrames, FTYPE dTime, FTYPE* const* ppIn, int nInputs, FTYPE* pOut) override
+        {
+            for (int n = 0; n < nFrames; n++)
+                for (int c = 0; c < nChans; c++)
+                    pOut[n * nChans + c] = func(c, dTime + n * dTimeStep);
+        }
+    };
+
+    // block function with the olcNoiseMaker block signature, run in place
+    class block_node : public node
+    {
+    private:
+        void(*func)(int, int, FTYPE*, FTYPE);
+
+    public:
+        block_node(void(*function)(int, int, FTYPE*, FTYPE))
+        {
+            func = function;
+        }
+
+        void process(int nChans, int nFrames, FTYPE dTime, FTYPE* const* ppIn, int nInputs, FTYPE* pOut) override
+        {
+            pass_through(nChans, nFrames, ppIn, nInputs, pOut);
+            func(nChans, nFrames, pOut, dTime);
+        }
+    };
+
+    // sum of all inputs
+    class mix_node : public node
+    {
+    public:
+        void process(int nChans, int nFrames, FTYPE dTime, FTYPE* const* ppIn, int nInputs, FTYPE* pOut) override
+        {
+            pass_through(nChans, nFrames, ppIn, nInputs, pOut);
+            for (int i = 1; i < nInputs; i++)
+                for (int s = 0; s < nChans * nFrames; s++)
+                    pOut[s] += ppIn[i][s];
+        }
+    };
+
+    // nodes below read their settings from param::parameter, each parameter should have a single node reading it
+
+    // channels summed to mono, delayed, and written back to every channel
+    class monodelay_node : public node
+    {
+    private:
+        sfx::monodelay& delay;
+        param::parameter& time;
+        param::parameter& feedback;
+        param::parameter& mix;
+
+    public:
+        monodelay_node(sfx::monodelay& d, param::parameter& t, param::parameter& fb, param::parameter& m)
+            : delay(d), time(t), feedback(fb), mix(m) {}
+
+        void process(int nChans, int nFrames, FTYPE dBlockTime, FTYPE* const* ppIn, int nInputs, FTYPE* pOut) override
+        {
+            pass_through(nChans, nFrames, ppIn, nInputs, pOut);
+            time.begin(dBlockTime);
+            feedback.begin(dBlockTime);
+            mix.begin(dBlockTime);
+            for (int n = 0; n < nFrames; n++)
+            {
+                FTYPE* frame = pOut + n * nChans;
+                FTYPE dSummed = 0.0;
+                for (int c = 0; c < nChans; c++)
+                    dSummed += frame[c];
+                dSummed = dSummed / (FTYPE)nChans;
+                FTYPE dTime = time.next();
+                FTYPE dFeedback = feedback.next();
+                float fMix = (float)mix.next();
+                delay.process(dSummed, dTime, dFeedback, fMix);
+                for (int c = 0; c < nChans; c++)
+                    frame[c] = dSummed;
+            }
+        }
+
+        void reset() override
+        {
+            if (!delay.idle())
+                delay.clear();
+        }
+    };
+
+    class pingpong_node : public node
+    {
+    private:
+        sfx::pingpongdelay& delay;
+        param::parameter& timeLeft;
+        param::parameter& timeRight;
+        param::parameter& feedbackLeft;
+        param::parameter& feedbackRight;
+        param::parameter& mix;
+
+    public:
+        pingpong_node(sfx::pingpongdelay& d, param::parameter& tl, param::parameter& tr, param::parameter& fbl, param::parameter& fbr, param::parameter& m)
+            : delay(d), timeLeft(tl), timeRight(tr), feedbackLeft(fbl), feedbackRight(fbr), mix(m) {}
+
+        void process(int nChans, int nFrames, FTYPE dTime, FTYPE* const* ppIn, int nInputs, FTYPE* pOut) override
+        {
+            pass_through(nChans, nFrames, ppIn, nInputs, pOut);
+            for (param::parameter* p : { &timeLeft, &timeRight, &feedbackLeft, &feedbackRight, &mix })
+                p->begin(dTime);
+            for (int n = 0; n < nFrames; n++)
+            {
+                sfx::pingpongdelay::stereo_sample t(timeLeft.next(), timeRight.next());
+                sfx::pingpongdelay::stereo_sample fb(feedbackLeft.next(), feedbackRight.next());
+                float fMix = (float)mix.next();
+                delay.process(nChans, pOut + n * nChans, t, fb, fMix);
+            }
+        }
+
+        void reset() override
+        {
+            if (!delay.idle())
+                delay.clear();
+        }
+    };
+
+    /**
+     * One filter per channel (anything with filter() and reset(), e.g. the RBJ
+     * filters), skipped while silent. With a frequency parameter the filters
+     * also need setup(sampleRate, frequency, q), which is called at control rate
+     * while the frequency or q moves.
+     */
+    template<class F>
+    class filter_node : public node
+    {
+    private:
+        F* filters;
+        std::vector<sfx::silence_gate> vGates;
+        param::parameter* pFrequency = nullptr;
+        param::parameter* pQ = nullptr;
+        FTYPE dSampleRate = 44100.0;
+        FTYPE dFrequency = -1.0;
+        FTYPE dQ = -1.0;
+
+    public:
+        filter_node(F* channelFilters, int nChans)
+            : filters(channelFilters), vGates(nChans) {}
+
+        filter_node(F* channelFilters, int nChans, int nSampleRate, param::parameter& frequency, param::parameter& q)
+            : filters(channelFilters), vGates(nChans), pFrequency(&frequency), pQ(&q)
+        {
+            dSampleRate = (FTYPE)nSampleRate;
+        }
+
+        void process(int nChans, int nFrames, FTYPE dTime, FTYPE* const* ppIn, int nInputs, FTYPE* pOut) override
+        {
+            pass_through(nChans, nFrames, ppIn, nInputs, pOut);
+            if (pFrequency == nullptr)
+            {
+                filter(nChans, nFrames, pOut);
+                return;
+            }
+
+            pFrequency->begin(dTime);
+            pQ->begin(dTime);
+            for (int n = 0; n < nFrames; )
+            {
+                int nChunk = std::min(nFrames - n, pFrequency->control_period());
+                FTYPE f = pFrequency->advance(nChunk);
+                FTYPE q = pQ->advance(nChunk);
+                if (f != dFrequency || q != dQ)
+                {
+                    dFrequency = f;
+                    dQ = q;
+                    for (int c = 0; c < nChans; c++)
+                        filters[c].setup(dSampleRate, f, q);
+                }
+                filter(nChans, nChunk, pOut + n * nChans);
+                n += nChunk;
+            }
+        }
+
+        void reset() override
+        {
+            for (size_t c = 0; c < vGates.size(); c++)
+                if (!vGates[c].idle())
+                {
+                    filters[c].reset();
+                    vGates[c] = sfx::silence_gate();
+                }
+        }
+
+    private:
+        void filter(int nChans, int nFrames, FTYPE* pOut)
+        {
+            for (int n = 0; n < nFrames; n++)
+            {
+                for (int c = 0; c < nChans; c++)
+                {
+                    FTYPE& s = pOut[n * nChans + c];
+                    if (vGates[c].bypass(s))
+                    {
+                        s = 0.0;
+                        continue;
+                    }
+                    FTYPE dIn = s;
+                    s = filters[c].filter(s);
+                    if (vGates[c].settle(dIn, s))
+                        filters[c].reset();
+                }
+            }
+        }
+    };
+
+    /**
+     * Runs another node at 2x/4x/8x the sample rate, for nonlinear stages that
+     * would otherwise alias. The inputs are summed, upsampled, processed and
+     * decimated again. The inner node sees nFrames * factor frames per block, so
+     * anything in it that depends on the sample rate has to be built for the
+     * oversampled rate.
+     */
+    class oversample_node : public node
+    {
+    private:
+        std::unique_ptr<node> pInner;
+        oversample::oversampler resampler;
+        sfx::aligned_buffer<FTYPE> vIn;
+        sfx::aligned_buffer<FTYPE> vOut;
+
+    public:
+        oversample_node(node* pNode, int nChans, int nMaxFrames, int nFactor)
+            : pInner(pNode), resampler(nChans, nMaxFrames, nFactor)
+        {
+            resampler.set_factor(nFactor);
+            vIn.allocate((size_t)nChans * nMaxFrames * resampler.factor());
+            vOut.allocate((size_t)nChans * nMaxFrames * resampler.factor());
+        }
+
+        void process(int nChans, int nFrames, FTYPE dTime, FTYPE* const* ppIn, int nInputs, FTYPE* pOut) override
+        {
+            pass_through(nChans, nFrames, ppIn, nInputs, pOut);
+            for (int i = 1; i < nInputs; i++)
+                for (int s = 0; s < nChans * nFrames; s++)
+                    pOut[s] += ppIn[i][s];
+
+            int nOversampled = nFrames * resampler.factor();
+            FTYPE* pIn = vIn.data();
+            resampler.upsample(pOut, nFrames, pIn);
+            pInner->process(nChans, nOversampled, dTime, &pIn, 1, pInner->in_place() ? pIn : vOut.data());
+            resampler.downsample(pInner->in_place() ? pIn : vOut.data(), nFrames, pOut);
+        }
+
+        void reset() override
+        {
+            pInner->reset();
+            resampler.reset();
+        }
+    };
+
+    // one convolver per channel, as an effect return (bWetOnly) the input is replaced by the wet signal
+    class convolver_node : public node
+    {
+    private:
+        sfx::convolver* convolvers;
+        int nConvolvers;
+        param::parameter& mix;
+        bool bWet;
+
+    public:
+        convolver_node(sfx::convolver* channelConvolvers, int nChans, param::parameter& m, bool bWetOnly = false)
+            : convolvers(channelConvolvers), nConvolvers(nChans), mix(m), bWet(bWetOnly) {}
+
+        void process(int nChans, int nFrames, FTYPE dTime, FTYPE* const* ppIn, int nInputs, FTYPE* pOut) override
+        {
+            pass_through(nChans, nFrames, ppIn, nInputs, pOut);
+            mix.begin(dTime);
+            for (int n = 0; n < nFrames; n++)
+            {
+                FTYPE dMix = mix.next();
+                for (int c = 0; c < nChans; c++)
+                {
+                    FTYPE& s = pOut[n * nChans + c];
+                    s = bWet ? dMix * convolvers[c].process(s) : s + dMix * convolvers[c].process(s);
+                }
+            }
+        }
+
+        void reset() override
+        {
+            for (int c = 0; c < nConvolvers; c++)
+                if (!convolvers[c].idle())
+                    convolvers[c].clear();
+        }
+    };
+
+}
+
+#endif /* ifndef GRAPH_H */
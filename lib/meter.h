@@ -0,0 +1,430 @@
+#pragma once
+#ifndef METER_H
+#define METER_H
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include "sfx.h"
+#include "oversample.h"
+
+/**
+ * Streaming level and loudness meters for the master output: sample peak,
+ * 4x oversampled true peak, RMS, and ITU-R BS.1770 / EBU R128 momentary,
+ * short-term and gated integrated loudness.
+ *
+ * The audio thread runs each block through per channel kernels (peak and
+ * true peak as block reductions, the K-weighting biquads, sums of squares)
+ * and accumulates 100ms slices. Every window is a running sum over a ring of
+ * slices, and integrated loudness keeps a 0.1 LU histogram of the 400ms
+ * blocks, so the cost per block does not depend on the window lengths or
+ * how long the meter has run. Results go to the ui through a triple buffer.
+ */
+namespace meter
+{
+
+    const int MAX_CHANNELS = 8;
+    const int MOMENTARY_SLICES = 4;         // 400ms
+    const int SHORT_TERM_SLICES = 30;       // 3s
+    const int RMS_SLICES = 3;               // 300ms
+    const int TRUE_PEAK_PHASES = 4;
+    const int TRUE_PEAK_TAPS = 12;          // per phase
+    const FTYPE HISTOGRAM_LOW = -70.0;      // absolute gate, LUFS
+    const FTYPE HISTOGRAM_HIGH = 5.0;
+    const FTYPE HISTOGRAM_STEP = 0.1;
+
+
+    struct snapshot
+    {
+        int nChans = 0;
+        uint64_t nFrames = 0;               // frames metered since the last reset
+
+        // linear, peaks are the largest over the last 100-200ms and since the last reset
+        FTYPE dPeak[MAX_CHANNELS] = {};
+        FTYPE dPeakMax[MAX_CHANNELS] = {};
+        FTYPE dTruePeak[MAX_CHANNELS] = {};
+        FTYPE dTruePeakMax[MAX_CHANNELS] = {};
+        FTYPE dRms[MAX_CHANNELS] = {};
+
+        // LUFS, -inf until the window has filled
+        FTYPE dMomentary = -std::numeric_limits<FTYPE>::infinity();
+        FTYPE dShortTerm = -std::numeric_limits<FTYPE>::infinity();
+        FTYPE dIntegrated = -std::numeric_limits<FTYPE>::infinity();
+    };
+
+
+    FTYPE loudness(FTYPE dPower)
+    {
+        return dPower > 0.0 ? -0.691 + 10.0 * std::log10(dPower) : -std::numeric_limits<FTYPE>::infinity();
+    }
+
+    FTYPE to_db(FTYPE dLinear)
+    {
+        return dLinear > 0.0 ? 20.0 * std::log10(dLinear) : -std::numeric_limits<FTYPE>::infinity();
+    }
+
+
+    struct biquad
+    {
+        FTYPE b0 = 1.0, b1 = 0.0, b2 = 0.0, a1 = 0.0, a2 = 0.0;
+        FTYPE x1 = 0.0, x2 = 0.0, y1 = 0.0, y2 = 0.0;
+
+        void reset()
+        {
+            x1 = x2 = y1 = y2 = 0.0;
+        }
+    };
+
+    // the BS.1770 pre-filter (high shelf) and RLB highpass, derived for any sample rate
+    void k_weighting(int nSampleRate, biquad& shelf, biquad& highpass)
+    {
+        const FTYPE PI = 3.14159265358979323846;
+
+        FTYPE K = std::tan(PI * 1681.974450955533 / nSampleRate);
+        FTYPE Q = 0.7071752369554196;
+        FTYPE Vh = std::pow(10.0, 3.999843853973347 / 20.0);
+        FTYPE Vb = std::pow(Vh, 0.4996667741545416);
+        FTYPE a0 = 1.0 + K / Q + K * K;
+        shelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
+        shelf.b1 = 2.0 * (K * K - Vh) / a0;
+        shelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
+        shelf.a1 = 2.0 * (K * K - 1.0) / a0;
+        shelf.a2 = (1.0 - K / Q + K * K) / a0;
+
+        K = std::tan(PI * 38.13547087602444 / nSampleRate);
+        Q = 0.5003270373238773;
+        a0 = 1.0 + K / Q + K * K;
+        highpass.b0 = 1.0;
+        highpass.b1 = -2.0;
+        highpass.b2 = 1.0;
+        highpass.a1 = 2.0 * (K * K - 1.0) / a0;
+        highpass.a2 = (1.0 - K / Q + K * K) / a0;
+    }
+
+
+    class meter
+    {
+    private:
+        struct channel
+        {
+            biquad shelf;
+            biquad highpass;
+            sfx::aligned_buffer<FTYPE> vLine;       // true peak history then the block
+            FTYPE dPeak = 0.0;                      // current slice
+            FTYPE dTruePeak = 0.0;
+            FTYPE dSquares = 0.0;
+            FTYPE dPrevPeak = 0.0;                  // last complete slice
+            FTYPE dPrevTruePeak = 0.0;
+            FTYPE dPeakMax = 0.0;
+            FTYPE dTruePeakMax = 0.0;
+            FTYPE vRmsRing[RMS_SLICES] = {};
+            FTYPE dRmsSum = 0.0;
+        };
+
+        int nChans;
+        int nSliceFrames;
+        std::vector<channel> vChannels;
+        FTYPE vTruePeakTaps[TRUE_PEAK_PHASES][TRUE_PEAK_TAPS];
+        sfx::aligned_buffer<FTYPE> vWeighted;
+
+        // slices, each holds the K-weighted sum of squares over all channels
+        int nSliceFill = 0;
+        FTYPE vSlices[SHORT_TERM_SLICES] = {};
+        int nSliceIndex = 0;
+        int nSlicesSeen = 0;
+        FTYPE dMomentarySum = 0.0;
+        FTYPE dShortTermSum = 0.0;
+
+        // gated integration over 400ms blocks: count and summed power per 0.1 LU bin above the absolute gate
+        std::vector<uint64_t> vHistogramCount;
+        std::vector<FTYPE> vHistogramPower;
+        uint64_t nGatedBlocks = 0;
+        FTYPE dGatedPower = 0.0;
+        FTYPE dIntegrated = -std::numeric_limits<FTYPE>::infinity();
+
+        uint64_t nFrames = 0;
+        std::atomic<bool> bResetRequested{ false };
+
+        // triple buffer: the writer fills vSnapshots[nBack], then swaps it with the middle slot
+        snapshot vSnapshots[3];
+        static const int DIRTY = 4;
+        std::atomic<int> nMiddle{ 1 };
+        int nBack = 0;
+        int nFront = 2;
+
+    public:
+        meter(int nChannels, int nSampleRate, int nMaxFrames)
+        {
+            nChans = std::min(nChannels, MAX_CHANNELS);
+            nSliceFrames = std::max(1, nSampleRate / 10);
+            vChannels = std::vector<channel>(nChans);
+            for (auto& c : vChannels)
+            {
+                k_weighting(nSampleRate, c.shelf, c.highpass);
+                c.vLine.allocate(TRUE_PEAK_TAPS - 1 + nMaxFrames);
+            }
+            vWeighted.allocate(nMaxFrames);
+
+            // kaiser windowed sinc interpolator, 48 taps split into 4 phases of 12, each with unity gain at DC
+            const FTYPE PI = 3.14159265358979323846;
+            const int nTaps = TRUE_PEAK_PHASES * TRUE_PEAK_TAPS;
+            for (int p = 0; p < TRUE_PEAK_PHASES; p++)
+            {
+                FTYPE dSum = 0.0;
+                for (int t = 0; t < TRUE_PEAK_TAPS; t++)
+                {
+                    FTYPE x = (t * TRUE_PEAK_PHASES + p) - (nTaps - 1) / 2.0;
+                    FTYPE s = x == 0.0 ? 1.0 : std::sin(PI * x / TRUE_PEAK_PHASES) / (PI * x / TRUE_PEAK_PHASES);
+                    FTYPE r = 2.0 * x / nTaps;
+                    FTYPE w = oversample::bessel_i0(6.0 * std::sqrt(std::max(0.0, 1.0 - r * r))) / oversample::bessel_i0(6.0);
+                    vTruePeakTaps[p][t] = s * w;
+                    dSum += s * w;
+                }
+                for (int t = 0; t < TRUE_PEAK_TAPS; t++)
+                    vTruePeakTaps[p][t] /= dSum;
+            }
+
+            int nBins = (int)std::lround((HISTOGRAM_HIGH - HISTOGRAM_LOW) / HISTOGRAM_STEP);
+            vHistogramCount.assign(nBins, 0);
+            vHistogramPower.assign(nBins, 0.0);
+            clear();
+        }
+
+        meter(const meter&) = delete;
+        meter& operator=(const meter&) = delete;
+
+        int channels() const
+        {
+            return nChans;
+        }
+
+        // any thread, the audio thread clears the maxima and integrated loudness before its next block
+        void reset()
+        {
+            bResetRequested.store(true, std::memory_order_relaxed);
+        }
+
+        // audio thread, nFrames interleaved frames of the channel count given at construction
+        void process(const FTYPE* samples, int nBlockFrames)
+        {
+            if (bResetRequested.exchange(false, std::memory_order_relaxed))
+                clear();
+
+            // split at slice boundaries so every slice is exactly 100ms
+            while (nBlockFrames > 0)
+            {
+                int n = std::min(nBlockFrames, nSliceFrames - nSliceFill);
+                for (int c = 0; c < nChans; c++)
+                    process_channel(vChannels[c], samples + c, n);
+                samples += n * nChans;
+                nBlockFrames -= n;
+                nSliceFill += n;
+                nFrames += n;
+                if (nSliceFill == nSliceFrames)
+                    end_slice();
+            }
+            publish();
+        }
+
+        // ui thread, the latest results
+        void read(snapshot& s)
+        {
+            if (nMiddle.load(std::memory_order_relaxed) & DIRTY)
+                nFront = nMiddle.exchange(nFront, std::memory_order_acq_rel) & ~DIRTY;
+            s = vSnapshots[nFront];
+        }
+
+    private:
+        void process_channel(channel& ch, const FTYPE* in, int nFrames)
+        {
+            // deinterleave behind the true peak history
+            FTYPE* x = ch.vLine.data() + TRUE_PEAK_TAPS - 1;
+            for (int n = 0; n < nFrames; n++)
+                x[n] = in[n * nChans];
+
+            // sample peak
+            FTYPE dPeak = ch.dPeak;
+            for (int n = 0; n < nFrames; n++)
+                dPeak = std::max(dPeak, std::fabs(x[n]));
+            ch.dPeak = dPeak;
+
+            // true peak, one polyphase branch at a time with the taps outside the sample loop
+            FTYPE* y = vWeighted.data();
+            FTYPE dTruePeak = ch.dTruePeak;
+            for (int p = 0; p < TRUE_PEAK_PHASES; p++)
+            {
+                std::fill(y, y + nFrames, 0.0);
+                for (int t = 0; t < TRUE_PEAK_TAPS; t++)
+                {
+                    const FTYPE h = vTruePeakTaps[p][t];
+                    const FTYPE* s = x - t;
+                    for (int n = 0; n < nFrames; n++)
+                        y[n] += h * s[n];
+                }
+                for (int n = 0; n < nFrames; n++)
+                    dTruePeak = std::max(dTruePeak, std::fabs(y[n]));
+            }
+            ch.dTruePeak = std::max(dTruePeak, dPeak);
+
+            // unweighted squares for rms
+            FTYPE dRaw = 0.0;
+            for (int n = 0; n < nFrames; n++)
+                dRaw += x[n] * x[n];
+            ch.vRmsRing[nSliceIndex % RMS_SLICES] += dRaw;
+
+            // K-weighting, the only part that runs sample by sample
+            biquad& a = ch.shelf;
+            biquad& b = ch.highpass;
+            FTYPE dSquares = 0.0;
+            for (int n = 0; n < nFrames; n++)
+            {
+                FTYPE s = a.b0 * x[n] + a.b1 * a.x1 + a.b2 * a.x2 - a.a1 * a.y1 - a.a2 * a.y2;
+                a.x2 = a.x1; a.x1 = x[n];
+                a.y2 = a.y1; a.y1 = s;
+                FTYPE k = b.b0 * s + b.b1 * b.x1 + b.b2 * b.x2 - b.a1 * b.y1 - b.a2 * b.y2;
+                b.x2 = b.x1; b.x1 = s;
+                b.y2 = b.y1; b.y1 = k;
+                dSquares += k * k;
+            }
+            ch.dSquares += dSquares;
+
+            // keep the tail as history, it never overlaps the block itself
+            memmove(ch.vLine.data(), ch.vLine.data() + nFrames, sizeof(FTYPE) * (TRUE_PEAK_TAPS - 1));
+        }
+
+        void end_slice()
+        {
+            // channel weights are 1 for everything short of surround layouts
+            FTYPE dSlice = 0.0;
+            for (auto& ch : vChannels)
+            {
+                dSlice += ch.dSquares;
+                ch.dSquares = 0.0;
+                ch.dPrevPeak = ch.dPeak;
+                ch.dPrevTruePeak = ch.dTruePeak;
+                ch.dPeakMax = std::max(ch.dPeakMax, ch.dPeak);
+                ch.dTruePeakMax = std::max(ch.dTruePeakMax, ch.dTruePeak);
+                ch.dPeak = 0.0;
+                ch.dTruePeak = 0.0;
+            }
+
+            // running window sums, the slice leaving each window is subtracted
+            dMomentarySum += dSlice - vSlices[(nSliceIndex + SHORT_TERM_SLICES - MOMENTARY_SLICES) % SHORT_TERM_SLICES];
+            dShortTermSum += dSlice - vSlices[nSliceIndex];
+            vSlices[nSliceIndex] = dSlice;
+
+            // rms over the last few slices, then open the next rms slot
+            int r = nSliceIndex % RMS_SLICES;
+            for (auto& ch : vChannels)
+            {
+                ch.dRmsSum = 0.0;
+                for (FTYPE v : ch.vRmsRing)
+                    ch.dRmsSum += v;
+            }
+
+            nSliceIndex = (nSliceIndex + 1) % SHORT_TERM_SLICES;
+            nSlicesSeen++;
+            nSliceFill = 0;
+
+            // resum once per lap so the running sums cannot drift
+            if (nSliceIndex == 0)
+            {
+                dShortTermSum = 0.0;
+                for (FTYPE v : vSlices)
+                    dShortTermSum += v;
+                dMomentarySum = 0.0;
+                for (int i = 1; i <= MOMENTARY_SLICES; i++)
+                    dMomentarySum += vSlices[SHORT_TERM_SLICES - i];
+            }
+            for (auto& ch : vChannels)
+                ch.vRmsRing[(r + 1) % RMS_SLICES] = 0.0;
+
+            // every slice closes a 400ms gating block (75% overlap)
+            if (nSlicesSeen >= MOMENTARY_SLICES)
+            {
+                FTYPE dPower = dMomentarySum / (MOMENTARY_SLICES * nSliceFrames);
+                FTYPE dLoudness = loudness(dPower);
+                if (dLoudness > HISTOGRAM_LOW)
+                {
+                    int nBin = std::min((int)vHistogramCount.size() - 1, (int)((dLoudness - HISTOGRAM_LOW) / HISTOGRAM_STEP));
+                    vHistogramCount[nBin]++;
+                    vHistogramPower[nBin] += dPower;
+                    nGatedBlocks++;
+                    dGatedPower += dPower;
+                    dIntegrated = integrated();
+                }
+            }
+        }
+
+        // relative gate 10 LU under the absolute gated mean, resolved to the histogram bins
+        FTYPE integrated() const
+        {
+            if (nGatedBlocks == 0)
+                return -std::numeric_limits<FTYPE>::infinity();
+            FTYPE dGate = loudness(dGatedPower / nGatedBlocks) - 10.0;
+            int nFirst = std::max(0, (int)std::ceil((dGate - HISTOGRAM_LOW) / HISTOGRAM_STEP));
+            uint64_t nCount = 0;
+            FTYPE dPower = 0.0;
+            for (int i = nFirst; i < (int)vHistogramCount.size(); i++)
+            {
+                nCount += vHistogramCount[i];
+                dPower += vHistogramPower[i];
+            }
+            return nCount > 0 ? loudness(dPower / nCount) : -std::numeric_limits<FTYPE>::infinity();
+        }
+
+        void publish()
+        {
+            snapshot& s = vSnapshots[nBack];
+            s.nChans = nChans;
+            s.nFrames = nFrames;
+            for (int c = 0; c < nChans; c++)
+            {
+                const channel& ch = vChannels[c];
+                s.dPeak[c] = std::max(ch.dPeak, ch.dPrevPeak);
+                s.dTruePeak[c] = std::max(ch.dTruePeak, ch.dPrevTruePeak);
+                s.dPeakMax[c] = std::max(ch.dPeakMax, ch.dPeak);
+                s.dTruePeakMax[c] = std::max(ch.dTruePeakMax, ch.dTruePeak);
+                s.dRms[c] = nSlicesSeen >= RMS_SLICES ? std::sqrt(std::max(0.0, ch.dRmsSum) / (RMS_SLICES * nSliceFrames)) : 0.0;
+            }
+            s.dMomentary = nSlicesSeen >= MOMENTARY_SLICES ? loudness(dMomentarySum / (MOMENTARY_SLICES * nSliceFrames)) : -std::numeric_limits<FTYPE>::infinity();
+            s.dShortTerm = nSlicesSeen >= SHORT_TERM_SLICES ? loudness(dShortTermSum / (SHORT_TERM_SLICES * nSliceFrames)) : -std::numeric_limits<FTYPE>::infinity();
+            s.dIntegrated = dIntegrated;
+            nBack = nMiddle.exchange(nBack | DIRTY, std::memory_order_acq_rel) & ~DIRTY;
+        }
+
+        void clear()
+        {
+            for (auto& ch : vChannels)
+            {
+                ch.shelf.reset();
+                ch.highpass.reset();
+                std::fill(ch.vLine.data(), ch.vLine.data() + TRUE_PEAK_TAPS - 1, 0.0);
+                ch.dPeak = ch.dTruePeak = ch.dSquares = 0.0;
+                ch.dPrevPeak = ch.dPrevTruePeak = 0.0;
+                ch.dPeakMax = ch.dTruePeakMax = 0.0;
+                std::fill(ch.vRmsRing, ch.vRmsRing + RMS_SLICES, 0.0);
+                ch.dRmsSum = 0.0;
+            }
+            std::fill(vSlices, vSlices + SHORT_TERM_SLICES, 0.0);
+            std::fill(vHistogramCount.begin(), vHistogramCount.end(), 0);
+            std::fill(vHistogramPower.begin(), vHistogramPower.end(), 0.0);
+            nSliceFill = nSliceIndex = nSlicesSeen = 0;
+            dMomentarySum = dShortTermSum = 0.0;
+            nGatedBlocks = 0;
+            dGatedPower = 0.0;
+            dIntegrated = -std::numeric_limits<FTYPE>::infinity();
+            nFrames = 0;
+        }
+    };
+
+}
+
+#endif /* ifndef METER_H */
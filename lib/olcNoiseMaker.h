@@ -62,24 +62,43 @@
 #include <string>
 #include <thread>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 using namespace std;
 
 #include <Windows.h>
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <xmmintrin.h>
+#include <pmmintrin.h>
+#define OLC_NOISEMAKER_SSE
+#endif
+
 #ifndef FTYPE
 #define FTYPE double
 #endif
 
 const double PI = 2.0 * acos(0.0);
 
+// Decaying feedback paths and filter states end up in subnormal floats, which
+// are very slow on x86. The modes are per thread, so every thread that renders
+// audio calls this before its first block.
+void EnableFlushToZero()
+{
+#ifdef OLC_NOISEMAKER_SSE
+    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+#endif
+}
+
 template<class T>
 class olcNoiseMaker
 {
 public:
-    olcNoiseMaker(string sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512)
+    olcNoiseMaker(string sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512,
+        bool bAdaptiveLatency = false, unsigned int nMinBlocks = 2)
     {
-        Create(sOutputDevice, nSampleRate, nChannels, nBlocks, nBlockSamples);
+        Create(sOutputDevice, nSampleRate, nChannels, nBlocks, nBlockSamples, bAdaptiveLatency, nMinBlocks);
     }
 
     ~olcNoiseMaker()
@@ -87,7 +106,10 @@ public:
         Destroy();
     }
 
-    bool Create(string sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512)
+    // bAdaptiveLatency and nMinBlocks are applied before the device starts, so the
+    // first blocks are already queued to the adaptive target (see SetAdaptiveLatency)
+    bool Create(string sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512,
+        bool bAdaptiveLatency = false, unsigned int nMinBlocks = 2)
     {
         m_bReady = false;
         m_nSampleRate = nSampleRate;
@@ -95,11 +117,24 @@ public:
         m_nBlockCount = nBlocks;
         m_nBlockSamples = nBlockSamples;
         m_nBlockFree = m_nBlockCount;
+        m_nBlockQueued = 0;
         m_nBlockCurrent = 0;
+        m_bAdaptiveLatency = bAdaptiveLatency;
+        m_nBlockMin = std::max(1u, std::min(nMinBlocks, m_nBlockCount));
+        m_nBlockTarget = m_bAdaptiveLatency ? m_nBlockMin.load() : m_nBlockCount;
+        m_nUnderruns = 0;
+        m_nUnderrunsSeen = 0;
+        m_nHealthyBlocks = 0;
+        m_nShrinkHold = 0;
+        m_bShrunk = false;
+        m_dRenderLoad = 0.0;
         m_pBlockMemory = nullptr;
+        m_pBlockBuffer = nullptr;
         m_pWaveHeaders = nullptr;
 
         m_userFunction = nullptr;
+        m_userFunctionAllChans = nullptr;
+        m_userFunctionBlock = nullptr;
 
         // Validate device
         vector<string> devices = Enumerate();
@@ -128,6 +163,11 @@ public:
             return Destroy();
         ZeroMemory(m_pBlockMemory, sizeof(T) * m_nBlockCount * m_nBlockSamples);
 
+        m_pBlockBuffer = new FTYPE[m_nBlockSamples];
+        if (m_pBlockBuffer == nullptr)
+            return Destroy();
+        memset(m_pBlockBuffer, 0, sizeof(FTYPE) * m_nBlockSamples);
+
         m_pWaveHeaders = new WAVEHDR[m_nBlockCount];
         if (m_pWaveHeaders == nullptr)
             return Destroy();
@@ -173,7 +213,45 @@ public:
         return m_dGlobalTime;
     }
 
-    
+    // Adaptive latency treats nBlocks as the maximum queue depth. The number of
+    // blocks kept queued starts at nMinBlocks, grows when the device underruns
+    // and shrinks again after a sustained period with plenty of render headroom.
+    void SetAdaptiveLatency(bool bEnabled, unsigned int nMinBlocks = 2)
+    {
+        m_nBlockMin = std::max(1u, std::min(nMinBlocks, m_nBlockCount));
+        m_bAdaptiveLatency = bEnabled;
+        m_nBlockTarget = bEnabled ? m_nBlockMin.load() : m_nBlockCount;
+    }
+
+    // Output latency of the currently queued audio in milliseconds
+    FTYPE GetLatency()
+    {
+        return 1000.0 * (FTYPE)(m_nBlockQueued * (m_nBlockSamples / m_nChannels)) / (FTYPE)m_nSampleRate;
+    }
+
+    // Blocks written to the device and not played yet
+    unsigned int GetQueueDepth()
+    {
+        return m_nBlockQueued;
+    }
+
+    // Blocks the adaptive latency is aiming to keep queued
+    unsigned int GetQueueTarget()
+    {
+        return m_nBlockTarget;
+    }
+
+    unsigned int GetUnderruns()
+    {
+        return m_nUnderruns;
+    }
+
+    // Peak (slowly decaying) fraction of a block's duration spent rendering it
+    FTYPE GetRenderLoad()
+    {
+        return m_dRenderLoad;
+    }
+
 
 public:
     static vector<string> Enumerate()
@@ -210,9 +288,18 @@ public:
     }
 
 
+    // Whole block at once: nFrames interleaved frames of nChans samples, with
+    // the time of the first frame. Takes priority over the per sample functions.
+    void SetUserFunctionBlock(void(*func)(int, int, FTYPE*, FTYPE))
+    {
+        m_userFunctionBlock = func;
+    }
+
+
 private:
     FTYPE(*m_userFunction)(int, FTYPE) = nullptr;
     void(*m_userFunctionAllChans)(int, FTYPE*, FTYPE);
+    void(*m_userFunctionBlock)(int, int, FTYPE*, FTYPE);
 
     unsigned int m_nSampleRate;
     unsigned int m_nChannels;
@@ -221,23 +308,40 @@ private:
     unsigned int m_nBlockCurrent;
 
     T* m_pBlockMemory;
+    FTYPE* m_pBlockBuffer;
     WAVEHDR *m_pWaveHeaders;
     HWAVEOUT m_hwDevice;
 
     thread m_thread;
     atomic<bool> m_bReady;
     atomic<unsigned int> m_nBlockFree;
+    atomic<unsigned int> m_nBlockQueued;    // written to the device and not played yet
     condition_variable m_cvBlockNotZero;
     mutex m_muxBlockNotZero;
 
     atomic<FTYPE> m_dGlobalTime;
 
+    // latency management
+    atomic<bool> m_bAdaptiveLatency{ false };
+    atomic<unsigned int> m_nBlockMin{ 2 };
+    atomic<unsigned int> m_nBlockTarget;
+    atomic<unsigned int> m_nUnderruns;
+    atomic<FTYPE> m_dRenderLoad;
+    unsigned int m_nUnderrunsSeen;
+    unsigned int m_nHealthyBlocks;
+    unsigned int m_nShrinkHold;
+    bool m_bShrunk;                         // the target shrank and no underrun has followed yet
+
     // Handler for soundcard request for more data
     void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwParam1, DWORD dwParam2)
     {
         if (uMsg != WOM_DONE) return;
 
+        // the device has played everything it was given, so it has run dry. m_nBlockFree
+        // can not tell, the block being rendered is taken from it before rendering starts
         m_nBlockFree++;
+        if (--m_nBlockQueued == 0 && m_bReady)
+            m_nUnderruns++;
         unique_lock<mutex> lm(m_muxBlockNotZero);
         m_cvBlockNotZero.notify_one();
     }
@@ -248,12 +352,46 @@ private:
         ((olcNoiseMaker*)dwInstance)->waveOutProc(hWaveOut, uMsg, dwParam1, dwParam2);
     }
 
+    // Called after each block is rendered. Grows the queue immediately on an
+    // underrun, and only shrinks it after a hold period with low render load.
+    // The hold doubles whenever a shrink is followed by an underrun.
+    void UpdateLatency(FTYPE dLoad)
+    {
+        m_dRenderLoad = std::max(dLoad, m_dRenderLoad * 0.995);
+        if (!m_bAdaptiveLatency) return;
+
+        unsigned int nBlocksPerSecond = std::max(1u, m_nSampleRate / (m_nBlockSamples / m_nChannels));
+        if (m_nShrinkHold == 0)
+            m_nShrinkHold = nBlocksPerSecond * 2;
+
+        unsigned int nUnderruns = m_nUnderruns;
+        if (nUnderruns != m_nUnderrunsSeen)
+        {
+            m_nUnderrunsSeen = nUnderruns;
+            if (m_nBlockTarget < m_nBlockCount)
+                m_nBlockTarget++;
+            if (m_bShrunk && m_nHealthyBlocks < m_nShrinkHold)
+                m_nShrinkHold = std::min(m_nShrinkHold * 2, nBlocksPerSecond * 60);
+            m_bShrunk = false;
+            m_nHealthyBlocks = 0;
+            return;
+        }
+
+        if (++m_nHealthyBlocks >= m_nShrinkHold && m_dRenderLoad < 0.5 && m_nBlockTarget > m_nBlockMin)
+        {
+            m_nBlockTarget--;
+            m_nHealthyBlocks = 0;
+            m_bShrunk = true;
+        }
+    }
+
     // Main thread. This loop responds to requests from the soundcard to fill 'blocks'
     // with audio data. If no requests are available it goes dormant until the sound
     // card is ready for more data. The block is fille by the "user" in some manner
     // and then issued to the soundcard.
     void MainThread()
     {
+        EnableFlushToZero();
         m_dGlobalTime = 0.0;
         FTYPE dTimeStep = 1.0 / (FTYPE)m_nSampleRate;
 
@@ -261,16 +399,20 @@ private:
         T nMaxSample = (T)pow(2, (sizeof(T) * 8) - 1) - 1;
         FTYPE dMaxSample = (FTYPE)nMaxSample;
         T nPreviousSample = 0;
+        FTYPE dBlockDuration = (FTYPE)(m_nBlockSamples / m_nChannels) / (FTYPE)m_nSampleRate;
 
         while (m_bReady)
         {
-            // Wait for block to become available
-            if (m_nBlockFree == 0)
+            // Wait for block to become available, and for the queue to drop
+            // below the current target depth
+            auto QueueFull = [&]() { return m_nBlockFree == 0 || m_nBlockCount - m_nBlockFree >= m_nBlockTarget; };
+            if (QueueFull())
             {
                 unique_lock<mutex> lm(m_muxBlockNotZero);
-                while(m_nBlockFree == 0) // sometimes, Windows signals incorrectly
+                while (QueueFull()) // sometimes, Windows signals incorrectly
                     m_cvBlockNotZero.wait(lm);
             }
+            auto tRenderStart = chrono::steady_clock::now();
 
             // Block is here, so use it
             m_nBlockFree--;
@@ -281,45 +423,61 @@ private:
 
             T nNewSample = 0;
             int nCurrentBlock = m_nBlockCurrent * m_nBlockSamples;
-            
-            for (unsigned int n = 0; n < m_nBlockSamples; n+=m_nChannels)
+
+            if (m_userFunctionBlock != nullptr)
+            {
+                // User process (whole block)
+                unsigned int nFrames = m_nBlockSamples / m_nChannels;
+                m_userFunctionBlock(m_nChannels, nFrames, m_pBlockBuffer, m_dGlobalTime);
+                for (unsigned int n = 0; n < nFrames * m_nChannels; n++)
+                    m_pBlockMemory[nCurrentBlock + n] = (T)(clip(m_pBlockBuffer[n], 1.0) * dMaxSample);
+                m_dGlobalTime = m_dGlobalTime + dTimeStep * nFrames;
+            }
+            else
             {
-                if (m_userFunctionAllChans == nullptr)
+                for (unsigned int n = 0; n < m_nBlockSamples; n+=m_nChannels)
                 {
-                    // User Process (per channel)
-                    for (unsigned int c = 0; c < m_nChannels; c++)
+                    if (m_userFunctionAllChans == nullptr)
                     {
-                        if (m_userFunction == nullptr)
-                            nNewSample = (T)(clip(UserProcess(c, m_dGlobalTime), 1.0) * dMaxSample);
-                        else
-                            nNewSample = (T)(clip(m_userFunction(c, m_dGlobalTime), 1.0) * dMaxSample);
+                        // User Process (per channel)
+                        for (unsigned int c = 0; c < m_nChannels; c++)
+                        {
+                            if (m_userFunction == nullptr)
+                                nNewSample = (T)(clip(UserProcess(c, m_dGlobalTime), 1.0) * dMaxSample);
+                            else
+                                nNewSample = (T)(clip(m_userFunction(c, m_dGlobalTime), 1.0) * dMaxSample);
                         
-                        m_pBlockMemory[nCurrentBlock + n + c] = nNewSample;
-                        nPreviousSample = nNewSample;
+                            m_pBlockMemory[nCurrentBlock + n + c] = nNewSample;
+                            nPreviousSample = nNewSample;
+                        }
                     }
-                }
-                else
-                {
-                    // User process (all channels)
-                    FTYPE *samples = new FTYPE[m_nChannels];
-                    m_userFunctionAllChans(m_nChannels, samples, m_dGlobalTime);
-                    for (unsigned int c = 0; c < m_nChannels; c++)
+                    else
                     {
-                        nNewSample = (T)(clip(samples[c], 1.0) * dMaxSample);
-                        m_pBlockMemory[nCurrentBlock + n + c] = nNewSample;
-                        nPreviousSample = nNewSample;
+                        // User process (all channels)
+                        FTYPE *samples = new FTYPE[m_nChannels];
+                        m_userFunctionAllChans(m_nChannels, samples, m_dGlobalTime);
+                        for (unsigned int c = 0; c < m_nChannels; c++)
+                        {
+                            nNewSample = (T)(clip(samples[c], 1.0) * dMaxSample);
+                            m_pBlockMemory[nCurrentBlock + n + c] = nNewSample;
+                            nPreviousSample = nNewSample;
+                        }
+                        delete[] samples;
                     }
-                    delete[] samples;
-                }
                 
-                m_dGlobalTime = m_dGlobalTime + dTimeStep;
+                    m_dGlobalTime = m_dGlobalTime + dTimeStep;
+                }
             }
 
             // Send block to sound device
             waveOutPrepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
+            m_nBlockQueued++;
             waveOutWrite(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
             m_nBlockCurrent++;
             m_nBlockCurrent %= m_nBlockCount;
+
+            FTYPE dRenderTime = chrono::duration<FTYPE>(chrono::steady_clock::now() - tRenderStart).count();
+            UpdateLatency(dRenderTime / dBlockDuration);
         }
     }
 };
@@ -0,0 +1,336 @@
+#pragma once
+#ifndef OVERSAMPLE_H
+#define OVERSAMPLE_H
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "sfx.h"
+#include "tablecache.h"
+
+/**
+ * 2x/4x/8x oversampling with cascaded polyphase half-band FIR stages. A
+ * half-band filter has every second tap zero except the centre one, so each
+ * 2x step costs one symmetric FIR per low rate sample: the other phase is a
+ * plain delay. Every stage runs over whole blocks with the tap loop outside
+ * the sample loop so the compiler can vectorise it.
+ *
+ * The first stage carries the real transition band (20kHz to 24.1kHz at
+ * 44.1kHz) and is long, the later stages only have to reject images far away
+ * from the audio band and are short. Stopband is about 85-90dB throughout.
+ */
+namespace oversample
+{
+
+    const int MAX_FACTOR = 8;
+    const int MAX_STAGES = 3;
+
+    struct stage_spec
+    {
+        int nPairs;     // nonzero taps either side of the centre
+        FTYPE dBeta;    // kaiser window
+    };
+
+    const stage_spec STAGES[MAX_STAGES] = { { 32, 9.0 }, { 8, 8.0 }, { 6, 9.0 } };
+
+
+    // zeroth order modified bessel function of the first kind, for the kaiser window
+    FTYPE bessel_i0(FTYPE x)
+    {
+        FTYPE dSum = 1.0;
+        FTYPE dTerm = 1.0;
+        for (int k = 1; k < 50; k++)
+        {
+            dTerm *= (x / (2.0 * k)) * (x / (2.0 * k));
+            dSum += dTerm;
+            if (dTerm < dSum * 1e-17) break;
+        }
+        return dSum;
+    }
+
+    /**
+     * Kaiser windowed half-band lowpass. Returns the nonzero off-centre taps,
+     * outermost first, normalised so the whole filter (centre tap 0.5) has
+     * unity gain at DC.
+     */
+    std::vector<FTYPE> halfband_design(int nPairs, FTYPE dBeta)
+    {
+        const FTYPE PI = 3.14159265358979323846;
+        int nHalf = 2 * nPairs - 1;
+        std::vector<FTYPE> vTaps(nPairs);
+        FTYPE dSum = 0.0;
+        for (int t = 0; t < nPairs; t++)
+        {
+            int d = nHalf - 2 * t;
+            FTYPE r = (FTYPE)d / (FTYPE)(nHalf + 1);
+            FTYPE w = bessel_i0(dBeta * std::sqrt(1.0 - r * r)) / bessel_i0(dBeta);
+            vTaps[t] = std::sin(PI * d / 2.0) / (PI * d) * w;
+            dSum += vTaps[t];
+        }
+        for (auto& a : vTaps)
+            a *= 0.25 / dSum;
+        return vTaps;
+    }
+
+
+    // the taps of stage s, from the table cache when one is installed
+    std::vector<FTYPE> halfband_taps(int s)
+    {
+        const FTYPE* p = tablecache::lookup<FTYPE>(("oversample.halfband." + std::to_string(s)).c_str(), STAGES[s].nPairs);
+        if (p != nullptr)
+            return std::vector<FTYPE>(p, p + STAGES[s].nPairs);
+        return halfband_design(STAGES[s].nPairs, STAGES[s].dBeta);
+    }
+
+    void cache_tables(tablecache::builder& b)
+    {
+        for (int s = 0; s < MAX_STAGES; s++)
+            b.add("oversample.halfband." + std::to_string(s), halfband_design(STAGES[s].nPairs, STAGES[s].dBeta));
+    }
+
+
+    /**
+     * One channel of 2x interpolation. For every input sample x[n] it writes
+     * two outputs, the filtered phase and x[n - nPairs + 1].
+     */
+    class halfband_up
+    {
+    private:
+        std::vector<FTYPE> vTaps;
+        int nPairs;
+        int nHistory;
+        sfx::aligned_buffer<FTYPE> vLine;       // nHistory old samples then the block
+        sfx::aligned_buffer<FTYPE> vPhase;
+
+    public:
+        void setup(const std::vector<FTYPE>& taps, int nMaxFrames)
+        {
+            vTaps = taps;
+            nPairs = (int)taps.size();
+            nHistory = 2 * nPairs - 1;
+            vLine.allocate(nHistory + nMaxFrames);
+            vPhase.allocate(nMaxFrames);
+        }
+
+        void reset()
+        {
+            std::fill(vLine.data(), vLine.data() + nHistory, 0.0);
+        }
+
+        // in has nFrames samples, out gets 2 * nFrames
+        void process(const FTYPE* in, int nFrames, FTYPE* out)
+        {
+            FTYPE* x = vLine.data() + nHistory;
+            FTYPE* y = vPhase.data();
+            memcpy(x, in, sizeof(FTYPE) * nFrames);
+
+            std::fill(y, y + nFrames, 0.0);
+            for (int t = 0; t < nPairs; t++)
+            {
+                const FTYPE a = 2.0 * vTaps[t];
+                const FTYPE* p = x - t;
+                const FTYPE* q = x - nHistory + t;
+                for (int n = 0; n < nFrames; n++)
+                    y[n] += a * (p[n] + q[n]);
+            }
+
+            const FTYPE* d = x - (nPairs - 1);
+            for (int n = 0; n < nFrames; n++)
+            {
+                out[2 * n] = y[n];
+                out[2 * n + 1] = d[n];
+            }
+            memmove(vLine.data(), vLine.data() + nFrames, sizeof(FTYPE) * nHistory);
+        }
+    };
+
+
+    // one channel of 2x decimation, the mirror of halfband_up
+    class halfband_down
+    {
+    private:
+        std::vector<FTYPE> vTaps;
+        int nPairs;
+        int nHistory;
+        sfx::aligned_buffer<FTYPE> vEven;       // history then the even input samples of the block
+        sfx::aligned_buffer<FTYPE> vOdd;        // the same for the odd ones, which only meet the centre tap
+
+    public:
+        void setup(const std::vector<FTYPE>& taps, int nMaxFrames)
+        {
+            vTaps = taps;
+            nPairs = (int)taps.size();
+            nHistory = 2 * nPairs - 1;
+            vEven.allocate(nHistory + nMaxFrames);
+            vOdd.allocate(nHistory + nMaxFrames);
+        }
+
+        void reset()
+        {
+            std::fill(vEven.data(), vEven.data() + nHistory, 0.0);
+            std::fill(vOdd.data(), vOdd.data() + nHistory, 0.0);
+        }
+
+        // in has 2 * nFrames samples, out gets nFrames
+        void process(const FTYPE* in, int nFrames, FTYPE* out)
+        {
+            FTYPE* e = vEven.data() + nHistory;
+            FTYPE* o = vOdd.data() + nHistory;
+            for (int n = 0; n < nFrames; n++)
+            {
+                e[n] = in[2 * n];
+                o[n] = in[2 * n + 1];
+            }
+
+            const FTYPE* d = o - nPairs;
+            for (int n = 0; n < nFrames; n++)
+                out[n] = 0.5 * d[n];
+            for (int t = 0; t < nPairs; t++)
+            {
+                const FTYPE a = vTaps[t];
+                const FTYPE* p = e - t;
+                const FTYPE* q = e - nHistory + t;
+                for (int n = 0; n < nFrames; n++)
+                    out[n] += a * (p[n] + q[n]);
+            }
+            memmove(vEven.data(), vEven.data() + nFrames, sizeof(FTYPE) * nHistory);
+            memmove(vOdd.data(), vOdd.data() + nFrames, sizeof(FTYPE) * nHistory);
+        }
+    };
+
+
+    /**
+     * Interleaved multichannel up and down sampling by 1, 2, 4 or 8. Stages
+     * for the largest factor are built up front, so the factor can change
+     * between blocks without allocating (the filters are cleared when it does).
+     */
+    class oversampler
+    {
+    private:
+        int nChans;
+        int nMaxFrames;
+        int nFactor = 1;
+        int nStages = 0;
+
+        // [stage * nChans + channel], stage s runs between 2^s and 2^(s+1) times the base rate
+        std::vector<halfband_up> vUp;
+        std::vector<halfband_down> vDown;
+        sfx::aligned_buffer<FTYPE> vPing;
+        sfx::aligned_buffer<FTYPE> vPong;
+
+    public:
+        oversampler(int nChannels, int nMaxBlockFrames, int nMaxFactor = MAX_FACTOR)
+        {
+            nChans = nChannels;
+            nMaxFrames = nMaxBlockFrames;
+            int nMaxStages = 0;
+            while ((1 << nMaxStages) < std::min(nMaxFactor, MAX_FACTOR))
+                nMaxStages++;
+
+            vUp = std::vector<halfband_up>(nMaxStages * nChans);
+            vDown = std::vector<halfband_down>(nMaxStages * nChans);
+            for (int s = 0; s < nMaxStages; s++)
+            {
+                std::vector<FTYPE> vTaps = halfband_taps(s);
+                for (int c = 0; c < nChans; c++)
+                {
+                    vUp[s * nChans + c].setup(vTaps, nMaxFrames << s);
+                    vDown[s * nChans + c].setup(vTaps, nMaxFrames << s);
+                }
+            }
+            size_t nScratch = (size_t)nMaxFrames << nMaxStages;
+            vPing.allocate(nScratch);
+            vPong.allocate(nScratch);
+            reset();
+        }
+
+        oversampler(const oversampler&) = delete;
+        oversampler& operator=(const oversampler&) = delete;
+
+        // rounded down to a power of two the stages allow
+        void set_factor(int nNewFactor)
+        {
+            int s = 0;
+            while ((2 << s) <= nNewFactor && s < (int)vUp.size() / std::max(1, nChans))
+                s++;
+            if (s == nStages) return;
+            nStages = s;
+            nFactor = 1 << s;
+            reset();
+        }
+
+        int factor() const
+        {
+            return nFactor;
+        }
+
+        void reset()
+        {
+            for (auto& u : vUp)
+                u.reset();
+            for (auto& d : vDown)
+                d.reset();
+        }
+
+        // in has nFrames interleaved frames, out gets nFrames * factor()
+        void upsample(const FTYPE* in, int nFrames, FTYPE* out)
+        {
+            if (nStages == 0)
+            {
+                memcpy(out, in, sizeof(FTYPE) * nChans * nFrames);
+                return;
+            }
+            for (int c = 0; c < nChans; c++)
+            {
+                FTYPE* a = vPing.data();
+                FTYPE* b = vPong.data();
+                for (int n = 0; n < nFrames; n++)
+                    a[n] = in[n * nChans + c];
+                int nLength = nFrames;
+                for (int s = 0; s < nStages; s++)
+                {
+                    vUp[s * nChans + c].process(a, nLength, b);
+                    std::swap(a, b);
+                    nLength *= 2;
+                }
+                for (int n = 0; n < nLength; n++)
+                    out[n * nChans + c] = a[n];
+            }
+        }
+
+        // in has nFrames * factor() interleaved frames, out gets nFrames
+        void downsample(const FTYPE* in, int nFrames, FTYPE* out)
+        {
+            if (nStages == 0)
+            {
+                memcpy(out, in, sizeof(FTYPE) * nChans * nFrames);
+                return;
+            }
+            for (int c = 0; c < nChans; c++)
+            {
+                FTYPE* a = vPing.data();
+                FTYPE* b = vPong.data();
+                int nLength = nFrames << nStages;
+                for (int n = 0; n < nLength; n++)
+                    a[n] = in[n * nChans + c];
+                for (int s = nStages - 1; s >= 0; s--)
+                {
+                    nLength /= 2;
+                    vDown[s * nChans + c].process(a, nLength, b);
+                    std::swap(a, b);
+                }
+                for (int n = 0; n < nFrames; n++)
+                    out[n * nChans + c] = a[n];
+            }
+        }
+    };
+
+}
+
+#endif /* ifndef OVERSAMPLE_H */
@@ -0,0 +1,330 @@
+#pragma once
+#ifndef PARAM_H
+#define PARAM_H
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+/**
+ * Live parameters shared between the ui and audio threads. The ui thread
+ * only stores an atomic target. The audio thread reads it once per control
+ * period (32 samples by default), works out a ramp when it moved, and then
+ * either steps the ramp per sample with next() or jumps a whole control
+ * period at once with advance() for consumers that only need control rate
+ * values, such as filter coefficients.
+ */
+namespace param
+{
+
+    enum class ramp
+    {
+        step,           // jump at the next control period
+        linear,
+        exponential     // constant ratio per sample, for frequencies and gains above zero
+    };
+
+    enum class lane_mode
+    {
+        off,
+        record,
+        play
+    };
+
+    const char* lane_mode_name(lane_mode m)
+    {
+        switch (m)
+        {
+        case lane_mode::off: return "Off";
+        case lane_mode::record: return "Recording";
+        case lane_mode::play: return "Playing";
+        }
+        return "";
+    }
+
+
+    /**
+     * Automation for one parameter in preallocated storage. The audio thread
+     * records target changes into it and plays them back, the ui thread only
+     * switches modes and reads the counts. Times are relative to the start of
+     * the take, playback holds the last point once it runs out. A take that
+     * fills the lane keeps its first capacity() points and counts the rest
+     * in dropped().
+     */
+    class lane
+    {
+    public:
+        struct point
+        {
+            FTYPE dTime;
+            FTYPE dValue;
+        };
+
+    private:
+        std::vector<point> vPoints;
+        std::atomic<int> nCount{ 0 };
+        std::atomic<int> nDropped{ 0 };
+        std::atomic<lane_mode> eMode{ lane_mode::off };
+        std::atomic<bool> bRestart{ false };
+
+        // audio thread
+        FTYPE dStart = 0.0;
+        FTYPE dLast = 0.0;
+        int nCursor = 0;
+
+    public:
+        lane(int nCapacity = 4096)
+        {
+            vPoints.resize(std::max(1, nCapacity));
+        }
+
+        // ui thread
+        void set_mode(lane_mode m)
+        {
+            bRestart.store(true, std::memory_order_relaxed);
+            eMode.store(m, std::memory_order_release);
+        }
+
+        lane_mode mode() const
+        {
+            return eMode.load(std::memory_order_relaxed);
+        }
+
+        int count() const
+        {
+            return nCount.load(std::memory_order_acquire);
+        }
+
+        int capacity() const
+        {
+            return (int)vPoints.size();
+        }
+
+        // points of this take that did not fit
+        int dropped() const
+        {
+            return nDropped.load(std::memory_order_relaxed);
+        }
+
+        // audio thread, called once per control period with the current target
+        void capture(FTYPE dTime, FTYPE dValue)
+        {
+            if (eMode.load(std::memory_order_acquire) != lane_mode::record) return;
+
+            int n = nCount.load(std::memory_order_relaxed);
+            if (bRestart.exchange(false, std::memory_order_relaxed))
+            {
+                n = 0;
+                dStart = dTime;
+                nDropped.store(0, std::memory_order_relaxed);
+            }
+            else if (n > 0 && dValue == dLast)
+                return;
+            if (n >= (int)vPoints.size())
+            {
+                nDropped.fetch_add(1, std::memory_order_relaxed);
+                dLast = dValue;
+                return;
+            }
+
+            vPoints[n] = { dTime - dStart, dValue };
+            dLast = dValue;
+            nCount.store(n + 1, std::memory_order_release);
+        }
+
+        // audio thread, false unless the lane is playing
+        bool sample(FTYPE dTime, FTYPE& dValue)
+        {
+            if (eMode.load(std::memory_order_acquire) != lane_mode::play) return false;
+
+            int n = nCount.load(std::memory_order_acquire);
+            if (n == 0) return false;
+            if (bRestart.exchange(false, std::memory_order_relaxed))
+            {
+                dStart = dTime;
+                nCursor = 0;
+            }
+            FTYPE t = dTime - dStart;
+            while (nCursor + 1 < n && vPoints[nCursor + 1].dTime <= t)
+                nCursor++;
+            dValue = vPoints[nCursor].dValue;
+            return true;
+        }
+    };
+
+
+    class parameter
+    {
+    private:
+        std::atomic<FTYPE> dTarget;
+        FTYPE dMin;
+        FTYPE dMax;
+        ramp eRamp;
+        FTYPE dRampTime;
+        lane* pLane = nullptr;
+
+        // audio thread
+        FTYPE dCurrent;
+        FTYPE dEnd;
+        FTYPE dStep = 0.0;              // added per sample, or multiplied for exponential ramps
+        bool bMultiply = false;
+        int nRampLeft = 0;
+        int nRampSamples = 1;
+        int nControl = 32;
+        int nCountdown = 0;
+        FTYPE dTimeStep = 1.0 / 44100.0;
+        FTYPE dTime = 0.0;
+
+        // start of a control period, the only place the target is read
+        void update()
+        {
+            FTYPE t = dTarget.load(std::memory_order_relaxed);
+            FTYPE v;
+            if (pLane != nullptr)
+            {
+                if (pLane->sample(dTime, v))
+                    t = std::min(dMax, std::max(dMin, v));
+                else
+                    pLane->capture(dTime, t);
+            }
+            nCountdown = nControl;
+            if (t == dEnd) return;
+
+            dEnd = t;
+            nRampLeft = eRamp == ramp::step ? 0 : nRampSamples;
+            if (nRampLeft == 0)
+            {
+                dCurrent = dEnd;
+                return;
+            }
+            bMultiply = eRamp == ramp::exponential && dCurrent > 0.0 && dEnd > 0.0;
+            dStep = bMultiply ? std::pow(dEnd / dCurrent, 1.0 / nRampLeft) : (dEnd - dCurrent) / nRampLeft;
+        }
+
+    public:
+        parameter(FTYPE dInitial = 0.0, FTYPE dMinimum = 0.0, FTYPE dMaximum = 1.0, ramp r = ramp::linear, FTYPE dRampSeconds = 0.02)
+        {
+            dMin = dMinimum;
+            dMax = dMaximum;
+            eRamp = r;
+            dRampTime = dRampSeconds;
+            dCurrent = dEnd = std::min(dMax, std::max(dMin, dInitial));
+            dTarget.store(dCurrent);
+        }
+
+        parameter(const parameter&) = delete;
+        parameter& operator=(const parameter&) = delete;
+
+        // before audio starts
+        void prepare(int nSampleRate, int nControlRate = 32)
+        {
+            dTimeStep = 1.0 / (FTYPE)nSampleRate;
+            nControl = std::max(1, nControlRate);
+            nRampSamples = std::max(1, (int)(dRampTime * nSampleRate));
+            nCountdown = 0;
+        }
+
+        void attach(lane* pAutomation)
+        {
+            pLane = pAutomation;
+        }
+
+        void range(FTYPE dMinimum, FTYPE dMaximum)
+        {
+            dMin = dMinimum;
+            dMax = dMaximum;
+            reset(get());
+        }
+
+        // jumps straight to dValue without a ramp
+        void reset(FTYPE dValue)
+        {
+            set(dValue);
+            dCurrent = dEnd = get();
+            nRampLeft = 0;
+        }
+
+        // any thread
+        void set(FTYPE dValue)
+        {
+            dTarget.store(std::min(dMax, std::max(dMin, dValue)), std::memory_order_relaxed);
+        }
+
+        FTYPE get() const
+        {
+            return dTarget.load(std::memory_order_relaxed);
+        }
+
+        FTYPE minimum() const { return dMin; }
+        FTYPE maximum() const { return dMax; }
+
+
+        // audio thread: keeps lane playback and recording in step with the block time
+        void begin(FTYPE dBlockTime)
+        {
+            dTime = dBlockTime;
+        }
+
+        // one sample of the smoothed value
+        FTYPE next()
+        {
+            if (nCountdown <= 0)
+                update();
+            nCountdown--;
+            dTime += dTimeStep;
+            if (nRampLeft > 0)
+            {
+                dCurrent = bMultiply ? dCurrent * dStep : dCurrent + dStep;
+                if (--nRampLeft == 0)
+                    dCurrent = dEnd;
+            }
+            return dCurrent;
+        }
+
+        // skips nSamples at control rate and returns the value reached
+        FTYPE advance(int nSamples)
+        {
+            while (nSamples > 0)
+            {
+                if (nCountdown <= 0)
+                    update();
+                int n = std::min(nSamples, nCountdown);
+                nCountdown -= n;
+                nSamples -= n;
+                dTime += n * dTimeStep;
+                if (nRampLeft > 0)
+                {
+                    int m = std::min(n, nRampLeft);
+                    dCurrent = bMultiply ? dCurrent * std::pow(dStep, (FTYPE)m) : dCurrent + dStep * m;
+                    nRampLeft -= m;
+                    if (nRampLeft == 0)
+                        dCurrent = dEnd;
+                }
+            }
+            return dCurrent;
+        }
+
+        int control_period() const
+        {
+            return nControl;
+        }
+
+        FTYPE value() const
+        {
+            return dCurrent;
+        }
+
+        bool ramping() const
+        {
+            return nRampLeft > 0;
+        }
+    };
+
+}
+
+#endif /* ifndef PARAM_H */
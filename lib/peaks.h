@@ -0,0 +1,167 @@
+#pragma once
+#ifndef PEAKS_H
+#define PEAKS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace peaks
+{
+
+    /**
+     * Multi-level min/max decimation of a sample stream. Level k holds one
+     * min/max pair per (nBaseBucket << k) samples, each level in a fixed size
+     * ring, so memory is bounded and any time span can be drawn by reading
+     * roughly one entry per screen column from the best matching level.
+     */
+    class pyramid
+    {
+    private:
+        struct bucket
+        {
+            float min;
+            float max;
+        };
+
+        struct level
+        {
+            std::vector<bucket> ring;
+            uint64_t nCount = 0;    // completed buckets
+            bucket acc{ 0.0f, 0.0f };
+            int nAcc = 0;
+        };
+
+        int nBaseBucket;
+        int nRawMask;
+        int nLevelMask;
+        std::vector<float> vRaw;
+        uint64_t nRawCount = 0;
+        std::vector<level> vLevels;
+
+        void emit(int k, const bucket& b)
+        {
+            level& l = vLevels[k];
+            l.ring[l.nCount & nLevelMask] = b;
+            l.nCount++;
+
+            if (k + 1 >= (int)vLevels.size()) return;
+            level& up = vLevels[k + 1];
+            if (up.nAcc == 0)
+                up.acc = b;
+            else
+                up.acc = { std::min(up.acc.min, b.min), std::max(up.acc.max, b.max) };
+            if (++up.nAcc == 2)
+            {
+                up.nAcc = 0;
+                emit(k + 1, up.acc);
+            }
+        }
+
+        static int pow2(int n)
+        {
+            int p = 1;
+            while (p < n)
+                p <<= 1;
+            return p;
+        }
+
+    public:
+        // nRawCapacity samples are kept for short spans, each level keeps
+        // nLevelCapacity buckets
+        pyramid(int nLevels = 14, int nBase = 16, int nRawCapacity = 1 << 15, int nLevelCapacity = 1 << 12)
+        {
+            nBaseBucket = nBase;
+            vRaw.assign(pow2(nRawCapacity), 0.0f);
+            nRawMask = (int)vRaw.size() - 1;
+            nLevelMask = pow2(nLevelCapacity) - 1;
+            vLevels.resize(nLevels);
+            for (auto& l : vLevels)
+                l.ring.assign(nLevelMask + 1, bucket{ 0.0f, 0.0f });
+        }
+
+        uint64_t count() const
+        {
+            return nRawCount;
+        }
+
+        void push(float sample)
+        {
+            vRaw[nRawCount & nRawMask] = sample;
+            nRawCount++;
+
+            level& l0 = vLevels[0];
+            if (l0.nAcc == 0)
+                l0.acc = { sample, sample };
+            else
+                l0.acc = { std::min(l0.acc.min, sample), std::max(l0.acc.max, sample) };
+            if (++l0.nAcc == nBaseBucket)
+            {
+                l0.nAcc = 0;
+                emit(0, l0.acc);
+            }
+        }
+
+        // min/max of the most recent nSpan samples split into nColumns columns.
+        // Cost is O(nColumns) whatever the span.
+        void query(uint64_t nSpan, int nColumns, float* pMin, float* pMax) const
+        {
+            double dPerColumn = (double)nSpan / (double)nColumns;
+
+            // pick the coarsest level whose bucket still fits inside one column
+            int k = -1;
+            while (k + 1 < (int)vLevels.size() && (double)((uint64_t)nBaseBucket << (k + 1)) <= dPerColumn)
+                k++;
+
+            if (k < 0)
+            {
+                // raw samples
+                uint64_t nEnd = nRawCount;
+                uint64_t nOldest = nRawCount > (uint64_t)vRaw.size() ? nRawCount - vRaw.size() : 0;
+                for (int x = 0; x < nColumns; x++)
+                {
+                    double s0 = (double)nEnd - (double)nSpan + x * dPerColumn;
+                    double s1 = s0 + std::max(1.0, dPerColumn);
+                    float mn = 0.0f, mx = 0.0f;
+                    bool bAny = false;
+                    for (int64_t s = (int64_t)s0; s < (int64_t)s1; s++)
+                    {
+                        if (s < (int64_t)nOldest || s >= (int64_t)nEnd) continue;
+                        float v = vRaw[s & nRawMask];
+                        mn = bAny ? std::min(mn, v) : v;
+                        mx = bAny ? std::max(mx, v) : v;
+                        bAny = true;
+                    }
+                    pMin[x] = mn;
+                    pMax[x] = mx;
+                }
+                return;
+            }
+
+            // the view ends at the last completed bucket of the chosen level
+            const level& l = vLevels[k];
+            double dBuckets = dPerColumn / (double)((uint64_t)nBaseBucket << k);
+            uint64_t nOldest = l.nCount > l.ring.size() ? l.nCount - l.ring.size() : 0;
+            for (int x = 0; x < nColumns; x++)
+            {
+                double b0 = (double)l.nCount - dBuckets * (nColumns - x);
+                double b1 = b0 + dBuckets;
+                float mn = 0.0f, mx = 0.0f;
+                bool bAny = false;
+                for (int64_t b = (int64_t)b0; b < (int64_t)b1; b++)
+                {
+                    if (b < (int64_t)nOldest || b >= (int64_t)l.nCount) continue;
+                    const bucket& e = l.ring[b & nLevelMask];
+                    mn = bAny ? std::min(mn, e.min) : e.min;
+                    mx = bAny ? std::max(mx, e.max) : e.max;
+                    bAny = true;
+                }
+                pMin[x] = mn;
+                pMax[x] = mx;
+            }
+        }
+    };
+
+}
+
+#endif /* ifndef PEAKS_H */
@@ -0,0 +1,237 @@
+#pragma once
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include "sfx.h"
+#include "wav.h"
+
+/**
+ * Records the live output to disk without the audio thread ever touching
+ * the file. push() copies each finished block into a preallocated single
+ * producer, single consumer ring of float frames and returns; a writer
+ * thread drains the ring in CHUNK_FRAMES pieces (whole multiples of 4KB for
+ * every format, after the 4KB wav header) and rewrites the header about once
+ * a second. When the writer falls a whole ring behind the block is dropped
+ * and counted as an overrun, the audio thread never waits.
+ *
+ * Files past 4GB are written as RF64, so captures are only limited by the
+ * disk.
+ */
+namespace recorder
+{
+
+    const size_t CHUNK_FRAMES = 16384;
+
+    class recorder
+    {
+    private:
+        int nChans;
+        int nSampleRate;
+        size_t nCapacity;                   // frames, a power of two and a multiple of CHUNK_FRAMES
+        sfx::aligned_buffer<float> vRing;
+
+        alignas(64) std::atomic<uint64_t> nWrite{ 0 };
+        alignas(64) std::atomic<uint64_t> nRead{ 0 };
+
+        std::atomic<bool> bRecording{ false };
+        std::atomic<bool> bPushing{ false };   // the audio thread is inside push()
+        std::atomic<bool> bStopping{ false };
+        std::atomic<bool> bFailed{ false };
+        std::atomic<uint64_t> nOverruns{ 0 };
+        std::atomic<uint64_t> nDropped{ 0 };
+        std::atomic<uint64_t> nRecorded{ 0 };
+
+        wav::writer file;
+        std::string sPath;
+        std::thread writer;
+
+    public:
+        // dSeconds of ring, enough to ride out slow disks and other programs hogging them
+        recorder(int nChannels, int nRate, double dSeconds = 8.0)
+        {
+            nChans = nChannels;
+            nSampleRate = nRate;
+            nCapacity = CHUNK_FRAMES;
+            while (nCapacity < (size_t)(dSeconds * nSampleRate))
+                nCapacity <<= 1;
+            vRing.allocate(nCapacity * nChans);
+        }
+
+        recorder(const recorder&) = delete;
+        recorder& operator=(const recorder&) = delete;
+
+        ~recorder()
+        {
+            stop();
+        }
+
+        // ui thread, opens the file and starts the writer
+        bool start(const std::string& sFile, wav::sample_format eFormat = wav::sample_format::float32, bool bWavHeader = true)
+        {
+            stop();
+            if (!file.open(sFile, nChans, nSampleRate, eFormat, bWavHeader))
+                return false;
+
+            sPath = sFile;
+            nOverruns.store(0, std::memory_order_relaxed);
+            nDropped.store(0, std::memory_order_relaxed);
+            nRecorded.store(0, std::memory_order_relaxed);
+            bFailed.store(false, std::memory_order_relaxed);
+            bStopping.store(false, std::memory_order_relaxed);
+
+            // stop() waited out any push(), so nothing touches the ring until bRecording is set
+            nWrite.store(0, std::memory_order_relaxed);
+            nRead.store(0, std::memory_order_relaxed);
+            writer = std::thread(&recorder::run, this);
+            bRecording.store(true, std::memory_order_release);
+            return true;
+        }
+
+        // ui thread, writes out what is left in the ring and closes the file
+        void stop()
+        {
+            if (!writer.joinable()) return;
+            bRecording.store(false);
+
+            // a push() that saw bRecording before it was cleared finishes its block, the writer drains it
+            while (bPushing.load())
+                std::this_thread::yield();
+            bStopping.store(true, std::memory_order_release);
+            writer.join();
+        }
+
+        // audio thread, nFrames interleaved frames of the channel count given at construction
+        void push(const FTYPE* samples, int nFrames)
+        {
+            // seq_cst pair with stop(): either it sees bPushing or this sees bRecording cleared
+            bPushing.store(true);
+            if (!bRecording.load())
+            {
+                bPushing.store(false, std::memory_order_release);
+                return;
+            }
+
+            uint64_t w = nWrite.load(std::memory_order_relaxed);
+            uint64_t r = nRead.load(std::memory_order_acquire);
+            if (nCapacity - (w - r) < (size_t)nFrames)
+            {
+                nOverruns.fetch_add(1, std::memory_order_relaxed);
+                nDropped.fetch_add(nFrames, std::memory_order_relaxed);
+                bPushing.store(false, std::memory_order_release);
+                return;
+            }
+
+            // at most two runs, before and after the end of the ring
+            size_t nSlot = (size_t)(w & (nCapacity - 1));
+            size_t nFirst = std::min((size_t)nFrames, nCapacity - nSlot);
+            float* p = vRing.data() + nSlot * nChans;
+            for (size_t i = 0; i < nFirst * nChans; i++)
+                p[i] = (float)samples[i];
+            p = vRing.data();
+            for (size_t i = nFirst * nChans; i < (size_t)nFrames * nChans; i++)
+                *p++ = (float)samples[i];
+
+            nWrite.store(w + nFrames, std::memory_order_release);
+            bPushing.store(false, std::memory_order_release);
+        }
+
+        bool recording() const
+        {
+            return bRecording.load(std::memory_order_relaxed);
+        }
+
+        const std::string& path() const
+        {
+            return sPath;
+        }
+
+        // blocks dropped because the ring was full, and the frames in them
+        uint64_t overruns() const
+        {
+            return nOverruns.load(std::memory_order_relaxed);
+        }
+
+        uint64_t dropped() const
+        {
+            return nDropped.load(std::memory_order_relaxed);
+        }
+
+        // frames on disk
+        uint64_t frames() const
+        {
+            return nRecorded.load(std::memory_order_relaxed);
+        }
+
+        double seconds() const
+        {
+            return frames() / (double)nSampleRate;
+        }
+
+        // how full the ring is, 0 to 1
+        double buffered() const
+        {
+            uint64_t w = nWrite.load(std::memory_order_relaxed);
+            uint64_t r = nRead.load(std::memory_order_relaxed);
+            return w > r ? (w - r) / (double)nCapacity : 0.0;
+        }
+
+        // a write failed (disk full, unplugged), the rest of the recording is thrown away
+        bool failed() const
+        {
+            return bFailed.load(std::memory_order_relaxed);
+        }
+
+    private:
+        void run()
+        {
+            uint64_t nNextHeader = nSampleRate;
+            while (true)
+            {
+                bool bStop = bStopping.load(std::memory_order_acquire);
+                uint64_t w = nWrite.load(std::memory_order_acquire);
+                uint64_t r = nRead.load(std::memory_order_relaxed);
+                size_t nAvailable = (size_t)(w - r);
+                if (nAvailable == 0 && bStop)
+                    break;
+                if (nAvailable < CHUNK_FRAMES && !bStop)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    continue;
+                }
+
+                // r stays a multiple of CHUNK_FRAMES until the final drain, so chunks only wrap then
+                size_t nSlot = (size_t)(r & (nCapacity - 1));
+                size_t n = std::min(std::min(nAvailable, CHUNK_FRAMES), nCapacity - nSlot);
+                if (!bFailed.load(std::memory_order_relaxed))
+                {
+                    if (file.write(vRing.data() + nSlot * nChans, n))
+                        nRecorded.store(file.frames(), std::memory_order_relaxed);
+                    else
+                        bFailed.store(true, std::memory_order_relaxed);
+                }
+                nRead.store(r + n, std::memory_order_release);
+
+                if (file.frames() >= nNextHeader)
+                {
+                    file.update_header();
+                    nNextHeader += nSampleRate;
+                }
+            }
+            if (!file.close())
+                bFailed.store(true, std::memory_order_relaxed);
+        }
+    };
+
+}
+
+#endif /* ifndef RECORDER_H */
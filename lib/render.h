@@ -0,0 +1,120 @@
+#pragma once
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <algorithm>
+#include <vector>
+#include "synth.h"
+
+namespace render
+{
+
+    /**
+     * Sum every playing note at dTime, retiring notes whose envelope finished.
+     * This is the voice mix used by the live engine, the benchmark and offline
+     * renders, so all three produce the same audio for the same notes.
+     */
+    FTYPE mix_notes(std::vector<synth::note>& vNotes, const FTYPE dTime)
+    {
+        FTYPE dMixedOutput = 0.0;
+        for (auto &n : vNotes)
+        {
+            bool bNoteFinished = false;
+            FTYPE dSound = 0.0;
+            if (n.channel != nullptr)
+                dSound = n.channel->sound(dTime, n, bNoteFinished);
+            dMixedOutput += dSound;
+            if (bNoteFinished)
+            {
+                n.active = false;
+                n.channel->env.state = synth::adsr_state::inactive;
+            }
+        }
+        safe_remove<std::vector<synth::note>>(vNotes, [](synth::note const& item) { return item.active; });
+        return dMixedOutput * 0.2;
+    }
+
+    // stereo form of mix_notes, for instruments with a stereo image such as unison stacks
+    void mix_notes_stereo(std::vector<synth::note>& vNotes, const FTYPE dTime, FTYPE& dLeft, FTYPE& dRight)
+    {
+        dLeft = 0.0;
+        dRight = 0.0;
+        for (auto &n : vNotes)
+        {
+            bool bNoteFinished = false;
+            FTYPE l = 0.0, r = 0.0;
+            if (n.channel != nullptr)
+                n.channel->sound_stereo(dTime, n, bNoteFinished, l, r);
+            dLeft += l;
+            dRight += r;
+            if (bNoteFinished)
+            {
+                n.active = false;
+                n.channel->env.state = synth::adsr_state::inactive;
+            }
+        }
+        safe_remove<std::vector<synth::note>>(vNotes, [](synth::note const& item) { return item.active; });
+        dLeft *= 0.2;
+        dRight *= 0.2;
+    }
+
+
+    // a note on/off at a fixed time, a list of these makes a note script
+    struct event
+    {
+        FTYPE dTime;
+        int nNote;
+        bool bOn;
+        FTYPE dVelocity;
+    };
+
+    /**
+     * Offline mono render of a note script through one instrument. Events
+     * must be sorted by time, and are applied the way the UI thread applies
+     * key presses. The instrument's settings are taken in once, the whole
+     * render is one block.
+     */
+    void render_script(synth::instrument_base& instrument, const std::vector<event>& vScript, int nSampleRate, int nFrames, std::vector<FTYPE>& vOut)
+    {
+        std::vector<synth::note> vNotes;
+        vOut.assign(nFrames, 0.0);
+        size_t e = 0;
+        FTYPE dTimeStep = 1.0 / (FTYPE)nSampleRate;
+        instrument.prepare(nSampleRate);
+        instrument.begin(0.0, nFrames);
+
+        for (int i = 0; i < nFrames; i++)
+        {
+            FTYPE dTime = i * dTimeStep;
+            for (; e < vScript.size() && vScript[e].dTime <= dTime; e++)
+            {
+                const event& ev = vScript[e];
+                auto n = std::find_if(vNotes.begin(), vNotes.end(), [&ev](synth::note const& item) { return item.id == ev.nNote; });
+                if (ev.bOn)
+                {
+                    if (n == vNotes.end())
+                    {
+                        synth::note nn;
+                        nn.id = ev.nNote;
+                        nn.on = dTime;
+                        nn.active = true;
+                        nn.channel = &instrument;
+                        nn.velocity = ev.dVelocity;
+                        vNotes.emplace_back(nn);
+                    }
+                    else
+                    {
+                        n->on = dTime;
+                        n->active = true;
+                    }
+                }
+                else if (n != vNotes.end() && n->off < n->on)
+                    n->off = dTime;
+            }
+            vOut[i] = mix_notes(vNotes, dTime);
+        }
+    }
+
+}
+
+#endif /* ifndef RENDER_H */
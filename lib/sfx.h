@@ -6,12 +6,71 @@
 #define FTYPE double
 #endif
 
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstring>
+#include <new>
 #include <stdexcept>
 #include <vector>
+#include "fft.h"
 
 namespace sfx
 {
 
+    // a tail that stays quieter than this (-100dB) is treated as silence. Idle
+    // processes wake on any non-zero input, so the start of a sound is never lost
+    const FTYPE SILENCE = 1e-5;
+
+
+    /**
+     * Tracks when a stateful process has gone quiet so it can be skipped.
+     * bypass() says whether the current input can skip processing entirely,
+     * settle() reports the transition into idle, when the caller should clear
+     * its state.
+     */
+    class silence_gate
+    {
+    private:
+        int nHold;
+        int nQuiet = 0;
+        bool bIdle = true;
+
+    public:
+        silence_gate(int holdSamples = 2048)
+        {
+            nHold = holdSamples;
+        }
+
+        bool idle() const
+        {
+            return bIdle;
+        }
+
+        bool bypass(const FTYPE& in)
+        {
+            if (bIdle && in == 0.0)
+                return true;
+            bIdle = false;
+            return false;
+        }
+
+        bool settle(const FTYPE& in, const FTYPE& out)
+        {
+            if (fabs(in) >= SILENCE || fabs(out) >= SILENCE)
+            {
+                nQuiet = 0;
+                return false;
+            }
+            if (++nQuiet < nHold)
+                return false;
+            nQuiet = 0;
+            bIdle = true;
+            return true;
+        }
+    };
+
+
     class monodelay
     {
     private:
@@ -19,6 +78,12 @@ namespace sfx
         int nSampleRate;
         int nMaxSamples;
         int nPhase = 0;
+
+        // tail tracking, the loop is idle once a whole lap was written with
+        // silent input and nothing above the silence threshold
+        bool bIdle = true;
+        FTYPE dLapPeak = 0.0;
+        int nSilentSamples = 0;
         
     public:        
         monodelay(int sampleRate, FTYPE maxTime)
@@ -33,13 +98,52 @@ namespace sfx
             delete[] memory;
         }
 
+        bool idle() const
+        {
+            return bIdle;
+        }
+
+        void clear()
+        {
+            if (memory != nullptr)
+                memset(memory, 0, nMaxSamples * sizeof(FTYPE));
+            nPhase = 0;
+            dLapPeak = 0.0;
+            nSilentSamples = 0;
+            bIdle = true;
+        }
+
         void process(FTYPE& sample, const FTYPE& time, const FTYPE& feedback, const float& fMix)
         {
             if (memory == nullptr) return;
-            if (nPhase >= (int)(time * nSampleRate) || nPhase >= nMaxSamples)
+
+            bool bSilent = fabs(sample) < SILENCE;
+            if (bIdle)
+            {
+                if (sample == 0.0)
+                {
+                    sample = (1.0 - fMix) * sample;
+                    return;
+                }
+                bIdle = false;
+            }
+            nSilentSamples = bSilent ? nSilentSamples + 1 : 0;
+
+            int nLength = std::min((int)(time * nSampleRate), nMaxSamples);
+            if (nPhase >= nLength)
+            {
+                if (nSilentSamples >= nLength && dLapPeak < SILENCE)
+                {
+                    clear();
+                    sample = (1.0 - fMix) * sample;
+                    return;
+                }
+                dLapPeak = 0.0;
                 nPhase = 0;
+            }
             FTYPE output = memory[nPhase];
-            memory[nPhase++] = output * feedback + sample;
+            memory[nPhase] = output * feedback + sample;
+            dLapPeak = std::max(dLapPeak, fabs(memory[nPhase++]));
             sample = fMix * output + (1.0 - fMix) * sample;
         }
     };
@@ -55,6 +159,14 @@ namespace sfx
         int nPhaseL = 0;
         int nPhaseR = 0;
 
+        // tail tracking, see monodelay
+        bool bIdle = true;
+        bool bQuietL = false;
+        bool bQuietR = false;
+        FTYPE dLapPeakL = 0.0;
+        FTYPE dLapPeakR = 0.0;
+        int nSilentSamples = 0;
+
     public:
         pingpongdelay(int sampleRate, FTYPE maxTime)
         {
@@ -81,23 +193,77 @@ namespace sfx
             }
         };
 
+        bool idle() const
+        {
+            return bIdle;
+        }
+
+        void clear()
+        {
+            memset(memoryL, 0, nMaxSamples * sizeof(FTYPE));
+            memset(memoryR, 0, nMaxSamples * sizeof(FTYPE));
+            nPhaseL = 0;
+            nPhaseR = 0;
+            dLapPeakL = 0.0;
+            dLapPeakR = 0.0;
+            bQuietL = false;
+            bQuietR = false;
+            nSilentSamples = 0;
+            bIdle = true;
+        }
+
         void process(int nChans, FTYPE *samples, const stereo_sample& time, const stereo_sample& fb, const float& fMix = 1.0)
         {
             if (nChans < 2) return;
 
             stereo_sample in(samples[0], samples[1]);
 
-            // boundary check phase counters
-            if (nPhaseL >= (int)(time.l * nSampleRate) || nPhaseL >= nMaxSamples)
+            // skip entirely while the loop is empty and there is no input
+            bool bSilent = fabs(in.l) < SILENCE && fabs(in.r) < SILENCE;
+            if (bIdle)
+            {
+                if (in.l == 0.0 && in.r == 0.0)
+                {
+                    samples[0] = (1.0f - fMix) * in.l;
+                    samples[1] = (1.0f - fMix) * in.r;
+                    return;
+                }
+                bIdle = false;
+            }
+            nSilentSamples = bSilent ? nSilentSamples + 1 : 0;
+
+            // boundary check phase counters, checking each lap for a silent tail
+            int nLengthL = std::min((int)(time.l * nSampleRate), nMaxSamples);
+            int nLengthR = std::min((int)(time.r * nSampleRate), nMaxSamples);
+            if (nPhaseL >= nLengthL)
+            {
+                bQuietL = nSilentSamples >= nLengthL && dLapPeakL < SILENCE;
+                dLapPeakL = 0.0;
                 nPhaseL = 0;
-            if (nPhaseR >= (int)(time.r * nSampleRate) || nPhaseR >= nMaxSamples)
+            }
+            if (nPhaseR >= nLengthR)
+            {
+                bQuietR = nSilentSamples >= nLengthR && dLapPeakR < SILENCE;
+                dLapPeakR = 0.0;
                 nPhaseR = 0;
+            }
+            if (bQuietL && bQuietR && bSilent)
+            {
+                clear();
+                samples[0] = (1.0f - fMix) * in.l;
+                samples[1] = (1.0f - fMix) * in.r;
+                return;
+            }
 
             // perform delay process
             samples[0] = memoryL[nPhaseL];
             samples[1] = memoryR[nPhaseR];
-            memoryL[nPhaseL++] = samples[1] * fb.l + in.l;
-            memoryR[nPhaseR++] = samples[0] * fb.r + in.r;
+            memoryL[nPhaseL] = samples[1] * fb.l + in.l;
+            memoryR[nPhaseR] = samples[0] * fb.r + in.r;
+            dLapPeakL = std::max(dLapPeakL, fabs(memoryL[nPhaseL++]));
+            dLapPeakR = std::max(dLapPeakR, fabs(memoryR[nPhaseR++]));
+            if (dLapPeakL >= SILENCE) bQuietL = false;
+            if (dLapPeakR >= SILENCE) bQuietR = false;
 
             // apply mix
             samples[0] = fMix * samples[0] + (1.0f - fMix) * in.l;
@@ -105,6 +271,270 @@ namespace sfx
         }
     };
 
+
+    /**
+     * Fixed size, cache line aligned array. Only for trivially destructible types.
+     */
+    template<class T>
+    class aligned_buffer
+    {
+    private:
+        T* memory = nullptr;
+        size_t nCount = 0;
+        static const size_t ALIGNMENT = 64;
+
+    public:
+        aligned_buffer() {}
+        aligned_buffer(const aligned_buffer&) = delete;
+        aligned_buffer& operator=(const aligned_buffer&) = delete;
+
+        ~aligned_buffer()
+        {
+            release();
+        }
+
+        void allocate(size_t count)
+        {
+            release();
+            nCount = count;
+            memory = static_cast<T*>(::operator new(sizeof(T) * std::max<size_t>(1, count), std::align_val_t(ALIGNMENT)));
+            std::fill(memory, memory + nCount, T());
+        }
+
+        void release()
+        {
+            if (memory != nullptr)
+                ::operator delete(memory, std::align_val_t(ALIGNMENT));
+            memory = nullptr;
+            nCount = 0;
+        }
+
+        void clear()
+        {
+            std::fill(memory, memory + nCount, T());
+        }
+
+        T* data() { return memory; }
+        const T* data() const { return memory; }
+        size_t size() const { return nCount; }
+        T& operator[](size_t i) { return memory[i]; }
+        const T& operator[](size_t i) const { return memory[i]; }
+    };
+
+
+    /**
+     * Zero latency convolution. The first partition of the impulse response
+     * runs as a direct form FIR, the rest is uniformly partitioned overlap-save
+     * in the frequency domain with a frequency domain delay line. Partition
+     * spectra are computed once in load(), which also does every allocation,
+     * so call it before audio starts.
+     */
+    class convolver
+    {
+    private:
+        typedef std::complex<FTYPE> cplx;
+
+        int nPartition = 0;     // samples per partition, B
+        int nFFTSize = 0;       // 2B
+        int nBins = 0;          // B + 1, the input is real so the upper half is implied
+        int nTail = 0;          // partitions after the direct form head
+        int nLength = 0;
+        const fft_plan* plan = nullptr;
+
+        aligned_buffer<FTYPE> vHead;        // first partition, reversed
+        aligned_buffer<FTYPE> vHistory;     // last B inputs, stored twice so the FIR reads contiguously
+        aligned_buffer<FTYPE> vFrame;       // previous and current input block
+        aligned_buffer<FTYPE> vTailOut;     // tail output for the current block
+        // spectra are stored as split real/imaginary arrays so the multiply-accumulate vectorises
+        aligned_buffer<FTYPE> vSpectraRe;   // nTail partition spectra
+        aligned_buffer<FTYPE> vSpectraIm;
+        aligned_buffer<FTYPE> vFDLRe;       // nTail most recent input spectra
+        aligned_buffer<FTYPE> vFDLIm;
+        aligned_buffer<FTYPE> vAccumRe;
+        aligned_buffer<FTYPE> vAccumIm;
+        aligned_buffer<cplx> vWork;
+
+        int nHistoryPos = 0;
+        int nBlockPos = 0;
+        int nFDLPos = 0;
+        int nSilentSamples = 0;
+        bool bIdle = true;
+
+        void process_partitions()
+        {
+            // spectrum of the last two input blocks into the delay line
+            for (int i = 0; i < nFFTSize; i++)
+                vWork[i] = cplx(vFrame[i], 0.0);
+            plan->forward(vWork.data());
+            FTYPE* pNewRe = vFDLRe.data() + (size_t)nFDLPos * nBins;
+            FTYPE* pNewIm = vFDLIm.data() + (size_t)nFDLPos * nBins;
+            for (int k = 0; k < nBins; k++)
+            {
+                pNewRe[k] = vWork[k].real();
+                pNewIm[k] = vWork[k].imag();
+            }
+
+            // partition j (1 based) pairs with the input spectrum j-1 blocks back
+            FTYPE* ar = vAccumRe.data();
+            FTYPE* ai = vAccumIm.data();
+            std::fill(ar, ar + nBins, 0.0);
+            std::fill(ai, ai + nBins, 0.0);
+            for (int j = 0; j < nTail; j++)
+            {
+                int nSlot = nFDLPos - j;
+                if (nSlot < 0) nSlot += nTail;
+                const FTYPE* xr = vFDLRe.data() + (size_t)nSlot * nBins;
+                const FTYPE* xi = vFDLIm.data() + (size_t)nSlot * nBins;
+                const FTYPE* hr = vSpectraRe.data() + (size_t)j * nBins;
+                const FTYPE* hi = vSpectraIm.data() + (size_t)j * nBins;
+                for (int k = 0; k < nBins; k++)
+                {
+                    ar[k] += xr[k] * hr[k] - xi[k] * hi[k];
+                    ai[k] += xr[k] * hi[k] + xi[k] * hr[k];
+                }
+            }
+
+            // rebuild the full spectrum from its conjugate symmetric half and invert
+            for (int k = 0; k < nBins; k++)
+                vWork[k] = cplx(ar[k], ai[k]);
+            for (int k = 1; k < nPartition; k++)
+                vWork[nFFTSize - k] = cplx(ar[k], -ai[k]);
+            plan->inverse(vWork.data());
+
+            // overlap-save keeps the second half, it is the output for the next block
+            for (int i = 0; i < nPartition; i++)
+                vTailOut[i] = vWork[nPartition + i].real();
+
+            std::copy(vFrame.data() + nPartition, vFrame.data() + nFFTSize, vFrame.data());
+            nFDLPos = nTail > 0 ? (nFDLPos + 1) % nTail : 0;
+        }
+
+    public:
+        // nPartitionSize must be a power of two
+        bool load(const std::vector<FTYPE>& vImpulse, int nPartitionSize = 512)
+        {
+            if (vImpulse.empty() || !fft_is_pow2(nPartitionSize)) return false;
+
+            nPartition = nPartitionSize;
+            nFFTSize = nPartition * 2;
+            nBins = nPartition + 1;
+            nLength = (int)vImpulse.size();
+            nTail = std::max(0, (nLength - 1) / nPartition);
+            plan = &fft_get_plan(nFFTSize);
+
+            vHead.allocate(nPartition);
+            vHistory.allocate(nPartition * 2);
+            vFrame.allocate(nFFTSize);
+            vTailOut.allocate(nPartition);
+            vSpectraRe.allocate((size_t)std::max(1, nTail) * nBins);
+            vSpectraIm.allocate((size_t)std::max(1, nTail) * nBins);
+            vFDLRe.allocate((size_t)std::max(1, nTail) * nBins);
+            vFDLIm.allocate((size_t)std::max(1, nTail) * nBins);
+            vAccumRe.allocate(nBins);
+            vAccumIm.allocate(nBins);
+            vWork.allocate(nFFTSize);
+
+            for (int i = 0; i < nPartition && i < nLength; i++)
+                vHead[nPartition - 1 - i] = vImpulse[i];
+
+            for (int j = 0; j < nTail; j++)
+            {
+                for (int i = 0; i < nFFTSize; i++)
+                {
+                    int n = (j + 1) * nPartition + i;
+                    vWork[i] = cplx(i < nPartition && n < nLength ? vImpulse[n] : 0.0, 0.0);
+                }
+                plan->forward(vWork.data());
+                for (int k = 0; k < nBins; k++)
+                {
+                    vSpectraRe[(size_t)j * nBins + k] = vWork[k].real();
+                    vSpectraIm[(size_t)j * nBins + k] = vWork[k].imag();
+                }
+            }
+
+            clear();
+            return true;
+        }
+
+        bool loaded() const
+        {
+            return plan != nullptr;
+        }
+
+        bool idle() const
+        {
+            return bIdle;
+        }
+
+        void clear()
+        {
+            vHistory.clear();
+            vFrame.clear();
+            vTailOut.clear();
+            vFDLRe.clear();
+            vFDLIm.clear();
+            nHistoryPos = 0;
+            nBlockPos = 0;
+            nFDLPos = 0;
+            nSilentSamples = 0;
+            bIdle = true;
+        }
+
+        // one sample in, one wet sample out, no latency
+        FTYPE process(const FTYPE& in)
+        {
+            if (plan == nullptr) return 0.0;
+
+            // once the whole response has rung out on silent input there is nothing to do
+            if (fabs(in) < SILENCE)
+            {
+                if (bIdle && in == 0.0) return 0.0;
+                bIdle = false;
+                if (++nSilentSamples > nLength + 2 * nPartition)
+                {
+                    clear();
+                    return 0.0;
+                }
+            }
+            else
+            {
+                nSilentSamples = 0;
+                bIdle = false;
+            }
+
+            // direct form head
+            vHistory[nHistoryPos] = in;
+            vHistory[nHistoryPos + nPartition] = in;
+            const FTYPE* x = vHistory.data() + nHistoryPos + 1;
+            const FTYPE* h = vHead.data();
+            FTYPE out = 0.0;
+            for (int i = 0; i < nPartition; i++)
+                out += h[i] * x[i];
+            nHistoryPos = (nHistoryPos + 1) % nPartition;
+
+            // frequency domain tail, computed a block ahead
+            out += vTailOut[nBlockPos];
+            vFrame[nPartition + nBlockPos] = in;
+            if (++nBlockPos == nPartition)
+            {
+                nBlockPos = 0;
+                if (nTail > 0)
+                    process_partitions();
+            }
+            return out;
+        }
+
+        // in place over an interleaved block, adding the wet signal scaled by fMix
+        void process(FTYPE* samples, int nFrames, int nStride, const float& fMix)
+        {
+            for (int n = 0; n < nFrames; n++)
+            {
+                FTYPE& s = samples[n * nStride];
+                s += fMix * process(s);
+            }
+        }
+    };
+
 }
 
 #endif /* ifndef SFX_H */
\ No newline at end of file
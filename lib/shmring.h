@@ -0,0 +1,427 @@
+#pragma once
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Rendered audio in a named shared memory ring, for other processes on the
+ * same host (a recorder, an analyser). One writer, any number of readers, and
+ * nobody waits on anybody: the writer never blocks, a reader that falls more
+ * than a ring behind skips ahead and counts the frames it lost.
+ *
+ * The mapping is a header followed by nCapacity interleaved float32 frames.
+ * The writer bumps the write index before it touches the ring and the frame
+ * counter after, so a reader that copies frames and then rereads the write
+ * index knows which of them may have been overwritten meanwhile (a seqlock
+ * over the whole ring). Both are absolute frame numbers, the slot is the
+ * number modulo nCapacity.
+ *
+ * POSIX shared memory (shm_open) or a Windows page file mapping.
+ */
+namespace shmring
+{
+
+    const char MAGIC[8] = { 'S', 'Y', 'N', 'T', 'H', 'R', 'N', 'G' };
+    const uint32_t VERSION = 1;
+
+    enum class format : uint32_t
+    {
+        float32 = 1
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring needs lock free 64 bit atomics to work across processes");
+
+    struct header
+    {
+        char sMagic[8];                     // written last by the writer, readers wait for it
+        uint32_t nVersion;
+        uint32_t nHeaderBytes;              // the ring starts here
+        uint32_t nChannels;
+        uint32_t nSampleRate;
+        uint32_t nCapacity;                 // frames, a power of two
+        format eFormat;
+        alignas(64) std::atomic<uint64_t> nWriteIndex;      // frames the writer has started on
+        alignas(64) std::atomic<uint64_t> nFrameCounter;    // frames complete and readable
+        std::atomic<uint64_t> nBlocks;
+        std::atomic<uint32_t> bClosed;      // set when the writer goes away
+    };
+
+    size_t header_bytes()
+    {
+        return (sizeof(header) + 63) & ~(size_t)63;
+    }
+
+
+    // a named mapping, created by the writer and opened read only by readers
+    class mapping
+    {
+    private:
+        void* pMemory = nullptr;
+        size_t nBytes = 0;
+        std::string sName;
+        bool bOwner = false;
+#ifdef _WIN32
+        HANDLE hMapping = NULL;
+#endif
+
+    public:
+        mapping() {}
+        mapping(const mapping&) = delete;
+        mapping& operator=(const mapping&) = delete;
+
+        ~mapping()
+        {
+            close();
+        }
+
+        bool create(const std::string& sMappingName, size_t nSize)
+        {
+            close();
+#ifdef _WIN32
+            sName = "Local\\" + sMappingName;
+            hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)nSize >> 32), (DWORD)nSize, sName.c_str());
+            if (hMapping == NULL) return false;
+            pMemory = MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, nSize);
+#else
+            sName = "/" + sMappingName;
+            shm_unlink(sName.c_str());      // a stale ring from a writer that crashed
+            int fd = shm_open(sName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+            if (fd < 0) return false;
+            if (ftruncate(fd, (off_t)nSize) != 0)
+            {
+                ::close(fd);
+                shm_unlink(sName.c_str());
+                return false;
+            }
+            pMemory = mmap(nullptr, nSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (pMemory == MAP_FAILED)
+                pMemory = nullptr;
+#endif
+            bOwner = true;
+            nBytes = nSize;
+            if (pMemory == nullptr)
+            {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        bool open(const std::string& sMappingName)
+        {
+            close();
+#ifdef _WIN32
+            sName = "Local\\" + sMappingName;
+            hMapping = OpenFileMappingA(FILE_MAP_READ, FALSE, sName.c_str());
+            if (hMapping == NULL) return false;
+            pMemory = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+            MEMORY_BASIC_INFORMATION info;
+            if (pMemory != nullptr && VirtualQuery(pMemory, &info, sizeof(info)) != 0)
+                nBytes = info.RegionSize;
+#else
+            sName = "/" + sMappingName;
+            int fd = shm_open(sName.c_str(), O_RDONLY, 0);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0)
+            {
+                nBytes = (size_t)st.st_size;
+                pMemory = mmap(nullptr, nBytes, PROT_READ, MAP_SHARED, fd, 0);
+                if (pMemory == MAP_FAILED)
+                    pMemory = nullptr;
+            }
+            ::close(fd);
+#endif
+            if (pMemory == nullptr)
+            {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        void close()
+        {
+#ifdef _WIN32
+            if (pMemory != nullptr)
+                UnmapViewOfFile(pMemory);
+            if (hMapping != NULL)
+                CloseHandle(hMapping);
+            hMapping = NULL;
+#else
+            if (pMemory != nullptr)
+                munmap(pMemory, nBytes);
+            if (bOwner)
+                shm_unlink(sName.c_str());
+#endif
+            pMemory = nullptr;
+            nBytes = 0;
+            bOwner = false;
+        }
+
+        void* data() const
+        {
+            return pMemory;
+        }
+
+        size_t size() const
+        {
+            return nBytes;
+        }
+    };
+
+
+    class writer
+    {
+    private:
+        mapping map;
+        header* pHeader = nullptr;
+        float* pRing = nullptr;
+        uint32_t nMask = 0;
+        int nChans = 0;
+        uint64_t nPosition = 0;
+
+    public:
+        writer() {}
+        writer(const writer&) = delete;
+        writer& operator=(const writer&) = delete;
+
+        ~writer()
+        {
+            close();
+        }
+
+        // nCapacityFrames is rounded up to a power of two
+        bool create(const std::string& sName, int nChannels, int nSampleRate, int nCapacityFrames = 1 << 16)
+        {
+            close();
+            uint32_t nCapacity = 1;
+            while (nCapacity < (uint32_t)nCapacityFrames)
+                nCapacity <<= 1;
+            size_t nSize = header_bytes() + sizeof(float) * nChannels * nCapacity;
+            if (!map.create(sName, nSize))
+                return false;
+
+            pHeader = new (map.data()) header();
+            pHeader->nVersion = VERSION;
+            pHeader->nHeaderBytes = (uint32_t)header_bytes();
+            pHeader->nChannels = (uint32_t)nChannels;
+            pHeader->nSampleRate = (uint32_t)nSampleRate;
+            pHeader->nCapacity = nCapacity;
+            pHeader->eFormat = format::float32;
+            pHeader->nWriteIndex.store(0, std::memory_order_relaxed);
+            pHeader->nFrameCounter.store(0, std::memory_order_relaxed);
+            pHeader->nBlocks.store(0, std::memory_order_relaxed);
+            pHeader->bClosed.store(0, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(pHeader->sMagic, MAGIC, sizeof(MAGIC));
+
+            pRing = reinterpret_cast<float*>(static_cast<char*>(map.data()) + header_bytes());
+            nMask = nCapacity - 1;
+            nChans = nChannels;
+            nPosition = 0;
+            return true;
+        }
+
+        void close()
+        {
+            if (pHeader != nullptr)
+                pHeader->bClosed.store(1, std::memory_order_release);
+            map.close();
+            pHeader = nullptr;
+            pRing = nullptr;
+        }
+
+        bool is_open() const
+        {
+            return pHeader != nullptr;
+        }
+
+        // audio thread, interleaved frames converted straight into the ring
+        void write(const FTYPE* samples, int nFrames)
+        {
+            if (pHeader == nullptr) return;
+            nFrames = std::min<int>(nFrames, (int)nMask + 1);
+
+            pHeader->nWriteIndex.store(nPosition + nFrames, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            uint32_t nSlot = (uint32_t)(nPosition & nMask);
+            int nFirst = std::min<int>(nFrames, (int)(nMask + 1 - nSlot));
+            float* out = pRing + (size_t)nSlot * nChans;
+            for (int i = 0; i < nFirst * nChans; i++)
+                out[i] = (float)samples[i];
+            for (int i = nFirst * nChans; i < nFrames * nChans; i++)
+                pRing[i - nFirst * nChans] = (float)samples[i];
+
+            nPosition += nFrames;
+            pHeader->nFrameCounter.store(nPosition, std::memory_order_release);
+            pHeader->nBlocks.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        uint64_t position() const
+        {
+            return nPosition;
+        }
+    };
+
+
+    class reader
+    {
+    public:
+        // up to two runs of interleaved frames, the second one after the ring wraps
+        struct view
+        {
+            const float* pFirst = nullptr;
+            int nFirst = 0;
+            const float* pSecond = nullptr;
+            int nSecond = 0;
+            uint64_t nStart = 0;
+
+            int frames() const { return nFirst + nSecond; }
+        };
+
+    private:
+        mapping map;
+        const header* pHeader = nullptr;
+        const float* pRing = nullptr;
+        uint32_t nMask = 0;
+        int nChans = 0;
+        uint64_t nPosition = 0;
+        uint64_t nLost = 0;
+
+        // the oldest frame that can still be trusted after reading
+        uint64_t oldest_valid() const
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t w = pHeader->nWriteIndex.load(std::memory_order_relaxed);
+            return w > nMask + 1 ? w - (nMask + 1) : 0;
+        }
+
+    public:
+        reader() {}
+        reader(const reader&) = delete;
+        reader& operator=(const reader&) = delete;
+
+        // bFromOldest starts with whatever is still in the ring rather than at the live position
+        bool open(const std::string& sName, bool bFromOldest = false)
+        {
+            pHeader = nullptr;
+            if (!map.open(sName) || map.size() < header_bytes())
+                return false;
+            const header* h = static_cast<const header*>(map.data());
+            if (memcmp(h->sMagic, MAGIC, sizeof(MAGIC)) != 0)
+                return false;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (h->nVersion != VERSION || h->eFormat != format::float32 || h->nCapacity == 0 || (h->nCapacity & (h->nCapacity - 1)) != 0
+                || map.size() < h->nHeaderBytes + sizeof(float) * h->nChannels * h->nCapacity)
+                return false;
+
+            pHeader = h;
+            pRing = reinterpret_cast<const float*>(static_cast<const char*>(map.data()) + h->nHeaderBytes);
+            nMask = h->nCapacity - 1;
+            nChans = (int)h->nChannels;
+            nPosition = bFromOldest ? oldest_valid() : pHeader->nFrameCounter.load(std::memory_order_acquire);
+            nLost = 0;
+            return true;
+        }
+
+        bool is_open() const { return pHeader != nullptr; }
+        int channels() const { return nChans; }
+        int sample_rate() const { return (int)pHeader->nSampleRate; }
+        int capacity() const { return (int)nMask + 1; }
+        bool closed() const { return pHeader->bClosed.load(std::memory_order_acquire) != 0; }
+        uint64_t position() const { return nPosition; }
+        uint64_t lost() const { return nLost; }
+        uint64_t blocks() const { return pHeader->nBlocks.load(std::memory_order_relaxed); }
+
+        // frames written but not read yet
+        uint64_t available() const
+        {
+            return pHeader->nFrameCounter.load(std::memory_order_acquire) - nPosition;
+        }
+
+        /**
+         * Zero copy read: points v at up to nMaxFrames frames inside the ring.
+         * Use them, then call release(v), which says whether the writer lapped
+         * them in the meantime. Frames the writer already overwrote before the
+         * call are skipped and counted as lost.
+         */
+        int acquire(view& v, int nMaxFrames)
+        {
+            uint64_t nEnd = pHeader->nFrameCounter.load(std::memory_order_acquire);
+            uint64_t nOldest = oldest_valid();
+            if (nPosition < nOldest)
+            {
+                nLost += nOldest - nPosition;
+                nPosition = nOldest;
+            }
+
+            // nWriteIndex runs ahead of nFrameCounter while a block is written, so the skip can pass nEnd
+            nEnd = std::max(nEnd, nPosition);
+            int nFrames = (int)std::min<uint64_t>(nEnd - nPosition, (uint64_t)std::max(0, nMaxFrames));
+            uint32_t nSlot = (uint32_t)(nPosition & nMask);
+            v.nStart = nPosition;
+            v.nFirst = std::min<int>(nFrames, (int)(nMask + 1 - nSlot));
+            v.pFirst = pRing + (size_t)nSlot * nChans;
+            v.nSecond = nFrames - v.nFirst;
+            v.pSecond = pRing;
+            return nFrames;
+        }
+
+        // true when every frame of v was still intact, either way the reader moves past them
+        bool release(const view& v)
+        {
+            uint64_t nOldest = oldest_valid();
+            nPosition = v.nStart + v.frames();
+            if (v.nStart >= nOldest)
+                return true;
+            nLost += std::min<uint64_t>(nOldest - v.nStart, v.frames());
+            return false;
+        }
+
+        // copies up to nMaxFrames interleaved frames, returns how many of them are good
+        int read(float* out, int nMaxFrames)
+        {
+            view v;
+            int nFrames = acquire(v, nMaxFrames);
+            memcpy(out, v.pFirst, sizeof(float) * v.nFirst * nChans);
+            memcpy(out + (size_t)v.nFirst * nChans, v.pSecond, sizeof(float) * v.nSecond * nChans);
+            uint64_t nOldest = oldest_valid();
+            release(v);
+            if (v.nStart >= nOldest)
+                return nFrames;
+
+            // drop the frames that were overwritten while copying, they are at the front
+            int nBad = (int)std::min<uint64_t>(nOldest - v.nStart, (uint64_t)nFrames);
+            memmove(out, out + (size_t)nBad * nChans, sizeof(float) * (nFrames - nBad) * nChans);
+            return nFrames - nBad;
+        }
+    };
+
+}
+
+#endif /* ifndef SHMRING_H */
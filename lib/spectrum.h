@@ -0,0 +1,202 @@
+#pragma once
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+namespace spectrum
+{
+
+    enum class aggregate
+    {
+        max,
+        rms
+    };
+
+    enum class bands
+    {
+        none,
+        third_octave,
+        twelfth_octave
+    };
+
+    const char* aggregate_name(aggregate eMode)
+    {
+        return eMode == aggregate::max ? "Max" : "RMS";
+    }
+
+    const char* bands_name(bands eBands)
+    {
+        switch (eBands)
+        {
+        case bands::none: return "Off";
+        case bands::third_octave: return "1/3 Oct";
+        case bands::twelfth_octave: return "1/12 Oct";
+        }
+        return "";
+    }
+
+    // reduce bins [nLo, nHi) of a magnitude spectrum to a single value
+    double reduce(const double* mag, int nLo, int nHi, aggregate eMode)
+    {
+        if (nHi <= nLo) return 0.0;
+        if (eMode == aggregate::max)
+        {
+            double d = mag[nLo];
+            for (int i = nLo + 1; i < nHi; i++)
+                d = std::max(d, mag[i]);
+            return d;
+        }
+        double dSum = 0.0;
+        for (int i = nLo; i < nHi; i++)
+            dSum += mag[i] * mag[i];
+        return sqrt(dSum / (nHi - nLo));
+    }
+
+
+    /**
+     * Maps screen columns to fft bin ranges on a log frequency axis. The table
+     * is only rebuilt when the column count, fft size or sample rate change.
+     */
+    class column_map
+    {
+    private:
+        int nColumns = 0;
+        int nFFTSize = 0;
+        double dSampleRate = 0.0;
+        double dMinHz = 20.0;
+        std::vector<std::pair<int, int>> vRanges;
+
+    public:
+        bool rebuild(int columns, int fftSize, double sampleRate, double minHz = 20.0)
+        {
+            if (columns == nColumns && fftSize == nFFTSize && sampleRate == dSampleRate && minHz == dMinHz)
+                return false;
+
+            nColumns = columns;
+            nFFTSize = fftSize;
+            dSampleRate = sampleRate;
+            dMinHz = minHz;
+
+            int nBins = nFFTSize / 2;
+            double dBinHz = dSampleRate / nFFTSize;
+            double dMaxHz = dSampleRate / 2.0;
+            vRanges.resize(nColumns);
+            for (int x = 0; x < nColumns; x++)
+            {
+                double fLo = dMinHz * pow(dMaxHz / dMinHz, (double)x / nColumns);
+                double fHi = dMinHz * pow(dMaxHz / dMinHz, (double)(x + 1) / nColumns);
+                int nLo = std::min(nBins - 1, (int)(fLo / dBinHz));
+                int nHi = std::min(nBins, std::max(nLo + 1, (int)(fHi / dBinHz)));
+                vRanges[x] = { nLo, nHi };
+            }
+            return true;
+        }
+
+        int columns() const { return nColumns; }
+        const std::pair<int, int>& range(int x) const { return vRanges[x]; }
+
+        // column position of a frequency on the same axis
+        double column_of(double dHz) const
+        {
+            return nColumns * log(std::max(dHz, dMinHz) / dMinHz) / log(dSampleRate / 2.0 / dMinHz);
+        }
+
+        void apply(const double* mag, double* out, aggregate eMode) const
+        {
+            for (int x = 0; x < nColumns; x++)
+                out[x] = reduce(mag, vRanges[x].first, vRanges[x].second, eMode);
+        }
+    };
+
+
+    /**
+     * Fractional octave bands (base 2, centred on 1kHz). Each bin is assigned
+     * to one band up front, so aggregating is a single pass over the spectrum.
+     */
+    class band_map
+    {
+    private:
+        bands eBands = bands::none;
+        int nFFTSize = 0;
+        double dSampleRate = 0.0;
+        std::vector<int> vBinBand;
+        std::vector<double> vLowerHz;
+        std::vector<double> vUpperHz;
+        std::vector<int> vBinCount;
+
+    public:
+        bool rebuild(bands b, int fftSize, double sampleRate, double minHz = 20.0)
+        {
+            if (b == eBands && fftSize == nFFTSize && sampleRate == dSampleRate)
+                return false;
+
+            eBands = b;
+            nFFTSize = fftSize;
+            dSampleRate = sampleRate;
+            vLowerHz.clear();
+            vUpperHz.clear();
+            vBinBand.assign(nFFTSize / 2, -1);
+            if (eBands == bands::none) return true;
+
+            int nPerOctave = eBands == bands::third_octave ? 3 : 12;
+            double dMaxHz = dSampleRate / 2.0;
+            int kMin = (int)floor(nPerOctave * log2(minHz / 1000.0));
+            for (int k = kMin; ; k++)
+            {
+                double fc = 1000.0 * pow(2.0, (double)k / nPerOctave);
+                double fLo = fc * pow(2.0, -0.5 / nPerOctave);
+                double fHi = fc * pow(2.0, 0.5 / nPerOctave);
+                if (fLo >= dMaxHz) break;
+                vLowerHz.push_back(fLo);
+                vUpperHz.push_back(std::min(fHi, dMaxHz));
+            }
+
+            double dBinHz = dSampleRate / nFFTSize;
+            vBinCount.assign(vLowerHz.size(), 0);
+            int nBand = 0;
+            for (int i = 0; i < nFFTSize / 2; i++)
+            {
+                double f = i * dBinHz;
+                while (nBand < (int)vUpperHz.size() && f >= vUpperHz[nBand])
+                    nBand++;
+                if (nBand >= (int)vUpperHz.size()) break;
+                if (f >= vLowerHz[nBand])
+                {
+                    vBinBand[i] = nBand;
+                    vBinCount[nBand]++;
+                }
+            }
+            return true;
+        }
+
+        int count() const { return (int)vLowerHz.size(); }
+        double lower(int nBand) const { return vLowerHz[nBand]; }
+        double upper(int nBand) const { return vUpperHz[nBand]; }
+
+        // out must hold count() values, bands without any bins read 0
+        void apply(const double* mag, double* out, aggregate eMode) const
+        {
+            std::fill(out, out + count(), 0.0);
+            for (int i = 0; i < (int)vBinBand.size(); i++)
+            {
+                int b = vBinBand[i];
+                if (b < 0) continue;
+                if (eMode == aggregate::max)
+                    out[b] = std::max(out[b], mag[i]);
+                else
+                    out[b] += mag[i] * mag[i];
+            }
+            if (eMode == aggregate::rms)
+                for (int b = 0; b < count(); b++)
+                    if (vBinCount[b] > 0)
+                        out[b] = sqrt(out[b] / vBinCount[b]);
+        }
+    };
+
+}
+
+#endif /* ifndef SPECTRUM_H */
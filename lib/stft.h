@@ -0,0 +1,166 @@
+#pragma once
+#ifndef STFT_H
+#define STFT_H
+
+#include <atomic>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <vector>
+#include "fft.h"
+
+namespace stft
+{
+
+    enum class window_type
+    {
+        hann,
+        blackman_harris
+    };
+
+    const char* window_name(window_type eWindow)
+    {
+        switch (eWindow)
+        {
+        case window_type::hann: return "Hann";
+        case window_type::blackman_harris: return "Blackman-Harris";
+        }
+        return "";
+    }
+
+    void make_window(window_type eWindow, int nSize, std::vector<double>& vWindow)
+    {
+        vWindow.resize(nSize);
+        for (int i = 0; i < nSize; i++)
+        {
+            double x = 2.0 * FFT_PI * i / (double)nSize;
+            switch (eWindow)
+            {
+            case window_type::hann:
+                vWindow[i] = 0.5 - 0.5 * cos(x);
+                break;
+            case window_type::blackman_harris:
+                vWindow[i] = 0.35875 - 0.48829 * cos(x) + 0.14128 * cos(2.0 * x) - 0.01168 * cos(3.0 * x);
+                break;
+            }
+        }
+    }
+
+
+    /**
+     * Single writer sample history. The audio thread pushes samples, the
+     * analysis side reads windows that end at any recent write position.
+     */
+    class history
+    {
+    private:
+        std::vector<double> vBuffer;
+        int nMask = 0;
+        std::atomic<uint64_t> nWritten{ 0 };
+
+    public:
+        history(int nCapacity = 1 << 16)
+        {
+            int n = 1;
+            while (n < nCapacity)
+                n <<= 1;
+            vBuffer.assign(n, 0.0);
+            nMask = n - 1;
+        }
+
+        int capacity() const
+        {
+            return nMask + 1;
+        }
+
+        uint64_t written() const
+        {
+            return nWritten.load(std::memory_order_acquire);
+        }
+
+        void push(double sample)
+        {
+            uint64_t n = nWritten.load(std::memory_order_relaxed);
+            vBuffer[n & nMask] = sample;
+            nWritten.store(n + 1, std::memory_order_release);
+        }
+
+        // copy the nCount samples that precede position nEnd
+        void read(uint64_t nEnd, int nCount, double* out) const
+        {
+            for (int i = 0; i < nCount; i++)
+            {
+                uint64_t n = nEnd - nCount + i;
+                out[i] = (nEnd >= (uint64_t)(nCount - i)) ? vBuffer[n & nMask] : 0.0;
+            }
+        }
+    };
+
+
+    /**
+     * Produces one windowed magnitude spectrum (in dB) per hop from a history.
+     */
+    class analyzer
+    {
+    private:
+        int nFFTSize = 0;
+        int nHopSize = 0;
+        window_type eWindow = window_type::hann;
+        std::vector<double> vWindow;
+        std::vector<double> vFrame;
+        std::vector<std::complex<double>> vSpectrum;
+        const fft_plan* plan = nullptr;
+        double dNorm = 1.0;
+        uint64_t nNextEnd = 0;
+
+    public:
+        void setup(int fftSize, int hopSize, window_type window)
+        {
+            nFFTSize = fftSize;
+            nHopSize = std::max(1, hopSize);
+            eWindow = window;
+            make_window(eWindow, nFFTSize, vWindow);
+            vFrame.resize(nFFTSize);
+            vSpectrum.resize(nFFTSize);
+            plan = &fft_get_plan(nFFTSize);
+
+            // normalise so a full scale sine reads 0 dB
+            double dSum = 0.0;
+            for (double w : vWindow)
+                dSum += w;
+            dNorm = 2.0 / dSum;
+        }
+
+        int fft_size() const { return nFFTSize; }
+        int hop_size() const { return nHopSize; }
+        int bins() const { return nFFTSize / 2; }
+        window_type window() const { return eWindow; }
+
+        // computes the next pending column into out (bins() values), returns
+        // false when the history has not advanced by a full hop yet
+        bool next_column(const history& h, double* out)
+        {
+            if (plan == nullptr) return false;
+
+            uint64_t nWritten = h.written();
+            if (nNextEnd + h.capacity() - nFFTSize < nWritten)
+                nNextEnd = nWritten - (nWritten % nHopSize);   // fell too far behind, skip ahead
+            if (nNextEnd > nWritten)
+                return false;
+
+            h.read(nNextEnd, nFFTSize, vFrame.data());
+            for (int i = 0; i < nFFTSize; i++)
+                vSpectrum[i] = std::complex<double>(vFrame[i] * vWindow[i], 0.0);
+            plan->forward(vSpectrum.data());
+
+            for (int i = 0; i < nFFTSize / 2; i++)
+                out[i] = 20.0 * log10(std::abs(vSpectrum[i]) * dNorm + 1e-12);
+
+            nNextEnd += nHopSize;
+            return true;
+        }
+    };
+
+}
+
+#endif /* ifndef STFT_H */
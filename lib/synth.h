@@ -8,6 +8,9 @@
 
 #include "olcNoiseMaker.h"
 #include "wavegen.h"
+#include "fastmath.h"
+#include "param.h"
+#include <atomic>
 #include "unordered_map"
 
 namespace synth
@@ -47,9 +50,137 @@ namespace synth
         bool operator==(const note& other) { return id == other.id; };
     };
 
-    FTYPE scale(const int& nNoteID)
+    const int NOTE_COUNT = 128;
+
+    std::vector<FTYPE> build_note_frequencies()
+    {
+        std::vector<FTYPE> v(NOTE_COUNT);
+        for (int i = 0; i < NOTE_COUNT; i++)
+            v[i] = 8 * pow(1.0594630943592952645618252949463, i);
+        return v;
+    }
+
+    // exact frequency of every note id, from the table cache when one is installed
+    const FTYPE* note_frequencies()
+    {
+        static std::vector<FTYPE> vTable;
+        static const FTYPE* pTable = []()
+        {
+            const FTYPE* p = tablecache::lookup<FTYPE>("synth.note_frequency", NOTE_COUNT);
+            if (p != nullptr) return p;
+            vTable = build_note_frequencies();
+            return (const FTYPE*)vTable.data();
+        }();
+        return pTable;
+    }
+
+    void cache_tables(tablecache::builder& b)
     {
-        return 8 * pow(1.0594630943592952645618252949463, nNoteID);
+        b.add("synth.note_frequency", build_note_frequencies());
+    }
+
+    FTYPE scale(const int& nNoteID, fastmath::accuracy eAccuracy = fastmath::default_accuracy)
+    {
+        if (eAccuracy == fastmath::accuracy::exact)
+            return nNoteID >= 0 && nNoteID < NOTE_COUNT ? note_frequencies()[nNoteID] : 8 * pow(1.0594630943592952645618252949463, nNoteID);
+        return 8 * fastmath::exp2(nNoteID / 12.0, eAccuracy);
+    }
+
+    /**
+     * Additive oscillator built on the fastmath sine kernels, one sine per
+     * harmonic: the band limited Fourier series of each waveform, truncated
+     * at nHarmonics. Used by the high and fast tiers to approximate the
+     * waveform wavegen::Generate gives the exact tier. Each waveform is a
+     * branch free loop over harmonics so it vectorises.
+     */
+    template<fastmath::accuracy A>
+    FTYPE osc_additive(const wavegen::WaveFunction& function, const FTYPE& dPhase, int nHarmonics)
+    {
+        using wf = wavegen::WaveFunction;
+        FTYPE dOutput = 0.0;
+        switch (function)
+        {
+        case wf::SAWTOOTH:
+            for (int h = 1; h <= nHarmonics; h++)
+                dOutput += ((h & 1) ? 1.0 : -1.0) * fastmath::sin_poly<A>(dPhase * h) / h;
+            return dOutput * 2.0 / PI;
+        case wf::SQUARE:
+            for (int h = 1; h <= nHarmonics; h++)
+                dOutput += fastmath::sin_poly<A>(dPhase * (2 * h - 1)) / (2 * h - 1);
+            return dOutput * 4.0 / PI;
+        case wf::TRIANGLE:
+            for (int h = 1; h <= nHarmonics; h++)
+                dOutput += ((h & 1) ? 1.0 : -1.0) * fastmath::sin_poly<A>(dPhase * (2 * h - 1)) / ((2 * h - 1) * (2 * h - 1));
+            return dOutput * 8.0 / (PI * PI);
+        default:
+            return fastmath::sin_poly<A>(dPhase);
+        }
+    }
+
+    /**
+     * Many oscillators of one waveform at once, one lane per phase in
+     * dPhase, each wrapped to [0, 2pi). The harmonic loop is outermost and
+     * the lane loop innermost, so every kernel call runs across all lanes
+     * together.
+     */
+    template<fastmath::accuracy A>
+    void osc_lanes(const wavegen::WaveFunction& function, const FTYPE* dPhase, int nLanes, int nHarmonics, FTYPE* dOutput)
+    {
+        using wf = wavegen::WaveFunction;
+        for (int k = 0; k < nLanes; k++)
+            dOutput[k] = 0.0;
+        FTYPE dScale = 1.0;
+        switch (function)
+        {
+        case wf::SAWTOOTH:
+            for (int h = 1; h <= nHarmonics; h++)
+            {
+                FTYPE g = ((h & 1) ? 1.0 : -1.0) / h;
+                for (int k = 0; k < nLanes; k++)
+                    dOutput[k] += g * fastmath::sin_poly_positive<A>(dPhase[k] * h);
+            }
+            dScale = 2.0 / PI;
+            break;
+        case wf::SQUARE:
+            for (int h = 1; h <= nHarmonics; h++)
+            {
+                FTYPE g = 1.0 / (2 * h - 1);
+                for (int k = 0; k < nLanes; k++)
+                    dOutput[k] += g * fastmath::sin_poly_positive<A>(dPhase[k] * (2 * h - 1));
+            }
+            dScale = 4.0 / PI;
+            break;
+        case wf::TRIANGLE:
+            for (int h = 1; h <= nHarmonics; h++)
+            {
+                FTYPE g = ((h & 1) ? 1.0 : -1.0) / ((2 * h - 1) * (2 * h - 1));
+                for (int k = 0; k < nLanes; k++)
+                    dOutput[k] += g * fastmath::sin_poly_positive<A>(dPhase[k] * (2 * h - 1));
+            }
+            dScale = 8.0 / (PI * PI);
+            break;
+        default:
+            for (int k = 0; k < nLanes; k++)
+                dOutput[k] = fastmath::sin_poly_positive<A>(dPhase[k]);
+        }
+        for (int k = 0; k < nLanes; k++)
+            dOutput[k] *= dScale;
+    }
+
+    /**
+     * One oscillator at the given tier. The exact tier is wavegen::Generate
+     * itself, the others approximate it with osc_additive and take the
+     * volume the same way Generate does.
+     */
+    FTYPE osc(const wavegen::WaveFunction& function, const FTYPE& dFrequency, const FTYPE& dTime, const FTYPE& dVolume, int nHarmonics, fastmath::accuracy eAccuracy)
+    {
+        FTYPE dPhase = w(dFrequency) * dTime;
+        switch (eAccuracy)
+        {
+        case fastmath::accuracy::high: return osc_additive<fastmath::accuracy::high>(function, dPhase, nHarmonics) * dVolume;
+        case fastmath::accuracy::fast: return osc_additive<fastmath::accuracy::fast>(function, dPhase, nHarmonics) * dVolume;
+        default: return wavegen::Generate(function, dFrequency, dTime, dVolume, nHarmonics);
+        }
     }
 
     struct envelope
@@ -143,12 +274,35 @@ namespace synth
     struct instrument_base
     {
         std::string name;
-        FTYPE dVolume;
+        param::parameter paramVolume{ 1.0, 0.0, 2.0 };
         synth::envelope_adsr env;
         FTYPE dMaxLifeTime;
-        wavegen::WaveFunction function;
+
+        // set from any thread, the audio thread reads them once per block in begin()
+        std::atomic<wavegen::WaveFunction> function{ wavegen::WaveFunction::SINE };
+        std::atomic<fastmath::accuracy> eAccuracy{ fastmath::default_accuracy };
+
         std::unordered_map<int, FTYPE> mNoteAmplitudes;
 
+    protected:
+        // the settings of the block being rendered
+        wavegen::WaveFunction eBlockFunction = wavegen::WaveFunction::SINE;
+        fastmath::accuracy eBlockAccuracy = fastmath::default_accuracy;
+        int nSampleRate = 44100;
+        FTYPE dBlockStart = 0.0;
+        FTYPE dBlockLength = 0.0;
+        FTYPE dVolumeStart = 1.0;
+        FTYPE dVolumeEnd = 1.0;
+
+        // the smoothed volume at dTime, a linear ramp across the block
+        FTYPE volume(const FTYPE dTime) const
+        {
+            if (dBlockLength <= 0.0) return dVolumeEnd;
+            FTYPE x = std::min(1.0, std::max(0.0, (dTime - dBlockStart) / dBlockLength));
+            return dVolumeStart + (dVolumeEnd - dVolumeStart) * x;
+        }
+
+    public:
         instrument_base()
         {
             for (int i = 4; i < 124; i++)
@@ -156,33 +310,213 @@ namespace synth
         }
 
         virtual FTYPE sound(const FTYPE dTime, synth::note n, bool& bNoteFinished) = 0;
+
+        // before audio starts
+        virtual void prepare(int nRate)
+        {
+            nSampleRate = nRate;
+            paramVolume.prepare(nRate);
+        }
+
+        // audio thread, once before each block of nFrames: takes in the settings the ui changed since the last one
+        virtual void begin(FTYPE dBlockTime, int nFrames)
+        {
+            eBlockFunction = function.load(std::memory_order_relaxed);
+            eBlockAccuracy = eAccuracy.load(std::memory_order_relaxed);
+            paramVolume.begin(dBlockTime);
+            dVolumeStart = paramVolume.value();
+            dVolumeEnd = paramVolume.advance(nFrames);
+            dBlockStart = dBlockTime;
+            dBlockLength = nFrames / (FTYPE)nSampleRate;
+        }
+
+        // instruments without a stereo image play the mono sound on both sides
+        virtual void sound_stereo(const FTYPE dTime, synth::note n, bool& bNoteFinished, FTYPE& dLeft, FTYPE& dRight)
+        {
+            dLeft = dRight = sound(dTime, n, bNoteFinished);
+        }
     };
 
+    const int MAX_UNISON = 16;
+
     struct instrument_single_osc : instrument_base
     {
-        int nHarmonics = 8;
+        std::atomic<int> nHarmonics{ 8 };
+
+        // unison, nUnison detuned sub-oscillators per voice spread across the stereo field. Set from
+        // any thread, the audio thread reads them once per block in begin()
+        std::atomic<int> nUnison{ 1 };
+        std::atomic<FTYPE> dDetune{ 0.15 };     // semitones from the centre to the outermost sub-oscillator
+        FTYPE dSpread = 0.8;                    // 0 is mono, 1 pans the outermost sub-oscillators hard
+
+    private:
+        int nBlockHarmonics = 8;
+
+        // per sub-oscillator tables for the current block, rebuilt when the unison settings change
+        int nUnisonBuilt = 0;
+        FTYPE dDetuneBuilt = 0.0;
+        FTYPE dSpreadBuilt = 0.0;
+        FTYPE vRatio[MAX_UNISON];
+        FTYPE vGainLeft[MAX_UNISON];
+        FTYPE vGainRight[MAX_UNISON];
+
+        // sub-oscillator phases of each note id in turns, carried from frame to frame. nBlock is the
+        // block they were last advanced in, a stack not rendered in the previous block restarts from
+        // where it stopped instead of jumping by the time it was silent
+        struct unison_phases
+        {
+            FTYPE dLast = 0.0;
+            uint64_t nBlock = 0;
+            FTYPE vTurns[MAX_UNISON] = {};
+        };
+        unison_phases vPhases[NOTE_COUNT];
+        uint64_t nBlockCount = 0;
+
+        static bool has_phases(const synth::note& n)
+        {
+            return n.id >= 0 && n.id < NOTE_COUNT;
+        }
+
+        FTYPE sound_mono(const FTYPE dTime, synth::note n, bool& bNoteFinished)
+        {
+            FTYPE dAmplitude = amplitude(dTime, n, bNoteFinished);
+            FTYPE dVolume = volume(dTime);
+            FTYPE dSound = synth::osc(eBlockFunction, synth::scale(n.id, eBlockAccuracy), dTime, dVolume, nBlockHarmonics, eBlockAccuracy);
+            return dSound * dAmplitude * dVolume;
+        }
+
+        void build_unison(int nVoices, FTYPE dDetuneSemitones)
+        {
+            for (int k = 0; k < nVoices; k++)
+            {
+                FTYPE x = nVoices > 1 ? 2.0 * k / (nVoices - 1) - 1.0 : 0.0;
+                vRatio[k] = std::exp2(x * dDetuneSemitones / 12.0);
+
+                // equal power pan, unity at the centre, summed to keep the level of one voice
+                FTYPE a = (x * dSpread + 1.0) * PI / 4.0;
+                vGainLeft[k] = cos(a) * sqrt(2.0 / nVoices);
+                vGainRight[k] = sin(a) * sqrt(2.0 / nVoices);
+            }
+            nUnisonBuilt = nVoices;
+            dDetuneBuilt = dDetuneSemitones;
+            dSpreadBuilt = dSpread;
+        }
+
+        FTYPE amplitude(const FTYPE dTime, const synth::note& n, bool& bNoteFinished)
+        {
+            FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off, n.velocity);
+            if (n.channel->env.state == adsr_state::attack)
+                dAmplitude = std::max(dAmplitude, mNoteAmplitudes.at(n.id));
+            if (dAmplitude <= 0.0)
+                bNoteFinished = true;
+            mNoteAmplitudes.at(n.id) = dAmplitude;
+            return dAmplitude;
+        }
+
+    public:
 
         instrument_single_osc()
         {
             name = "single oscillator";
-            dVolume = 1.0;
             env.dAttackTime = 0.15;
             env.dDecayTime = 0.4;
             env.dSustainAmplitude = 0.9;
             env.dReleaseTime = 0.3;
-            function = wavegen::WaveFunction::SINE;
+            build_unison(1, dDetune.load());
+        }
+
+        void begin(FTYPE dBlockTime, int nFrames) override
+        {
+            instrument_base::begin(dBlockTime, nFrames);
+            nBlockCount++;
+            nBlockHarmonics = std::max(1, nHarmonics.load(std::memory_order_relaxed));
+            int nVoices = std::max(1, std::min(nUnison.load(std::memory_order_relaxed), MAX_UNISON));
+            FTYPE dDetuneNow = dDetune.load(std::memory_order_relaxed);
+            if (nVoices != nUnisonBuilt || dDetuneNow != dDetuneBuilt || dSpread != dSpreadBuilt)
+                build_unison(nVoices, dDetuneNow);
         }
 
         FTYPE sound(const FTYPE dTime, synth::note n, bool& bNoteFinished) override
         {
-            FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off, n.velocity);
-            if (n.channel->env.state == adsr_state::attack)
-                dAmplitude = std::max(dAmplitude, mNoteAmplitudes.at(n.id));
-            if (dAmplitude <= 0.0)
-                bNoteFinished = true;
-            FTYPE dSound = wavegen::Generate(function, synth::scale(n.id), dTime, dVolume, nHarmonics);
-            mNoteAmplitudes.at(n.id) = dAmplitude;
-            return dSound * dAmplitude * dVolume;
+            if (nUnisonBuilt > 1 && has_phases(n))
+            {
+                FTYPE dLeft, dRight;
+                sound_stereo(dTime, n, bNoteFinished, dLeft, dRight);
+                return 0.5 * (dLeft + dRight);
+            }
+            return sound_mono(dTime, n, bNoteFinished);
+        }
+
+        /**
+         * The whole unison stack of one voice in a single call. The envelope
+         * and bookkeeping run once, the sub-oscillators run as lanes of
+         * osc_lanes. A note that starts from silence gets random phases,
+         * seeded from its id and start time. From then on each phase only
+         * advances, so retriggering a note in its release or changing the
+         * detune never makes them jump.
+         */
+        void sound_stereo(const FTYPE dTime, synth::note n, bool& bNoteFinished, FTYPE& dLeft, FTYPE& dRight) override
+        {
+            int nVoices = nUnisonBuilt;
+            if (nVoices == 1 || !has_phases(n))
+            {
+                dLeft = dRight = sound_mono(dTime, n, bNoteFinished);
+                return;
+            }
+
+            bool bSounding = mNoteAmplitudes.at(n.id) > 0.0;
+            FTYPE dAmplitude = amplitude(dTime, n, bNoteFinished);
+            FTYPE dFrequency = synth::scale(n.id, eBlockAccuracy);
+
+            unison_phases& p = vPhases[n.id];
+            if (!bSounding)
+            {
+                uint64_t nOnBits;
+                memcpy(&nOnBits, &n.on, sizeof(nOnBits));
+                uint32_t seed = (uint32_t)(n.id * 2654435761u) ^ (uint32_t)(nOnBits ^ (nOnBits >> 32));
+                for (int k = 0; k < MAX_UNISON; k++)
+                {
+                    seed = seed * 1664525u + 1013904223u;
+                    p.vTurns[k] = (seed >> 8) / 16777216.0;
+                }
+                p.dLast = dTime;
+            }
+            else if (p.nBlock + 1 < nBlockCount)
+                p.dLast = dTime;
+            FTYPE dElapsed = dTime - p.dLast;
+            p.dLast = dTime;
+            p.nBlock = nBlockCount;
+
+            FTYPE vPhase[MAX_UNISON];
+            FTYPE vOut[MAX_UNISON];
+            for (int k = 0; k < nVoices; k++)
+            {
+                FTYPE dTurns = p.vTurns[k] + dFrequency * vRatio[k] * dElapsed;
+                p.vTurns[k] = dTurns - floor(dTurns);
+                vPhase[k] = 2.0 * PI * p.vTurns[k];
+            }
+            FTYPE dVolume = volume(dTime);
+            switch (eBlockAccuracy)
+            {
+            case fastmath::accuracy::high: osc_lanes<fastmath::accuracy::high>(eBlockFunction, vPhase, nVoices, nBlockHarmonics, vOut); break;
+            case fastmath::accuracy::fast: osc_lanes<fastmath::accuracy::fast>(eBlockFunction, vPhase, nVoices, nBlockHarmonics, vOut); break;
+            default:
+                // the phase as a time into the period, so Generate sees the same phase
+                for (int k = 0; k < nVoices; k++)
+                    vOut[k] = wavegen::Generate(eBlockFunction, dFrequency * vRatio[k], p.vTurns[k] / (dFrequency * vRatio[k]), 1.0, nBlockHarmonics);
+                break;
+            }
+
+            dLeft = 0.0;
+            dRight = 0.0;
+            for (int k = 0; k < nVoices; k++)
+            {
+                dLeft += vGainLeft[k] * vOut[k];
+                dRight += vGainRight[k] * vOut[k];
+            }
+            FTYPE dGain = dAmplitude * dVolume * dVolume;
+            dLeft *= dGain;
+            dRight *= dGain;
         }
     };
 
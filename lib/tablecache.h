@@ -0,0 +1,330 @@
+#pragma once
+#ifndef TABLECACHE_H
+#define TABLECACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Precomputed tables (sine tables, note frequencies, fft plans, filter taps)
+ * in one binary file that every process maps read-only, so startup skips
+ * building them and concurrent render processes share a single copy in the
+ * page cache.
+ *
+ * The file is a header, a directory of named sections and the section data,
+ * each section starting on a SECTION_ALIGNMENT boundary so tables can be used
+ * in place. The header carries a format version, a content key chosen by the
+ * application (bump it when a generator changes), the size of the value type
+ * and a byte order mark, the file size and a checksum of everything after the
+ * header. A file that fails any of these is ignored and rebuilt.
+ *
+ * Modules look tables up with tablecache::lookup() and fall back to building
+ * their own when there is no cache installed or the section is missing, so
+ * the cache only ever changes where the numbers live, never what they are.
+ */
+namespace tablecache
+{
+
+    const char MAGIC[8] = { 'S', 'Y', 'N', 'T', 'H', 'T', 'B', 'L' };
+    const uint32_t VERSION = 1;
+    const uint32_t ORDER_MARK = 0x01020304;
+    const size_t SECTION_ALIGNMENT = 64;
+    const int MAX_NAME = 48;
+    const int MAX_KEY = 64;
+
+    struct header
+    {
+        char sMagic[8];
+        uint32_t nVersion;
+        uint32_t nByteOrder;
+        uint32_t nValueBytes;               // sizeof(FTYPE) of the writer
+        uint32_t nSections;
+        uint64_t nFileBytes;
+        uint64_t nChecksum;                 // of the directory and all sections
+        char sKey[MAX_KEY];
+    };
+
+    struct section
+    {
+        char sName[MAX_NAME];
+        uint64_t nOffset;                   // from the start of the file
+        uint64_t nBytes;
+    };
+
+    static_assert(sizeof(header) % 8 == 0 && sizeof(section) % 8 == 0, "the directory is read in place");
+
+
+    // fnv-1a over 64 bit words, with the tail bytes folded into a last word
+    uint64_t checksum(const uint8_t* p, size_t nBytes)
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+        size_t nWords = nBytes / 8;
+        for (size_t i = 0; i < nWords; i++)
+        {
+            uint64_t w;
+            memcpy(&w, p + i * 8, 8);
+            h = (h ^ w) * 0x100000001b3ull;
+        }
+        uint64_t nTail = 0;
+        memcpy(&nTail, p + nWords * 8, nBytes - nWords * 8);
+        return (h ^ nTail ^ nBytes) * 0x100000001b3ull;
+    }
+
+
+    // collects sections and writes the file, replacing any existing one atomically
+    class builder
+    {
+    private:
+        struct entry
+        {
+            std::string sName;
+            std::vector<uint8_t> vData;
+        };
+        std::vector<entry> vEntries;
+
+    public:
+        void add(const std::string& sName, const void* data, size_t nBytes)
+        {
+            entry e;
+            e.sName = sName.substr(0, MAX_NAME - 1);
+            e.vData.assign((const uint8_t*)data, (const uint8_t*)data + nBytes);
+            vEntries.push_back(std::move(e));
+        }
+
+        template <class T>
+        void add(const std::string& sName, const std::vector<T>& v)
+        {
+            add(sName, v.data(), v.size() * sizeof(T));
+        }
+
+        int count() const
+        {
+            return (int)vEntries.size();
+        }
+
+        bool write(const std::string& sPath, const std::string& sKey, uint32_t nValueBytes)
+        {
+            auto align = [](size_t n) { return (n + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT; };
+
+            size_t nSize = align(sizeof(header) + vEntries.size() * sizeof(section));
+            std::vector<section> vDirectory(vEntries.size());
+            for (size_t i = 0; i < vEntries.size(); i++)
+            {
+                memset(&vDirectory[i], 0, sizeof(section));
+                memcpy(vDirectory[i].sName, vEntries[i].sName.c_str(), vEntries[i].sName.size());
+                vDirectory[i].nOffset = nSize;
+                vDirectory[i].nBytes = vEntries[i].vData.size();
+                nSize = align(nSize + vEntries[i].vData.size());
+            }
+
+            std::vector<uint8_t> vFile(nSize, 0);
+            memcpy(vFile.data() + sizeof(header), vDirectory.data(), vDirectory.size() * sizeof(section));
+            for (size_t i = 0; i < vEntries.size(); i++)
+                memcpy(vFile.data() + vDirectory[i].nOffset, vEntries[i].vData.data(), vEntries[i].vData.size());
+
+            header h;
+            memset(&h, 0, sizeof(h));
+            memcpy(h.sMagic, MAGIC, sizeof(MAGIC));
+            h.nVersion = VERSION;
+            h.nByteOrder = ORDER_MARK;
+            h.nValueBytes = nValueBytes;
+            h.nSections = (uint32_t)vEntries.size();
+            h.nFileBytes = nSize;
+            h.nChecksum = checksum(vFile.data() + sizeof(header), nSize - sizeof(header));
+            memcpy(h.sKey, sKey.c_str(), std::min(sKey.size(), (size_t)MAX_KEY - 1));
+            memcpy(vFile.data(), &h, sizeof(h));
+
+            // several processes may build at once, each writes its own file and the last rename wins
+#ifdef _WIN32
+            std::string sTemp = sPath + ".tmp" + std::to_string(_getpid());
+#else
+            std::string sTemp = sPath + ".tmp" + std::to_string(getpid());
+#endif
+            FILE* f = fopen(sTemp.c_str(), "wb");
+            if (f == nullptr) return false;
+            bool bOk = fwrite(vFile.data(), 1, vFile.size(), f) == vFile.size();
+            bOk = fclose(f) == 0 && bOk;
+#ifdef _WIN32
+            bOk = bOk && MoveFileExA(sTemp.c_str(), sPath.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+            bOk = bOk && rename(sTemp.c_str(), sPath.c_str()) == 0;
+#endif
+            if (!bOk)
+                remove(sTemp.c_str());
+            return bOk;
+        }
+    };
+
+
+    // a validated, read-only mapping of a cache file
+    class cache
+    {
+    private:
+        const uint8_t* pBase = nullptr;
+        size_t nSize = 0;
+#ifdef _WIN32
+        HANDLE hFile = INVALID_HANDLE_VALUE;
+        HANDLE hMapping = nullptr;
+#endif
+
+        bool map(const std::string& sPath)
+        {
+#ifdef _WIN32
+            hFile = CreateFileA(sPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (hFile == INVALID_HANDLE_VALUE) return false;
+            LARGE_INTEGER nFileSize;
+            if (!GetFileSizeEx(hFile, &nFileSize) || nFileSize.QuadPart < (LONGLONG)sizeof(header)) return false;
+            nSize = (size_t)nFileSize.QuadPart;
+            hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (hMapping == nullptr) return false;
+            pBase = static_cast<const uint8_t*>(MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+            return pBase != nullptr;
+#else
+            int fd = ::open(sPath.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(header))
+            {
+                ::close(fd);
+                return false;
+            }
+            nSize = (size_t)st.st_size;
+            void* p = mmap(nullptr, nSize, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (p == MAP_FAILED) return false;
+            pBase = static_cast<const uint8_t*>(p);
+            return true;
+#endif
+        }
+
+    public:
+        cache() {}
+        cache(const cache&) = delete;
+        cache& operator=(const cache&) = delete;
+
+        ~cache()
+        {
+            close();
+        }
+
+        // maps the file and checks it end to end, false if it is missing, stale or damaged
+        bool open(const std::string& sPath, const std::string& sKey, uint32_t nValueBytes)
+        {
+            close();
+            if (!map(sPath))
+            {
+                close();
+                return false;
+            }
+
+            const header* h = reinterpret_cast<const header*>(pBase);
+            char sFileKey[MAX_KEY];
+            memcpy(sFileKey, h->sKey, MAX_KEY);
+            sFileKey[MAX_KEY - 1] = 0;
+            bool bValid = memcmp(h->sMagic, MAGIC, sizeof(MAGIC)) == 0
+                && h->nVersion == VERSION
+                && h->nByteOrder == ORDER_MARK
+                && h->nValueBytes == nValueBytes
+                && h->nFileBytes == nSize
+                && sKey.substr(0, MAX_KEY - 1) == sFileKey
+                && sizeof(header) + (uint64_t)h->nSections * sizeof(section) <= nSize
+                && h->nChecksum == checksum(pBase + sizeof(header), nSize - sizeof(header));
+            for (uint32_t i = 0; bValid && i < h->nSections; i++)
+            {
+                const section& s = directory()[i];
+                bValid = s.nOffset % SECTION_ALIGNMENT == 0 && s.nOffset <= nSize && s.nBytes <= nSize - s.nOffset && s.sName[MAX_NAME - 1] == 0;
+            }
+            if (!bValid)
+                close();
+            return bValid;
+        }
+
+        void close()
+        {
+#ifdef _WIN32
+            if (pBase != nullptr) UnmapViewOfFile(pBase);
+            if (hMapping != nullptr) CloseHandle(hMapping);
+            if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+            hMapping = nullptr;
+            hFile = INVALID_HANDLE_VALUE;
+#else
+            if (pBase != nullptr) munmap(const_cast<uint8_t*>(pBase), nSize);
+#endif
+            pBase = nullptr;
+            nSize = 0;
+        }
+
+        bool is_open() const
+        {
+            return pBase != nullptr;
+        }
+
+        size_t bytes() const
+        {
+            return nSize;
+        }
+
+        int sections() const
+        {
+            return pBase != nullptr ? (int)reinterpret_cast<const header*>(pBase)->nSections : 0;
+        }
+
+        const section* directory() const
+        {
+            return reinterpret_cast<const section*>(pBase + sizeof(header));
+        }
+
+        // the section's data, or nullptr if there is none of that name and size
+        const void* find(const char* sName, size_t nBytes) const
+        {
+            for (int i = 0; i < sections(); i++)
+            {
+                const section& s = directory()[i];
+                if (strcmp(s.sName, sName) == 0)
+                    return s.nBytes == nBytes ? pBase + s.nOffset : nullptr;
+            }
+            return nullptr;
+        }
+    };
+
+
+    // the cache modules read from, set once at startup before any tables are built
+    const cache*& installed()
+    {
+        static const cache* pCache = nullptr;
+        return pCache;
+    }
+
+    void install(const cache* pCache)
+    {
+        installed() = pCache;
+    }
+
+    // nCount values of T from the installed cache, or nullptr
+    template <class T>
+    const T* lookup(const char* sName, size_t nCount)
+    {
+        const cache* c = installed();
+        return c != nullptr ? static_cast<const T*>(c->find(sName, nCount * sizeof(T))) : nullptr;
+    }
+
+}
+
+#endif /* ifndef TABLECACHE_H */
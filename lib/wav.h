@@ -0,0 +1,309 @@
+#pragma once
+#ifndef WAV_H
+#define WAV_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace wav
+{
+
+    /**
+     * Reads a RIFF/WAVE file into one vector per channel, scaled to +/-1.
+     * Supports 8/16/24/32 bit PCM and 32/64 bit float, including
+     * WAVE_FORMAT_EXTENSIBLE headers and RF64 files.
+     */
+    bool read(const std::string& sPath, std::vector<std::vector<double>>& vChannels, int& nSampleRate)
+    {
+        FILE* f = fopen(sPath.c_str(), "rb");
+        if (f == nullptr) return false;
+
+        auto u16 = [](const uint8_t* p) { return (uint32_t)p[0] | ((uint32_t)p[1] << 8); };
+        auto u32 = [](const uint8_t* p) { return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24); };
+
+        uint8_t riff[12];
+        if (fread(riff, 1, 12, f) != 12 || (memcmp(riff, "RIFF", 4) != 0 && memcmp(riff, "RF64", 4) != 0) || memcmp(riff + 8, "WAVE", 4) != 0)
+        {
+            fclose(f);
+            return false;
+        }
+
+        uint32_t nFormat = 0, nChannels = 0, nBits = 0;
+        uint64_t nLargeData = 0;
+        std::vector<uint8_t> vData;
+        uint8_t chunk[8];
+        while (fread(chunk, 1, 8, f) == 8)
+        {
+            uint32_t nSize = u32(chunk + 4);
+            if (memcmp(chunk, "fmt ", 4) == 0)
+            {
+                std::vector<uint8_t> fmt(nSize);
+                if (nSize < 16 || fread(fmt.data(), 1, nSize, f) != nSize) break;
+                nFormat = u16(&fmt[0]);
+                nChannels = u16(&fmt[2]);
+                nSampleRate = (int)u32(&fmt[4]);
+                nBits = u16(&fmt[14]);
+                if (nFormat == 0xFFFE && nSize >= 26)
+                    nFormat = u16(&fmt[24]);   // sub format of WAVE_FORMAT_EXTENSIBLE
+            }
+            else if (memcmp(chunk, "ds64", 4) == 0)
+            {
+                // RF64 keeps the real sizes here and 0xFFFFFFFF in the chunk headers
+                std::vector<uint8_t> ds64(nSize);
+                if (nSize < 16 || fread(ds64.data(), 1, nSize, f) != nSize) break;
+                nLargeData = u32(&ds64[8]) | ((uint64_t)u32(&ds64[12]) << 32);
+            }
+            else if (memcmp(chunk, "data", 4) == 0)
+            {
+                size_t nDataSize = nSize == 0xFFFFFFFF && nLargeData > 0 ? (size_t)nLargeData : nSize;
+                vData.resize(nDataSize);
+                vData.resize(fread(vData.data(), 1, nDataSize, f));
+                break;
+            }
+            else
+                fseek(f, nSize, SEEK_CUR);
+
+            if (nSize & 1)
+                fseek(f, 1, SEEK_CUR);  // chunks are word aligned
+        }
+        fclose(f);
+
+        uint32_t nBytes = nBits / 8;
+        bool bFloat = nFormat == 3;
+        if (nChannels == 0 || nBytes == 0 || (nFormat != 1 && !bFloat) || (bFloat && nBytes != 4 && nBytes != 8))
+            return false;
+
+        size_t nFrames = vData.size() / (nBytes * nChannels);
+        vChannels.assign(nChannels, std::vector<double>(nFrames));
+        const uint8_t* p = vData.data();
+        for (size_t i = 0; i < nFrames; i++)
+        {
+            for (uint32_t c = 0; c < nChannels; c++, p += nBytes)
+            {
+                double d = 0.0;
+                if (bFloat && nBytes == 4)
+                {
+                    float v;
+                    memcpy(&v, p, 4);
+                    d = v;
+                }
+                else if (bFloat)
+                    memcpy(&d, p, 8);
+                else if (nBytes == 1)
+                    d = (p[0] - 128) / 128.0;
+                else
+                {
+                    // little endian signed integer, sign extended from the top byte
+                    int64_t v = (int8_t)p[nBytes - 1];
+                    for (int b = (int)nBytes - 2; b >= 0; b--)
+                        v = v * 256 + p[b];     // not a shift, v may be negative
+                    d = v / (double)(1ll << (nBits - 1));
+                }
+                vChannels[c][i] = d;
+            }
+        }
+        return true;
+    }
+
+
+    enum class sample_format
+    {
+        pcm16,
+        pcm24,
+        float32
+    };
+
+    const char* sample_format_name(sample_format eFormat)
+    {
+        switch (eFormat)
+        {
+        case sample_format::pcm16: return "16 bit";
+        case sample_format::pcm24: return "24 bit";
+        case sample_format::float32: return "32 bit float";
+        }
+        return "?";
+    }
+
+    int sample_bytes(sample_format eFormat)
+    {
+        return eFormat == sample_format::pcm16 ? 2 : eFormat == sample_format::pcm24 ? 3 : 4;
+    }
+
+
+    /**
+     * Streams interleaved float frames to a WAV file, or to a headerless raw
+     * file of the same samples. The header is written up front with zero
+     * sizes and rewritten by update_header() and close(), so a file cut off
+     * by a crash is still readable up to the last update.
+     *
+     * Past 4GB the file turns into RF64: the RIFF id becomes RF64, the 32 bit
+     * sizes become 0xFFFFFFFF and the real ones go in a ds64 chunk that was
+     * reserved as JUNK at the start. A second JUNK chunk pads the header so
+     * the samples start at DATA_OFFSET, which keeps every large write aligned
+     * in the file.
+     */
+    class writer
+    {
+    public:
+        static const size_t DATA_OFFSET = 4096;
+
+    private:
+        FILE* f = nullptr;
+        bool bHeader = true;
+        sample_format eFormat = sample_format::float32;
+        int nChans = 0;
+        int nSampleRate = 0;
+        uint64_t nFrames = 0;
+        std::vector<uint8_t> vBytes;
+
+    public:
+        writer() {}
+        writer(const writer&) = delete;
+        writer& operator=(const writer&) = delete;
+
+        ~writer()
+        {
+            close();
+        }
+
+        bool open(const std::string& sPath, int nChannels, int nRate, sample_format eSampleFormat = sample_format::float32, bool bWavHeader = true)
+        {
+            close();
+            f = fopen(sPath.c_str(), "wb");
+            if (f == nullptr) return false;
+            setvbuf(f, nullptr, _IONBF, 0);     // callers write large blocks, stdio would only copy them
+
+            bHeader = bWavHeader;
+            eFormat = eSampleFormat;
+            nChans = nChannels;
+            nSampleRate = nRate;
+            nFrames = 0;
+            if (bHeader && !update_header())
+            {
+                fclose(f);
+                f = nullptr;
+                return false;
+            }
+            return true;
+        }
+
+        bool is_open() const
+        {
+            return f != nullptr;
+        }
+
+        uint64_t frames() const
+        {
+            return nFrames;
+        }
+
+        uint64_t data_bytes() const
+        {
+            return nFrames * nChans * sample_bytes(eFormat);
+        }
+
+        bool rf64() const
+        {
+            return bHeader && data_bytes() + DATA_OFFSET - 8 > 0xFFFFFFFFull;
+        }
+
+        bool write(const float* samples, size_t nCount)
+        {
+            if (f == nullptr) return false;
+            size_t nSamples = nCount * nChans;
+            int nBytes = sample_bytes(eFormat);
+            vBytes.resize(nSamples * nBytes);
+            uint8_t* p = vBytes.data();
+            if (eFormat == sample_format::float32)
+                memcpy(p, samples, nSamples * sizeof(float));   // little endian hosts only, like the reader
+            else
+            {
+                // same scale as read(), clipped to the largest positive code
+                double dScale = eFormat == sample_format::pcm16 ? 32768.0 : 8388608.0;
+                for (size_t i = 0; i < nSamples; i++, p += nBytes)
+                {
+                    int32_t v = (int32_t)std::lrint(std::min(dScale - 1.0, std::max(-dScale, samples[i] * dScale)));
+                    for (int b = 0; b < nBytes; b++)
+                        p[b] = (uint8_t)(v >> (8 * b));
+                }
+            }
+            if (fwrite(vBytes.data(), 1, vBytes.size(), f) != vBytes.size())
+                return false;
+            nFrames += nCount;
+            return true;
+        }
+
+        // rewrites the header for the frames written so far and goes back to the end
+        bool update_header()
+        {
+            if (f == nullptr) return false;
+            if (!bHeader) return fflush(f) == 0;
+
+            uint8_t h[DATA_OFFSET] = {};
+            auto put16 = [&](size_t o, uint32_t v) { h[o] = (uint8_t)v; h[o + 1] = (uint8_t)(v >> 8); };
+            auto put32 = [&](size_t o, uint32_t v) { put16(o, v & 0xFFFF); put16(o + 2, v >> 16); };
+            auto put64 = [&](size_t o, uint64_t v) { put32(o, (uint32_t)v); put32(o + 4, (uint32_t)(v >> 32)); };
+
+            uint64_t nData = data_bytes();
+            uint64_t nRiff = DATA_OFFSET - 8 + nData + (nData & 1);
+            bool bLarge = rf64();
+
+            memcpy(h, bLarge ? "RF64" : "RIFF", 4);
+            put32(4, bLarge ? 0xFFFFFFFF : (uint32_t)nRiff);
+            memcpy(h + 8, "WAVE", 4);
+
+            // ds64, or JUNK of the same size until it is needed
+            memcpy(h + 12, bLarge ? "ds64" : "JUNK", 4);
+            put32(16, 28);
+            if (bLarge)
+            {
+                put64(20, nRiff);
+                put64(28, nData);
+                put64(36, nFrames);
+            }
+
+            bool bFloat = eFormat == sample_format::float32;
+            int nBytes = sample_bytes(eFormat);
+            size_t o = 48;
+            memcpy(h + o, "fmt ", 4);
+            put32(o + 4, bFloat ? 18 : 16);
+            put16(o + 8, bFloat ? 3 : 1);
+            put16(o + 10, (uint32_t)nChans);
+            put32(o + 12, (uint32_t)nSampleRate);
+            put32(o + 16, (uint32_t)(nSampleRate * nChans * nBytes));
+            put16(o + 20, (uint32_t)(nChans * nBytes));
+            put16(o + 22, (uint32_t)(8 * nBytes));
+            o += bFloat ? 26 : 24;      // float has an empty cbSize
+
+            memcpy(h + o, "JUNK", 4);
+            put32(o + 4, (uint32_t)(DATA_OFFSET - 8 - (o + 8)));
+
+            memcpy(h + DATA_OFFSET - 8, "data", 4);
+            put32(DATA_OFFSET - 4, bLarge ? 0xFFFFFFFF : (uint32_t)nData);
+
+            bool bOk = fseek(f, 0, SEEK_SET) == 0 && fwrite(h, 1, DATA_OFFSET, f) == DATA_OFFSET;
+            bOk = fseek(f, 0, SEEK_END) == 0 && bOk;
+            return fflush(f) == 0 && bOk;
+        }
+
+        bool close()
+        {
+            if (f == nullptr) return true;
+            bool bOk = true;
+            if (bHeader && (data_bytes() & 1))
+                bOk = fputc(0, f) != EOF;       // the data chunk is word aligned
+            bOk = update_header() && bOk;
+            bOk = fclose(f) == 0 && bOk;
+            f = nullptr;
+            return bOk;
+        }
+    };
+
+}
+
+#endif /* ifndef WAV_H */
@@ -1,10 +1,25 @@
 #define OLC_PGE_APPLICATION
 #include "olcPixelGameEngine.h"
 #include "synth.h"
+#include "render.h"
 #include "sfx.h"
 #include "Iir.h"
 #include <vector>
 #include "fft.h"
+#include "stft.h"
+#include "peaks.h"
+#include "spectrum.h"
+#include "frames.h"
+#include "wav.h"
+#include "graph.h"
+#include "bus.h"
+#include "param.h"
+#include "shmring.h"
+#include "meter.h"
+#include "recorder.h"
+#include "tablecache.h"
+#include <ctime>
+#include <thread>
 
 
 // constants
@@ -12,139 +27,272 @@ const int nChannels = 2;
 const int nSampleRate = 44100;
 
 
-// synth
-synth::instrument_single_osc instrument;
-std::vector<synth::note> vNotes;
-std::mutex muxNotes;
+// synth, one instrument per bus
+const int nBuses = 2;
+synth::instrument_single_osc instruments[nBuses];
+bus::mixer* buses = nullptr;
+int nSelectedBus = 0;
+bool bLayered = false;
 int nNoteOffset = 64;
 
+// second bus insert
+FTYPE dPadLpfFrequency = 800.0;
+Iir::RBJ::LowPass* padFilters = nullptr;
 
-// filters
+
+// filters, the lpf cutoff can be recorded and played back
 bool bLpfEnabled = true;
 bool bHpfEnabled = true;
-FTYPE dHpfFrequency = 100.0;
-FTYPE dLpfFrequency = 1500.0;
-FTYPE dHpfQ = 0.3;
-FTYPE dLpfQ = 0.7;
+param::parameter paramHpfFrequency{ 100.0, 20.0, 20000.0, param::ramp::exponential, 0.05 };
+param::parameter paramLpfFrequency{ 1500.0, 20.0, 20000.0, param::ramp::exponential, 0.05 };
+param::parameter paramHpfQ{ 0.3, 0.1, 10.0 };
+param::parameter paramLpfQ{ 0.7, 0.1, 10.0 };
+param::lane laneLpfFrequency;
 Iir::RBJ::HighPass* hpFilters = nullptr;
 Iir::RBJ::LowPass* lpFilters = nullptr;
 
 
-// mono delay
+// mono delay, times step rather than ramp since the delays change their loop length
 bool bMonoDelayEnabled = false;
 sfx::monodelay sfxMonoDelay{nSampleRate, 4.0};
-FTYPE dDelayTime = 1.0;
-FTYPE dDelayFeedback = 0.6;
-float fDelayMix = 0.5f;
+param::parameter paramDelayTime{ 1.0, 0.01, 4.0, param::ramp::step };
+param::parameter paramDelayFeedback{ 0.6, 0.0, 0.95 };
+param::parameter paramDelayMix{ 0.5, 0.0, 1.0 };
 
 
 // stereo ping pong delay
 bool bStereoDelayEnabled = false;
 sfx::pingpongdelay sfxPingPong{nSampleRate, 4.0};
-sfx::pingpongdelay::stereo_sample ppDelayTime(0.3, 0.5);
-sfx::pingpongdelay::stereo_sample ppDelayFb(0.75, 0.75);
-float fPpDelayMix = 0.5f;
+param::parameter paramPpTimeLeft{ 0.3, 0.01, 4.0, param::ramp::step };
+param::parameter paramPpTimeRight{ 0.5, 0.01, 4.0, param::ramp::step };
+param::parameter paramPpFeedbackLeft{ 0.75, 0.0, 0.95 };
+param::parameter paramPpFeedbackRight{ 0.75, 0.0, 0.95 };
+param::parameter paramPpMix{ 0.5, 0.0, 1.0 };
+
+
+// convolution reverb, impulse response from ir.wav or a synthetic decay
+bool bReverbEnabled = false;
+param::parameter paramReverbMix{ 0.3, 0.0, 1.0 };
+sfx::convolver* reverbs = nullptr;
+
+
+// signal graph
+graph::graph* dsp = nullptr;
+int nodeMonoDelay = -1;
+int nodePingPong = -1;
+int nodeHpf = -1;
+int nodeLpf = -1;
+int nodeReverbSend = -1;
+int nodeReverb = -1;
+
+
+// loudness and level meters on the master output
+meter::meter* meters = nullptr;
+
+
+// precomputed tables mapped from disk and shared by every running instance, built on the
+// first run; bump the key when a table generator changes so old files are rebuilt
+const std::string sTablesPath = "olcsynth.tables";
+const std::string sTablesKey = "olcsynth tables 1";
+tablecache::cache tables;
+
+
+// F4 records the master output to a wav file, written by its own thread
+recorder::recorder* recording = nullptr;
+
+
+// the master output is also published in shared memory for other local processes (see tools/shmring_monitor.cpp)
+shmring::writer shmOutput;
 
 
 // visualizer
 int nVisMode = 0;
 bool bVisEnabled = true;
-int nVisMemorySize = 0;
-FTYPE** dVisMemory = nullptr;
-int nVisPhase = 0;
-
-// visualizer / FFT
-int nFFTMemorySize = 1;
-int nFFTMemorySizeHalf = 1;
-FTYPE** dFFTMemoryPre = nullptr;
-FTYPE** dFFTMemoryPost = nullptr;
+peaks::pyramid* visPeaks = nullptr;
+
 std::mutex muxVis;
-int nFFTPhase = 0;
-std::mutex muxFFT;
 
+// visualizer / fft and spectrogram, the audio thread only records samples and the analysis happens on the ui thread
+stft::history* visHistory = nullptr;
 
-FTYPE ProcessChannel(int nChannel, FTYPE dTime)
-{
-    unique_lock<mutex> lm(muxNotes);
-    FTYPE dMixedOutput = 0.0;
-    for (auto &n : vNotes)
-    {
-        bool bNoteFinished = false;
-        FTYPE dSound = 0.0;
-        if (n.channel != nullptr)
-            dSound = n.channel->sound(dTime, n, bNoteFinished);
-        dMixedOutput += dSound;
-        if (bNoteFinished)
-        {
-            n.active = false;
-            n.channel->env.state = synth::adsr_state::inactive;
-        }
-    }
-    safe_remove<std::vector<synth::note>>(vNotes, [](synth::note const& item) { return item.active; });
-    return dMixedOutput * 0.2;
-}
 
-void ProcessAllChannels(int nChans, FTYPE *samples, FTYPE dTime)
+void StoreVisualizer(int nChans, int nFrames, FTYPE *samples, FTYPE dTime)
 {
-    // perform mono processing per channel
-    for (int c = 0; c < nChans; c++)
-        samples[c] = ProcessChannel(c, dTime);
-    
-    // mono delay
-    if (bMonoDelayEnabled)
+    // store samples in visualizer memory
+    if (bVisEnabled && nVisMode == 0 && visPeaks != nullptr)
     {
-        FTYPE dSummedOutput = 0.0;
-        for (int c = 0; c < nChans; c++)
-            dSummedOutput += samples[c];
-        dSummedOutput = dSummedOutput / (FTYPE)nChans;
-        sfxMonoDelay.process(dSummedOutput, dDelayTime, dDelayFeedback, fDelayMix);
-        for (int c = 0; c < nChans; c++)
-            samples[c] = dSummedOutput;
+        unique_lock<mutex> lm(muxVis);
+        for (int n = 0; n < nFrames * nChans; n += nChans)
+            for (int c = 0; c < nChans; c++)
+                visPeaks[c].push((float)samples[n + c]);
     }
 
-    // perform stereo processing (ping pong delay for now)
-    // if (bStereoDelayEnabled)
-    sfxPingPong.process(nChans, samples, ppDelayTime, ppDelayFb, bStereoDelayEnabled ? fPpDelayMix : 0.0f);
-    
-    // filters
-    if (bHpfEnabled || bLpfEnabled)
+    // store samples in the fft / spectrogram history
+    if (bVisEnabled && (nVisMode == 1 || nVisMode == 2) && visHistory != nullptr)
     {
-        for (int c = 0; c < nChans; c++)
-        {
-            if (bHpfEnabled)
-                samples[c] = hpFilters[c].filter(samples[c]);
-            if (bLpfEnabled)
-                samples[c] = lpFilters[c].filter(samples[c]);
-        }
+        for (int n = 0; n < nFrames * nChans; n += nChans)
+            for (int c = 0; c < nChans; c++)
+                visHistory[c].push(samples[n + c]);
     }
+}
 
-    // store samples in visualizer memory
-    if (bVisEnabled && nVisMode == 0 && dVisMemory != nullptr)
+void StoreMeters(int nChans, int nFrames, FTYPE *samples, FTYPE dTime)
+{
+    meters->process(samples, nFrames);
+}
+
+void RecordOutput(int nChans, int nFrames, FTYPE *samples, FTYPE dTime)
+{
+    recording->push(samples, nFrames);
+}
+
+void WriteSharedOutput(int nChans, int nFrames, FTYPE *samples, FTYPE dTime)
+{
+    shmOutput.write(samples, nFrames);
+}
+
+void ProcessBlock(int nChans, int nFrames, FTYPE *samples, FTYPE dTime)
+{
+    dsp->process(nFrames, samples, dTime);
+}
+
+// buses render in parallel, their dry mix feeds the master chain and send 0 feeds the reverb
+void BuildBuses()
+{
+    int nThreads = std::max(0, std::min(nBuses, (int)std::thread::hardware_concurrency()) - 1);
+    buses = new bus::mixer(nChannels, 512, 1, nThreads);
+    for (int b = 0; b < nBuses; b++)
+        buses->add(&instruments[b], nSampleRate);
+
+    // second bus is a filtered saw layer with more reverb
+    instruments[1].function = wavegen::WaveFunction::SAWTOOTH;
+    bus::bus& pad = (*buses)[1];
+    int nPadLpf = pad.inserts.add(new graph::filter_node<Iir::RBJ::LowPass>(padFilters, nChannels), { pad.voices() });
+    pad.inserts.set_output(nPadLpf);
+    pad.inserts.commit();
+
+    (*buses)[0].paramSends[0].reset(1.0);
+    (*buses)[1].paramSends[0].reset(1.5);
+    (*buses)[1].paramGain.reset(0.7);
+}
+
+// every live parameter read by the master chain
+void PrepareParameters()
+{
+    param::parameter* vParams[] = {
+        &paramHpfFrequency, &paramLpfFrequency, &paramHpfQ, &paramLpfQ,
+        &paramDelayTime, &paramDelayFeedback, &paramDelayMix,
+        &paramPpTimeLeft, &paramPpTimeRight, &paramPpFeedbackLeft, &paramPpFeedbackRight, &paramPpMix,
+        &paramReverbMix
+    };
+    for (param::parameter* p : vParams)
+        p->prepare(nSampleRate);
+    paramLpfFrequency.attach(&laneLpfFrequency);
+}
+
+// the master chain, stages are switched by recompiling rather than by tests on the audio thread
+void BuildGraph()
+{
+    dsp = new graph::graph(nChannels, 512, nSampleRate);
+    int nDry = dsp->add(new bus::return_node(*buses, 0));
+    nodeMonoDelay = dsp->add(new graph::monodelay_node(sfxMonoDelay, paramDelayTime, paramDelayFeedback, paramDelayMix), { nDry });
+    nodePingPong = dsp->add(new graph::pingpong_node(sfxPingPong, paramPpTimeLeft, paramPpTimeRight, paramPpFeedbackLeft, paramPpFeedbackRight, paramPpMix), { nodeMonoDelay });
+    nodeHpf = dsp->add(new graph::filter_node<Iir::RBJ::HighPass>(hpFilters, nChannels, nSampleRate, paramHpfFrequency, paramHpfQ), { nodePingPong });
+    nodeLpf = dsp->add(new graph::filter_node<Iir::RBJ::LowPass>(lpFilters, nChannels, nSampleRate, paramLpfFrequency, paramLpfQ), { nodeHpf });
+    nodeReverbSend = dsp->add(new bus::return_node(*buses, 1));
+    nodeReverb = dsp->add(new graph::convolver_node(reverbs, nChannels, paramReverbMix, true), { nodeReverbSend });
+    int nMaster = dsp->add(new graph::mix_node(), { nodeLpf, nodeReverb });
+    int nVis = dsp->add(new graph::block_node(StoreVisualizer), { nMaster });
+    int nMeter = dsp->add(new graph::block_node(StoreMeters), { nVis });
+    int nRecord = dsp->add(new graph::block_node(RecordOutput), { nMeter });
+    int nShared = dsp->add(new graph::block_node(WriteSharedOutput), { nRecord });
+    dsp->set_output(nShared);
+}
+
+void UpdateGraph()
+{
+    dsp->set_enabled(nodeMonoDelay, bMonoDelayEnabled);
+    dsp->set_enabled(nodePingPong, bStereoDelayEnabled);
+    dsp->set_enabled(nodeHpf, bHpfEnabled);
+    dsp->set_enabled(nodeLpf, bLpfEnabled);
+    dsp->set_enabled(nodeReverbSend, bReverbEnabled);
+    dsp->set_enabled(nodeReverb, bReverbEnabled);
+    dsp->commit();
+}
+
+// load ir.wav, or fall back to exponentially decaying noise with a different seed per channel
+void LoadReverb(const std::string& sPath, FTYPE dSeconds = 2.5)
+{
+    std::vector<std::vector<double>> vFile;
+    int nFileRate = 0;
+    bool bFile = wav::read(sPath, vFile, nFileRate) && !vFile.empty() && !vFile[0].empty();
+
+    reverbs = new sfx::convolver[nChannels];
+    for (int c = 0; c < nChannels; c++)
     {
-        unique_lock<mutex> lm(muxVis);
-        nVisPhase %= nVisMemorySize;
-        for (int c = 0; c < nChans; c++)
+        std::vector<FTYPE> vImpulse;
+        if (bFile)
+            vImpulse = vFile[std::min(c, (int)vFile.size() - 1)];
+        else
         {
-            if (dVisMemory[c] != nullptr)
-                dVisMemory[c][nVisPhase] = samples[c];
+            vImpulse.resize((size_t)(dSeconds * nSampleRate));
+            uint32_t seed = 0x9E3779B9u * (c + 1);
+            for (size_t i = 0; i < vImpulse.size(); i++)
+            {
+                seed = seed * 1664525u + 1013904223u;
+                FTYPE dNoise = (seed >> 8) / (FTYPE)(1 << 23) - 1.0;
+                vImpulse[i] = dNoise * exp(-6.9 * i / (dSeconds * nSampleRate));  // -60dB at the end
+            }
         }
-        nVisPhase++;
+
+        // unit energy so the mix level does not depend on the response
+        FTYPE dEnergy = 0.0;
+        for (FTYPE s : vImpulse)
+            dEnergy += s * s;
+        if (dEnergy > 0.0)
+            for (FTYPE& s : vImpulse)
+                s /= sqrt(dEnergy);
+
+        reverbs[c].load(vImpulse);
     }
+}
 
-    // store samples in FFT memory
-    if (bVisEnabled && nVisMode == 1 && dFFTMemoryPre != nullptr && dFFTMemoryPost != nullptr)
+// must run before anything builds its tables: fft plans for the reverb, the
+// spectrogram sizes and the 1280 pixel wide analyser, sine tables, note
+// frequencies and oversampling filters
+void LoadTables()
+{
+    if (!tables.open(sTablesPath, sTablesKey, sizeof(FTYPE)))
     {
-        unique_lock<mutex> lm(muxFFT);
-        nFFTPhase %= nFFTMemorySize;
-        for (int c = 0; c < nChans; c++)
-        {
-            if (dFFTMemoryPre[c] != nullptr)
-                dFFTMemoryPre[c][nFFTPhase] = samples[c];
-            if (nFFTPhase == 0)
-                fft_magnitude(dFFTMemoryPre[c], dFFTMemoryPost[c], nFFTMemorySize);
-        }
-        nFFTPhase++;
+        tablecache::builder b;
+        fastmath::cache_tables(b);
+        synth::cache_tables(b);
+        oversample::cache_tables(b);
+        fft_cache_tables(b, { 512, 1024, 2048, 2560, 4096, 8192 });
+        if (b.write(sTablesPath, sTablesKey, sizeof(FTYPE)))
+            tables.open(sTablesPath, sTablesKey, sizeof(FTYPE));
     }
+    if (tables.is_open())
+        tablecache::install(&tables);
+}
+
+// olcsynth_20240101_120000.wav in the working directory
+std::string RecordingName()
+{
+    char buf[64];
+    time_t t = time(nullptr);
+    strftime(buf, sizeof(buf), "olcsynth_%Y%m%d_%H%M%S.wav", localtime(&t));
+    return buf;
+}
+
+// one decimal place, meters read -inf until they have signal
+std::string FormatDecibels(FTYPE dDecibels)
+{
+    if (!std::isfinite(dDecibels))
+        return "-inf";
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%.1f", dDecibels);
+    return buf;
 }
 
 
@@ -154,6 +302,39 @@ private:
     FTYPE dWallTime = 0.0;
     std::vector<olc::Key> vKeys = { olc::Z, olc::S, olc::X, olc::C, olc::F, olc::V, olc::G, olc::B, olc::H, olc::N, olc::M, olc::K, olc::COMMA, olc::L, olc::PERIOD };
 
+    // oscilloscope time span
+    std::vector<FTYPE> vVisSpans = { 0.005, 0.01, 0.029, 0.1, 0.25, 1.0, 2.5, 5.0, 10.0, 30.0 };
+    int nVisSpan = 2;
+    std::vector<float> vVisMin;
+    std::vector<float> vVisMax;
+
+    // fft analyser, one unwindowed spectrum per nFFTSize samples, the plan and buffers are set up in OnUserCreate
+    int nFFTSize = 1;
+    const fft_plan* fftPlan = nullptr;
+    std::vector<double> vFFTFrame;
+    std::vector<std::complex<double>> vFFTSpectrum;
+    std::vector<std::vector<double>> vFFTMagnitude;
+    std::vector<uint64_t> vFFTEnd;
+    spectrum::column_map fftColumnMap;
+    spectrum::band_map fftBandMap;
+    spectrum::aggregate eFFTAggregate = spectrum::aggregate::max;
+    spectrum::bands eFFTBands = spectrum::bands::none;
+    std::vector<double> vFFTValues;
+
+    // spectrogram
+    int nSpecFFTSize = 2048;
+    int nSpecHopDiv = 4;
+    int nSpecHeight = 0;
+    stft::window_type eSpecWindow = stft::window_type::hann;
+    std::vector<stft::analyzer> vSpecAnalyzers;
+    std::vector<olc::Sprite*> vSpecSprites;
+    std::vector<olc::Decal*> vSpecDecals;
+    std::vector<int> vSpecColumn;
+    spectrum::column_map specRowMap;
+    std::vector<double> vSpecColumnDb;
+    std::vector<double> vSpecRowDb;
+    olc::Pixel pSpecPalette[256];
+
 public:
     olcNoiseMaker<short> *pSound = nullptr;
 
@@ -165,21 +346,41 @@ public:
     bool OnUserCreate() override
     {
         // setup visualizer
-        nVisMemorySize = ScreenWidth();
-        dVisMemory = new FTYPE*[nChannels];
-        nFFTMemorySize = ScreenWidth() * 2;
-        nFFTMemorySizeHalf = nFFTMemorySize / 2;
-        dFFTMemoryPre = new FTYPE*[nChannels];
-        dFFTMemoryPost = new FTYPE*[nChannels];
+        visPeaks = new peaks::pyramid[nChannels];
+        vVisMin.resize(ScreenWidth());
+        vVisMax.resize(ScreenWidth());
+        visHistory = new stft::history[nChannels];
+
+        // setup fft analyser
+        nFFTSize = ScreenWidth() * 2;
+        fftPlan = &fft_get_plan(nFFTSize);
+        vFFTFrame.assign(nFFTSize, 0.0);
+        vFFTSpectrum.assign(nFFTSize, std::complex<double>(0.0, 0.0));
+        vFFTMagnitude.assign(nChannels, std::vector<double>(nFFTSize / 2, 0.0));
+        vFFTEnd.assign(nChannels, 0);
+
+        // setup spectrogram, one scrolling sprite per channel
+        nSpecHeight = (ScreenHeight() - 130) / nChannels;
+        vSpecAnalyzers.resize(nChannels);
+        vSpecColumn.assign(nChannels, 0);
         for (int i = 0; i < nChannels; i++)
         {
-            dVisMemory[i] = new FTYPE[nVisMemorySize];
-            dFFTMemoryPre[i] = new FTYPE[nFFTMemorySize];
-            dFFTMemoryPost[i] = new FTYPE[nFFTMemorySizeHalf];
-            memset(&(dVisMemory[i])[0], 0.0, nVisMemorySize * sizeof(FTYPE));
-            memset(&(dFFTMemoryPre[i])[0], 0.0, nFFTMemorySize * sizeof(FTYPE));
-            memset(&(dFFTMemoryPost[i])[0], 0.0, nFFTMemorySizeHalf * sizeof(FTYPE));
+            vSpecSprites.push_back(new olc::Sprite(ScreenWidth(), nSpecHeight));
+            for (int y = 0; y < nSpecHeight; y++)
+                for (int x = 0; x < ScreenWidth(); x++)
+                    vSpecSprites[i]->SetPixel(x, y, olc::BLACK);
+            vSpecDecals.push_back(new olc::Decal(vSpecSprites[i]));
         }
+        for (int i = 0; i < 256; i++)
+        {
+            // black -> blue -> red -> yellow -> white
+            float f = i / 255.0f;
+            uint8_t r = (uint8_t)(255 * std::min(1.0f, std::max(0.0f, f * 3.0f - 1.0f)));
+            uint8_t g = (uint8_t)(255 * std::min(1.0f, std::max(0.0f, f * 3.0f - 2.0f)));
+            uint8_t b = (uint8_t)(255 * std::min(1.0f, std::max(0.0f, f < 0.33f ? f * 3.0f : (f < 0.66f ? 2.0f - f * 3.0f : f * 3.0f - 2.0f))));
+            pSpecPalette[i] = olc::Pixel(r, g, b);
+        }
+        SetupSpectrogram();
         bVisEnabled = true;
         
         return true;
@@ -189,47 +390,131 @@ public:
     {
         // cleanup visualizer
         bVisEnabled = false;
+        delete[] visPeaks;
+        visPeaks = nullptr;
         for (int i = 0; i < nChannels; i++)
         {
-            delete[] dVisMemory[i];
-            delete[] dFFTMemoryPre[i];
-            delete[] dFFTMemoryPost[i];
+            delete vSpecDecals[i];
+            delete vSpecSprites[i];
         }
-        delete[] dVisMemory;
-        delete[] dFFTMemoryPre;
-        delete[] dFFTMemoryPost;
+        delete[] visHistory;
+        visHistory = nullptr;
         return true;
     }
 
-    void DrawVisualizer(FTYPE* mem, int yOffset, int yScale, const olc::Pixel& p = olc::YELLOW)
+    // rebuild analyzers and the row -> bin range table after a settings change
+    void SetupSpectrogram()
+    {
+        for (auto& a : vSpecAnalyzers)
+            a.setup(nSpecFFTSize, nSpecFFTSize / nSpecHopDiv, eSpecWindow);
+
+        // rows are spaced logarithmically from 20Hz (bottom) to nyquist (top)
+        specRowMap.rebuild(nSpecHeight, nSpecFFTSize, (FTYPE)nSampleRate);
+        vSpecColumnDb.resize(nSpecFFTSize / 2);
+        vSpecRowDb.resize(nSpecHeight);
+    }
+
+    // analyse any new hops and write them as columns, O(height) per column
+    void UpdateSpectrogram()
+    {
+        const int nMaxColumnsPerFrame = 64;
+        for (int c = 0; c < nChannels; c++)
+        {
+            bool bUpdated = false;
+            for (int n = 0; n < nMaxColumnsPerFrame && vSpecAnalyzers[c].next_column(visHistory[c], vSpecColumnDb.data()); n++)
+            {
+                int x = vSpecColumn[c];
+                specRowMap.apply(vSpecColumnDb.data(), vSpecRowDb.data(), spectrum::aggregate::max);
+                for (int y = 0; y < nSpecHeight; y++)
+                {
+                    int i = (int)((vSpecRowDb[nSpecHeight - 1 - y] + 100.0) * 2.55);
+                    vSpecSprites[c]->SetPixel(x, y, pSpecPalette[std::min(255, std::max(0, i))]);
+                }
+                vSpecColumn[c] = (x + 1) % ScreenWidth();
+                bUpdated = true;
+            }
+            if (bUpdated)
+                vSpecDecals[c]->Update();
+        }
+    }
+
+    // the sprite is a ring of columns, so draw it in two parts with the newest column on the right
+    void DrawSpectrogram(int nChannel, int yOffset)
     {
-        olc::vi2d vPrevPixel;
-        for (int x = 0; x < ScreenWidth() - 1; x++)
+        float w = (float)ScreenWidth();
+        float h = (float)nSpecHeight;
+        float x = (float)vSpecColumn[nChannel];
+        olc::Decal* d = vSpecDecals[nChannel];
+        DrawPartialDecal({ 0.0f, (float)yOffset }, d, { x, 0.0f }, { w - x, h });
+        if (x > 0.0f)
+            DrawPartialDecal({ w - x, (float)yOffset }, d, { 0.0f, 0.0f }, { x, h });
+    }
+
+    void UpdateSpectrogramSettings()
+    {
+        bool bChanged = false;
+        if (GetKey(olc::E).bPressed)
         {
-            int i = (nVisPhase + x + 1) % nVisMemorySize;
-            int y = mem[i] * yScale + yOffset;
-            if (x != 0)
-                DrawLine(vPrevPixel, { x, y }, p);
-            vPrevPixel = { x, y };
+            eSpecWindow = eSpecWindow == stft::window_type::hann ? stft::window_type::blackman_harris : stft::window_type::hann;
+            bChanged = true;
         }
+        if (GetKey(olc::R).bPressed)
+        {
+            nSpecFFTSize = nSpecFFTSize >= 8192 ? 512 : nSpecFFTSize * 2;
+            bChanged = true;
+        }
+        if (GetKey(olc::T).bPressed)
+        {
+            nSpecHopDiv = nSpecHopDiv >= 8 ? 1 : nSpecHopDiv * 2;
+            bChanged = true;
+        }
+        if (bChanged)
+            SetupSpectrogram();
     }
 
-    void DrawFFT(FTYPE* mem, int yOffset, int yScale, const olc::Pixel& p = olc::RED)
+    // lets the frames:: drawing code, shared with tools/visualizer_export.cpp, draw on the window
+    struct screen_target
+    {
+        olc::PixelGameEngine* pge;
+        void line(int x0, int y0, int x1, int y1, frames::color c) { pge->DrawLine(x0, y0, x1, y1, olc::Pixel(c.r, c.g, c.b)); }
+        void fill(int x, int y, int w, int h, frames::color c) { pge->FillRect(x, y, w, h, olc::Pixel(c.r, c.g, c.b)); }
+    };
+
+    void DrawVisualizer(const peaks::pyramid& mem, int yOffset, int yScale, const olc::Pixel& p = olc::YELLOW)
     {
-        olc::vi2d vPrevPixel;
-        for (int x = 0; x < ScreenWidth(); x++)
+        screen_target screen{ this };
+        mem.query((uint64_t)(vVisSpans[nVisSpan] * nSampleRate), ScreenWidth(), vVisMin.data(), vVisMax.data());
+        frames::draw_scope(screen, vVisMin.data(), vVisMax.data(), ScreenWidth(), yOffset, yScale, { p.r, p.g, p.b });
+    }
+
+    // a new spectrum each time a full nFFTSize samples have been recorded since the last one
+    void UpdateFFT()
+    {
+        for (int c = 0; c < nChannels; c++)
         {
-            int wx = (int)(x * (double)nFFTMemorySizeHalf / (double)ScreenWidth());
-            FTYPE lx = -(wx / PI) * log10((nFFTMemorySizeHalf - wx) / (double)nFFTMemorySizeHalf);
-            int i = (int)std::min<FTYPE>(nFFTMemorySizeHalf - 1, std::max<FTYPE>(0, floor(lx)));
-            
-            int y = -mem[i] * 0.005 * yScale + yOffset;
-            if (x != 0)
-                DrawLine(vPrevPixel, { x, y }, p);
-            vPrevPixel = { x, y };
+            uint64_t nWritten = visHistory[c].written();
+            uint64_t nEnd = nWritten - nWritten % nFFTSize;
+            if (nEnd == vFFTEnd[c] || nEnd < (uint64_t)nFFTSize)
+                continue;
+            vFFTEnd[c] = nEnd;
+
+            visHistory[c].read(nEnd, nFFTSize, vFFTFrame.data());
+            for (int i = 0; i < nFFTSize; i++)
+                vFFTSpectrum[i] = std::complex<double>(vFFTFrame[i], 0.0);
+            fftPlan->forward(vFFTSpectrum.data());
+            for (int i = 0; i < nFFTSize / 2; i++)
+                vFFTMagnitude[c][i] = std::abs(vFFTSpectrum[i]);
         }
     }
 
+    void DrawFFT(FTYPE* mem, int yOffset, int yScale, const olc::Pixel& p = olc::RED)
+    {
+        // mapping tables are cached and only rebuilt when the width or fft size changes
+        screen_target screen{ this };
+        frames::draw_spectrum(screen, mem, nFFTSize, (FTYPE)nSampleRate, ScreenWidth(), yOffset, yScale, { p.r, p.g, p.b },
+            eFFTAggregate, eFFTBands, fftColumnMap, fftBandMap, vFFTValues);
+    }
+
     bool OnUserUpdate(float fElapsedTime) override
     {
         if (!UpdateSound(fElapsedTime)) return false;
@@ -237,7 +522,30 @@ public:
 
         if (GetKey(olc::TAB).bPressed)
         {
-            nVisMode = (nVisMode == 0) ? 1 : 0;
+            nVisMode = (nVisMode + 1) % 3;
+        }
+
+        if (nVisMode == 0)
+        {
+            if (GetKey(olc::LEFT).bPressed && nVisSpan > 0)
+                nVisSpan--;
+            if (GetKey(olc::RIGHT).bPressed && nVisSpan < (int)vVisSpans.size() - 1)
+                nVisSpan++;
+        }
+
+        if (nVisMode == 1)
+        {
+            if (GetKey(olc::Y).bPressed)
+                eFFTAggregate = eFFTAggregate == spectrum::aggregate::max ? spectrum::aggregate::rms : spectrum::aggregate::max;
+            if (GetKey(olc::U).bPressed)
+                eFFTBands = (spectrum::bands)(((int)eFFTBands + 1) % 3);
+            UpdateFFT();
+        }
+
+        if (nVisMode == 2)
+        {
+            UpdateSpectrogramSettings();
+            UpdateSpectrogram();
         }
 
         Clear(0);
@@ -246,24 +554,32 @@ public:
         for (int c = 0; c < nChannels; c++)
         {          
             muxVis.lock();
-            muxFFT.lock();
 
             int yScale = ScreenHeight() / nChannels - 50;
             int yOffset = (c + 1) * yScale - yScale / 2 + 100;
             switch (nVisMode)
             {
-            case 0: DrawVisualizer(dVisMemory[c], yOffset, yScale); break;
-            case 1: DrawFFT(dFFTMemoryPost[c], yOffset + c * 15 + 60, yScale); break;
+            case 0: DrawVisualizer(visPeaks[c], yOffset, yScale); break;
+            case 1: DrawFFT(vFFTMagnitude[c].data(), yOffset + c * 15 + 60, yScale); break;
+            case 2: DrawSpectrogram(c, 80 + c * nSpecHeight); break;
             }
 
             muxVis.unlock();
-            muxFFT.unlock();
         }
 
         // ui
         FTYPE dTimeNow = pSound->GetTime();
         
-        std::string sNotes = "Notes: " + to_string(vNotes.size()) + " Wall Time: " + to_string(dWallTime) + " CPU Time: " + to_string(dTimeNow) + " Latency: " + to_string(dWallTime - dTimeNow) ;
+        synth::instrument_single_osc& instrument = instruments[nSelectedBus];
+        size_t nNotes = 0;
+        for (int b = 0; b < buses->count(); b++)
+        {
+            std::unique_lock<std::mutex> lm((*buses)[b].muxNotes);
+            nNotes += (*buses)[b].vNotes.size();
+        }
+
+        std::string sNotes = "Notes: " + to_string(nNotes) + " Wall Time: " + to_string(dWallTime) + " CPU Time: " + to_string(dTimeNow) + " Latency: " + to_string(dWallTime - dTimeNow) ;
+        std::string sOutput = "Output: " + to_string((int)pSound->GetLatency()) + "ms (" + to_string(pSound->GetQueueDepth()) + "/" + to_string(pSound->GetQueueTarget()) + " blocks) Underruns: " + to_string(pSound->GetUnderruns()) + " Load: " + to_string((int)(pSound->GetRenderLoad() * 100.0)) + "%";
         
         std::string sSin = "1) Sine";
         std::string sSaw = "2) Sawtooth";
@@ -274,11 +590,41 @@ public:
         std::string sStereoDelayStatus  = "W) Stereo Delay: " + std::string(bStereoDelayEnabled ? "ON" : "OFF");
         std::string sHPFStatus          = "O) HPF: " + std::string(bHpfEnabled ? "ON" : "OFF");
         std::string sLPFStatus          = "P) LPF: " + std::string(bLpfEnabled ? "ON" : "OFF");
-        std::string sVolume             = "Volume: " + to_string(instrument.dVolume);
+        std::string sReverbStatus       = "I) Reverb: " + std::string(bReverbEnabled ? "ON" : "OFF");
+        std::string sBusStatus          = "D) Bus: " + std::to_string(nSelectedBus + 1) + "/" + std::to_string(nBuses) + "  J) Layer: " + std::string(bLayered ? "ON" : "OFF");
+        std::string sCutoff             = "PGUP/PGDN) Cutoff: " + std::to_string((int)paramLpfFrequency.get()) + "Hz";
+        std::string sAutomation         = "9) Record  0) Play: " + std::string(param::lane_mode_name(laneLpfFrequency.mode())) + " (" + std::to_string(laneLpfFrequency.count()) + " points"
+            + (laneLpfFrequency.dropped() > 0 ? ", " + std::to_string(laneLpfFrequency.dropped()) + " dropped, lane full)" : ")");
+        std::string sVolume             = "Volume: " + to_string((*buses)[nSelectedBus].paramGain.get());
         std::string sOctave             = "Octave: " + std::to_string(nNoteOffset / 12) + " Total Offset: " + std::to_string(nNoteOffset);
         std::string sHarmonics          = "Harmonics: " + std::to_string(instrument.nHarmonics);
+        std::string sAccuracy           = "A) Math: " + std::string(fastmath::accuracy_name(instrument.eAccuracy));
+        std::string sOversampling       = "F2) Oversampling: " + std::to_string((*buses)[nSelectedBus].oversampling()) + "x";
+        meter::snapshot levels;
+        meters->read(levels);
+        std::string sLevels = "Peak:";
+        for (int c = 0; c < levels.nChans; c++)
+            sLevels += " " + FormatDecibels(meter::to_db(levels.dPeakMax[c]));
+        sLevels += " dBFS  True Peak:";
+        for (int c = 0; c < levels.nChans; c++)
+            sLevels += " " + FormatDecibels(meter::to_db(levels.dTruePeakMax[c]));
+        sLevels += " dBTP  RMS:";
+        for (int c = 0; c < levels.nChans; c++)
+            sLevels += " " + FormatDecibels(meter::to_db(levels.dRms[c]));
+        std::string sLoudness = "F3) Loudness M: " + FormatDecibels(levels.dMomentary) + " S: " + FormatDecibels(levels.dShortTerm) + " I: " + FormatDecibels(levels.dIntegrated) + " LUFS";
+
+        std::string sRecord = "F4) Record: " + std::string(recording->recording() ? recording->path() + " " + std::to_string((int)recording->seconds()) + "s" : "OFF");
+        sRecord += "  Buffer: " + std::to_string((int)(recording->buffered() * 100.0)) + "%  Overruns: " + std::to_string(recording->overruns()) + " (" + std::to_string(recording->dropped()) + " frames)";
+        if (recording->failed())
+            sRecord += "  WRITE FAILED";
+
+        std::string sUnison             = "5/6) Unison: " + std::to_string(instrument.nUnison) + "  7/8) Detune: " + std::to_string((int)(instrument.dDetune * 100.0)) + " cents";
 
         DrawString({ 10, ScreenHeight() - 20 }, sNotes);
+        DrawString({ 10, ScreenHeight() - 40 }, sOutput);
+        DrawString({ 10, ScreenHeight() - 60 }, sLoudness);
+        DrawString({ 10, ScreenHeight() - 80 }, sLevels);
+        DrawString({ 10, ScreenHeight() - 100 }, sRecord, recording->recording() ? olc::WHITE : olc::GREY);
 
         using wf = wavegen::WaveFunction;
         DrawString({ 10, 10 }, sSin, instrument.function == wf::SINE ? olc::WHITE : olc::GREY);
@@ -290,12 +636,37 @@ public:
         DrawString({ 10 + 200, 30 }, sStereoDelayStatus, bStereoDelayEnabled ? olc::WHITE : olc::GREY);
         DrawString({ 10, 50 }, sHPFStatus, bHpfEnabled ? olc::WHITE : olc::GREY);
         DrawString({ 10 + 200, 50 }, sLPFStatus, bLpfEnabled ? olc::WHITE : olc::GREY);
+        DrawString({ 10, 70 }, sReverbStatus, bReverbEnabled ? olc::WHITE : olc::GREY);
+        DrawString({ 10, 90 }, sBusStatus);
+        DrawString({ 10, 110 }, sCutoff);
+        DrawString({ 10 + 200, 110 }, sAutomation, laneLpfFrequency.mode() == param::lane_mode::off ? olc::GREY : olc::WHITE);
 
         DrawString({ (int)(ScreenWidth() - sVolume.length() * 8 - 10), 10 }, sVolume);
         DrawString({ (int)(ScreenWidth() - sOctave.length() * 8 - 10), 30 }, sOctave);
 
         if (instrument.function != wf::SINE)
             DrawString({ (int)(ScreenWidth() - sHarmonics.length() * 8 - 10), 50 }, sHarmonics);
+        DrawString({ (int)(ScreenWidth() - sAccuracy.length() * 8 - 10), 70 }, sAccuracy);
+        DrawString({ (int)(ScreenWidth() - sUnison.length() * 8 - 10), 90 }, sUnison);
+        DrawString({ (int)(ScreenWidth() - sOversampling.length() * 8 - 10), 110 }, sOversampling);
+
+        if (nVisMode == 0)
+        {
+            std::string sSpan = "LEFT/RIGHT) Span: " + std::to_string((int)(vVisSpans[nVisSpan] * 1000.0)) + "ms";
+            DrawString({ (int)(ScreenWidth() - sSpan.length() * 8 - 10), ScreenHeight() - 40 }, sSpan);
+        }
+
+        if (nVisMode == 1)
+        {
+            std::string sFFT = "Y) Bins: " + std::string(spectrum::aggregate_name(eFFTAggregate)) + "  U) Bands: " + std::string(spectrum::bands_name(eFFTBands));
+            DrawString({ (int)(ScreenWidth() - sFFT.length() * 8 - 10), ScreenHeight() - 40 }, sFFT);
+        }
+
+        if (nVisMode == 2)
+        {
+            std::string sSpec = "E) Window: " + std::string(stft::window_name(eSpecWindow)) + "  R) FFT: " + std::to_string(nSpecFFTSize) + "  T) Hop: " + std::to_string(nSpecFFTSize / nSpecHopDiv);
+            DrawString({ (int)(ScreenWidth() - sSpec.length() * 8 - 10), ScreenHeight() - 40 }, sSpec);
+        }
 
         return !(GetKey(olc::ESCAPE).bPressed);
     }
@@ -311,18 +682,26 @@ public:
             bHpfEnabled = !bHpfEnabled;
         if (GetKey(olc::P).bPressed)
             bLpfEnabled = !bLpfEnabled;
+        if (GetKey(olc::I).bPressed)
+            bReverbEnabled = !bReverbEnabled;
+        UpdateGraph();
+
+        // volume is the gain of the selected bus, the mixer ramps it per sample
+        param::parameter& gain = (*buses)[nSelectedBus].paramGain;
         if (GetKey(olc::UP).bHeld)
-        {
-            instrument.dVolume += instrument.dVolume * 0.5 * fElapsedTime;
-            if (instrument.dVolume >= 1.0)
-                instrument.dVolume = 1.0;
-        }
+            gain.set(std::min(1.0, gain.get() + gain.get() * 0.5 * fElapsedTime));
         if (GetKey(olc::DOWN).bHeld)
-        {
-            instrument.dVolume -= instrument.dVolume * 0.5 * fElapsedTime;
-            if (instrument.dVolume < 0.1)
-                instrument.dVolume = 0.1;
-        }
+            gain.set(std::max(0.1, gain.get() - gain.get() * 0.5 * fElapsedTime));
+
+        // lpf cutoff sweeps by an octave a second, 9 records it and 0 plays the take back
+        if (GetKey(olc::PGUP).bHeld)
+            paramLpfFrequency.set(paramLpfFrequency.get() * std::pow(2.0, fElapsedTime));
+        if (GetKey(olc::PGDN).bHeld)
+            paramLpfFrequency.set(paramLpfFrequency.get() * std::pow(2.0, -fElapsedTime));
+        if (GetKey(olc::K9).bPressed)
+            laneLpfFrequency.set_mode(laneLpfFrequency.mode() == param::lane_mode::record ? param::lane_mode::off : param::lane_mode::record);
+        if (GetKey(olc::K0).bPressed)
+            laneLpfFrequency.set_mode(laneLpfFrequency.mode() == param::lane_mode::play ? param::lane_mode::off : param::lane_mode::play);
         return true;
     }
 
@@ -334,6 +713,12 @@ public:
         dWallTime += fElapsedTime;
         FTYPE dTimeNow = pSound->GetTime();
 
+        if (GetKey(olc::D).bPressed)
+            nSelectedBus = (nSelectedBus + 1) % nBuses;
+        if (GetKey(olc::J).bPressed)
+            bLayered = !bLayered;
+
+        synth::instrument_single_osc& instrument = instruments[nSelectedBus];
         if (GetKey(olc::K1).bPressed)
             instrument.function = wavegen::WaveFunction::SINE;
         if (GetKey(olc::K2).bPressed) 
@@ -342,6 +727,28 @@ public:
             instrument.function = wavegen::WaveFunction::SQUARE;
         if (GetKey(olc::K4).bPressed) 
             instrument.function = wavegen::WaveFunction::TRIANGLE;
+        if (GetKey(olc::F3).bPressed)
+            meters->reset();
+        if (GetKey(olc::F4).bPressed)
+        {
+            if (recording->recording())
+                recording->stop();
+            else
+                recording->start(RecordingName());
+        }
+
+        if (GetKey(olc::F2).bPressed)
+            (*buses)[nSelectedBus].set_oversampling((*buses)[nSelectedBus].oversampling() >= oversample::MAX_FACTOR ? 1 : (*buses)[nSelectedBus].oversampling() * 2);
+        if (GetKey(olc::A).bPressed)
+            instrument.eAccuracy = (fastmath::accuracy)(((int)instrument.eAccuracy.load() + 1) % 3);
+        if (GetKey(olc::K5).bPressed)
+            instrument.nUnison = std::max(1, instrument.nUnison - 1);
+        if (GetKey(olc::K6).bPressed)
+            instrument.nUnison = std::min(synth::MAX_UNISON, instrument.nUnison + 1);
+        if (GetKey(olc::K7).bPressed)
+            instrument.dDetune = std::max(0.0, instrument.dDetune - 0.05);
+        if (GetKey(olc::K8).bPressed)
+            instrument.dDetune = std::min(1.0, instrument.dDetune + 0.05);
         if (GetKey(olc::NP_ADD).bPressed)
             instrument.nHarmonics++;
         if (GetKey(olc::NP_SUB).bPressed)
@@ -360,51 +767,56 @@ public:
         if (instrument.nHarmonics < 1)
             instrument.nHarmonics = 1;
 
-        // check key states to add/remove notes
-        for (int k = 0; k < vKeys.size(); k++)
+        // check key states to add/remove notes, new notes go to the selected bus or to every bus when layered
+        for (int b = 0; b < buses->count(); b++)
         {
-            // Check if note already exists in currently playing notes
-            muxNotes.lock();
-            auto noteFound = find_if(vNotes.begin(), vNotes.end(), [&k](synth::note const& item) { return item.id == k + nNoteOffset; });
-            if (noteFound == vNotes.end())
+            bus::bus& target = (*buses)[b];
+            bool bTarget = bLayered || b == nSelectedBus;
+            for (int k = 0; k < vKeys.size(); k++)
             {
-                // note not found in vector
-                if (GetKey(vKeys[k]).bPressed)
+                // Check if note already exists in currently playing notes
+                target.muxNotes.lock();
+                auto noteFound = find_if(target.vNotes.begin(), target.vNotes.end(), [&k](synth::note const& item) { return item.id == k + nNoteOffset; });
+                if (noteFound == target.vNotes.end())
                 {
-                    // key is pressed, make a new note
-                    synth::note n;
-                    n.id = k + nNoteOffset;
-                    n.offset = nNoteOffset;
-                    n.on = dTimeNow;
-                    n.active = true;
-                    n.channel = &instrument;
-                    n.velocity = (FTYPE)rand() / (FTYPE)RAND_MAX * 0.6 + 0.4;   // random velocity for now
-                    // Add note to vector
-                    vNotes.emplace_back(n);
+                    // note not found in vector
+                    if (bTarget && GetKey(vKeys[k]).bPressed)
+                    {
+                        // key is pressed, make a new note
+                        synth::note n;
+                        n.id = k + nNoteOffset;
+                        n.offset = nNoteOffset;
+                        n.on = dTimeNow;
+                        n.active = true;
+                        n.channel = target.instrument;
+                        n.velocity = (FTYPE)rand() / (FTYPE)RAND_MAX * 0.6 + 0.4;   // random velocity for now
+                        // Add note to vector
+                        target.vNotes.emplace_back(n);
+                    }
                 }
-            }
-            else
-            {
-                // note does exist in vector
-                if (GetKey(vKeys[k]).bHeld)
+                else
                 {
-                    // key still held, do nothing
-                    if (noteFound->off > noteFound->on)
+                    // note does exist in vector
+                    if (bTarget && GetKey(vKeys[k]).bHeld)
                     {
-                        // key pressed again during release phase
-                        noteFound->on = dTimeNow;
-                        noteFound->active = true;
+                        // key still held, do nothing
+                        if (noteFound->off > noteFound->on)
+                        {
+                            // key pressed again during release phase
+                            noteFound->on = dTimeNow;
+                            noteFound->active = true;
+                        }
                     }
                 }
-            }
 
-            // double check notes outside of the current key ids
-            for (auto& n : vNotes)
-                if (!GetKey(vKeys[n.id - n.offset]).bHeld)
-                    if (n.off < n.on)
-                        n.off = dTimeNow;
+                // double check notes outside of the current key ids
+                for (auto& n : target.vNotes)
+                    if (!GetKey(vKeys[n.id - n.offset]).bHeld)
+                        if (n.off < n.on)
+                            n.off = dTimeNow;
 
-            muxNotes.unlock();
+                target.muxNotes.unlock();
+            }
         }
         return true;
     }
@@ -412,19 +824,42 @@ public:
 
 int main()
 {
-    // setup noise maker
-    vector<string> devices = olcNoiseMaker<short>::Enumerate();
-    olcNoiseMaker<short> sound(devices[0], nSampleRate, nChannels, 8, 1024);
-    sound.SetUserFunctionAllChans(ProcessAllChannels);
+    // setup shared tables
+    LoadTables();
 
-    // setup filters
+    // setup filters (before the audio thread can reach them)
     hpFilters = new Iir::RBJ::HighPass[nChannels];
     lpFilters = new Iir::RBJ::LowPass[nChannels];
+    padFilters = new Iir::RBJ::LowPass[nChannels];
     for (int c = 0; c < nChannels; c++)
     {
-        lpFilters[c].setup((FTYPE)nSampleRate, dLpfFrequency, dLpfQ);
-        hpFilters[c].setup((FTYPE)nSampleRate, dHpfFrequency, dHpfQ);
+        lpFilters[c].setup((FTYPE)nSampleRate, paramLpfFrequency.get(), paramLpfQ.get());
+        hpFilters[c].setup((FTYPE)nSampleRate, paramHpfFrequency.get(), paramHpfQ.get());
+        padFilters[c].setup((FTYPE)nSampleRate, dPadLpfFrequency, paramLpfQ.get());
     }
+    PrepareParameters();
+
+    // setup reverb
+    LoadReverb("ir.wav");
+
+    // setup meters
+    meters = new meter::meter(nChannels, nSampleRate, 512);
+
+    // setup recorder, 8 seconds of ring between the audio thread and the disk
+    recording = new recorder::recorder(nChannels, nSampleRate, 8.0);
+
+    // setup shared memory output, about 3 seconds of ring
+    shmOutput.create("olcsynth", nChannels, nSampleRate, 1 << 17);
+
+    // setup buses and signal graph
+    BuildBuses();
+    BuildGraph();
+    UpdateGraph();
+
+    // setup noise maker
+    vector<string> devices = olcNoiseMaker<short>::Enumerate();
+    olcNoiseMaker<short> sound(devices[0], nSampleRate, nChannels, 16, 512, true, 2);
+    sound.SetUserFunctionBlock(ProcessBlock);
 
     // setup olc pge app
     olcSynth app;
@@ -432,9 +867,18 @@ int main()
     app.Construct(1280, 720, 1, 1);
     app.Start();
 
-    // delete filters
+    // stop the audio thread before freeing what it uses
+    sound.Stop();
+
+    // delete filters and graph
     delete[] hpFilters;
     delete[] lpFilters;
+    delete dsp;
+    delete buses;
+    delete[] padFilters;
+    delete[] reverbs;
+    delete meters;
+    delete recording;
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,396 @@
+/*
+    Golden render tests for the synth engine.
+
+    Renders a short note script through the voice mix and then through the
+    master effect chain: the mono delay, the ping pong delay, and the whole
+    chain of both delays into a high and a low pass filter. Each render is
+    compared against its reference in tests/golden with golden::compare.
+    Also checks fft_magnitude against a naive DFT across power of two, mixed
+    radix and Bluestein sizes. Prints one line per check and exits non-zero
+    if any of them fails.
+
+    golden_test [--update] [reference dir]
+
+    The references are rendered by the code the engine started from, not by
+    the code under test. Built with -DGOLDEN_BASELINE this file renders the
+    same cases through that tree's note handling, ProcessChannel and
+    ProcessAllChannels, using only what it already had:
+
+        git worktree add ../olcsynth-baseline e36c80f
+        g++ -std=c++17 -O2 -DGOLDEN_BASELINE -I../olcsynth-baseline/lib -Ilib tests/golden_test.cpp -o golden_baseline
+        golden_baseline --update
+
+    Both trees get their oscillators from wavegen::Generate and their filters
+    from Iir::RBJ, neither of which is part of this repository, so the voice
+    here is a plain sine and the filters are a textbook RBJ biquad with the
+    interface filter_node expects. --update on a normal build writes the
+    current output instead, for changes that are meant to alter it.
+*/
+#include "synth.h"
+#include "sfx.h"
+#ifndef GOLDEN_BASELINE
+#include "render.h"
+#include "graph.h"
+#include "param.h"
+#endif
+#include "golden.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+// constants
+const int nSampleRate = 22050;
+const double dSeconds = 1.2;
+const int nBlockFrames = 512;
+const double dMaxFFTError = 1e-12;     // relative to the peak bin
+
+// master chain settings, the live defaults with the mono delay shortened so its echoes land inside the render
+const FTYPE dDelayTime = 0.25;
+const FTYPE dDelayFeedback = 0.6;
+const float fDelayMix = 0.5f;
+const FTYPE dPpTimeLeft = 0.3, dPpTimeRight = 0.5;
+const FTYPE dPpFeedback = 0.75;
+const float fPpMix = 0.5f;
+const FTYPE dHpfFrequency = 100.0, dHpfQ = 0.3;
+const FTYPE dLpfFrequency = 1500.0, dLpfQ = 0.7;
+
+
+struct test_case
+{
+    std::string name;
+    int nChannels;
+    bool bMonoDelay;
+    bool bPingPong;
+    bool bFilters;
+};
+
+// a note on/off at a fixed time
+struct cue
+{
+    FTYPE dTime;
+    int nNote;
+    bool bOn;
+    FTYPE dVelocity;
+};
+
+// two overlapping notes, the first retriggered in its release, then both released
+std::vector<cue> script()
+{
+    return {
+        { 0.01, 57, true, 0.7 },
+        { 0.10, 64, true, 0.7 },
+        { 0.30, 57, false, 0.7 },
+        { 0.35, 64, false, 0.7 },
+        { 0.40, 57, true, 0.7 },
+        { 0.55, 57, false, 0.7 },
+    };
+}
+
+
+// the envelope and note table of instrument_single_osc with a sine in place of wavegen::Generate
+struct sine_voice : synth::instrument_base
+{
+    sine_voice()
+    {
+        name = "golden sine";
+        env.dAttackTime = 0.15;
+        env.dDecayTime = 0.4;
+        env.dSustainAmplitude = 0.9;
+        env.dReleaseTime = 0.3;
+    }
+
+    FTYPE sound(const FTYPE dTime, synth::note n, bool& bNoteFinished) override
+    {
+        FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off, n.velocity);
+        if (n.channel->env.state == synth::adsr_state::attack)
+            dAmplitude = std::max(dAmplitude, mNoteAmplitudes.at(n.id));
+        if (dAmplitude <= 0.0)
+            bNoteFinished = true;
+        mNoteAmplitudes.at(n.id) = dAmplitude;
+        return sin(synth::w(synth::scale(n.id)) * dTime) * dAmplitude;
+    }
+};
+
+// RBJ cookbook biquad, direct form 1, in place of Iir::RBJ
+template<bool bHighPass>
+struct rbj_filter
+{
+    double b0 = 1.0, b1 = 0.0, b2 = 0.0, a1 = 0.0, a2 = 0.0;
+    double x1 = 0.0, x2 = 0.0, y1 = 0.0, y2 = 0.0;
+
+    void setup(double dRate, double dFrequency, double dQ)
+    {
+        double w0 = 2.0 * PI * dFrequency / dRate;
+        double cs = cos(w0);
+        double alpha = sin(w0) / (2.0 * dQ);
+        double a0 = 1.0 + alpha;
+        b1 = (bHighPass ? -(1.0 + cs) : 1.0 - cs) / a0;
+        b0 = b2 = (bHighPass ? (1.0 + cs) : 1.0 - cs) / 2.0 / a0;
+        a1 = -2.0 * cs / a0;
+        a2 = (1.0 - alpha) / a0;
+    }
+
+    double filter(double x)
+    {
+        double y = b0 * x + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
+        x2 = x1;
+        x1 = x;
+        y2 = y1;
+        y1 = y;
+        return y;
+    }
+
+    void reset()
+    {
+        x1 = x2 = y1 = y2 = 0.0;
+    }
+};
+
+
+#ifdef GOLDEN_BASELINE
+
+// the baseline ui thread's note handling and ProcessChannel, one frame at a time
+void render_voices(synth::instrument_base& instrument, int nFrames, std::vector<FTYPE>& vOut)
+{
+    std::vector<cue> vScript = script();
+    std::vector<synth::note> vNotes;
+    vOut.assign(nFrames, 0.0);
+    size_t e = 0;
+    for (int i = 0; i < nFrames; i++)
+    {
+        FTYPE dTime = i / (FTYPE)nSampleRate;
+        for (; e < vScript.size() && vScript[e].dTime <= dTime; e++)
+        {
+            const cue& c = vScript[e];
+            auto n = std::find_if(vNotes.begin(), vNotes.end(), [&c](synth::note const& item) { return item.id == c.nNote; });
+            if (c.bOn && n == vNotes.end())
+            {
+                synth::note nn;
+                nn.id = c.nNote;
+                nn.on = dTime;
+                nn.active = true;
+                nn.channel = &instrument;
+                nn.velocity = c.dVelocity;
+                vNotes.emplace_back(nn);
+            }
+            else if (c.bOn && n->off > n->on)
+            {
+                n->on = dTime;
+                n->active = true;
+            }
+            else if (!c.bOn && n != vNotes.end() && n->off < n->on)
+                n->off = dTime;
+        }
+
+        FTYPE dMixedOutput = 0.0;
+        for (auto &n : vNotes)
+        {
+            bool bNoteFinished = false;
+            FTYPE dSound = 0.0;
+            if (n.channel != nullptr)
+                dSound = n.channel->sound(dTime, n, bNoteFinished);
+            dMixedOutput += dSound;
+            if (bNoteFinished)
+            {
+                n.active = false;
+                n.channel->env.state = synth::adsr_state::inactive;
+            }
+        }
+        safe_remove<std::vector<synth::note>>(vNotes, [](synth::note const& item) { return item.active; });
+        vOut[i] = dMixedOutput * 0.2;
+    }
+}
+
+// the baseline ProcessAllChannels with the chosen stages switched on
+void render_chain(const test_case& t, const std::vector<FTYPE>& vDry, std::vector<FTYPE>& vOut)
+{
+    int nChans = t.nChannels;
+    int nFrames = (int)vDry.size();
+    sfx::monodelay monoDelay{ nSampleRate, 4.0 };
+    sfx::pingpongdelay pingPong{ nSampleRate, 4.0 };
+    sfx::pingpongdelay::stereo_sample ppTime(dPpTimeLeft, dPpTimeRight);
+    sfx::pingpongdelay::stereo_sample ppFeedback(dPpFeedback, dPpFeedback);
+    std::vector<rbj_filter<true>> vHpf(nChans);
+    std::vector<rbj_filter<false>> vLpf(nChans);
+    for (int c = 0; c < nChans; c++)
+    {
+        vHpf[c].setup(nSampleRate, dHpfFrequency, dHpfQ);
+        vLpf[c].setup(nSampleRate, dLpfFrequency, dLpfQ);
+    }
+
+    vOut.assign(nFrames * nChans, 0.0);
+    for (int i = 0; i < nFrames; i++)
+    {
+        FTYPE* samples = &vOut[i * nChans];
+        for (int c = 0; c < nChans; c++)
+            samples[c] = vDry[i];
+
+        if (t.bMonoDelay)
+        {
+            FTYPE dSummedOutput = 0.0;
+            for (int c = 0; c < nChans; c++)
+                dSummedOutput += samples[c];
+            dSummedOutput = dSummedOutput / (FTYPE)nChans;
+            monoDelay.process(dSummedOutput, dDelayTime, dDelayFeedback, fDelayMix);
+            for (int c = 0; c < nChans; c++)
+                samples[c] = dSummedOutput;
+        }
+
+        if (t.bPingPong)
+            pingPong.process(nChans, samples, ppTime, ppFeedback, fPpMix);
+
+        if (t.bFilters)
+            for (int c = 0; c < nChans; c++)
+                samples[c] = vLpf[c].filter(vHpf[c].filter(samples[c]));
+    }
+}
+
+#else
+
+void render_voices(synth::instrument_base& instrument, int nFrames, std::vector<FTYPE>& vOut)
+{
+    std::vector<render::event> vScript;
+    for (const cue& c : script())
+        vScript.push_back({ c.dTime, c.nNote, c.bOn, c.dVelocity });
+    render::render_script(instrument, vScript, nSampleRate, nFrames, vOut);
+}
+
+// plays a prerendered mono signal on every channel
+class buffer_node : public graph::node
+{
+private:
+    const std::vector<FTYPE>& vSource;
+    size_t nPosition = 0;
+
+public:
+    buffer_node(const std::vector<FTYPE>& v) : vSource(v) {}
+
+    void process(int nChans, int nFrames, FTYPE dTime, FTYPE* const* ppIn, int nInputs, FTYPE* pOut) override
+    {
+        for (int n = 0; n < nFrames; n++, nPosition++)
+            for (int c = 0; c < nChans; c++)
+                pOut[n * nChans + c] = nPosition < vSource.size() ? vSource[nPosition] : 0.0;
+    }
+};
+
+// the live master chain, built from the same graph nodes as the window
+void render_chain(const test_case& t, const std::vector<FTYPE>& vDry, std::vector<FTYPE>& vOut)
+{
+    int nChans = t.nChannels;
+    int nFrames = (int)vDry.size();
+    sfx::monodelay monoDelay{ nSampleRate, 4.0 };
+    sfx::pingpongdelay pingPong{ nSampleRate, 4.0 };
+    std::vector<rbj_filter<true>> vHpf(nChans);
+    std::vector<rbj_filter<false>> vLpf(nChans);
+
+    param::parameter paramDelayTime{ dDelayTime, 0.0, 4.0 }, paramDelayFeedback{ dDelayFeedback }, paramDelayMix{ fDelayMix };
+    param::parameter paramPpTimeLeft{ dPpTimeLeft, 0.0, 4.0 }, paramPpTimeRight{ dPpTimeRight, 0.0, 4.0 };
+    param::parameter paramPpFeedbackLeft{ dPpFeedback }, paramPpFeedbackRight{ dPpFeedback }, paramPpMix{ fPpMix };
+    param::parameter paramHpfFrequency{ dHpfFrequency, 20.0, 20000.0 }, paramHpfQ{ dHpfQ, 0.1, 10.0 };
+    param::parameter paramLpfFrequency{ dLpfFrequency, 20.0, 20000.0 }, paramLpfQ{ dLpfQ, 0.1, 10.0 };
+    param::parameter* vParams[] = {
+        &paramDelayTime, &paramDelayFeedback, &paramDelayMix,
+        &paramPpTimeLeft, &paramPpTimeRight, &paramPpFeedbackLeft, &paramPpFeedbackRight, &paramPpMix,
+        &paramHpfFrequency, &paramHpfQ, &paramLpfFrequency, &paramLpfQ
+    };
+    for (param::parameter* p : vParams)
+        p->prepare(nSampleRate);
+
+    graph::graph dsp(nChans, nBlockFrames, nSampleRate);
+    int nLast = dsp.add(new buffer_node(vDry));
+    if (t.bMonoDelay)
+        nLast = dsp.add(new graph::monodelay_node(monoDelay, paramDelayTime, paramDelayFeedback, paramDelayMix), { nLast });
+    if (t.bPingPong)
+        nLast = dsp.add(new graph::pingpong_node(pingPong, paramPpTimeLeft, paramPpTimeRight, paramPpFeedbackLeft, paramPpFeedbackRight, paramPpMix), { nLast });
+    if (t.bFilters)
+    {
+        nLast = dsp.add(new graph::filter_node<rbj_filter<true>>(vHpf.data(), nChans, nSampleRate, paramHpfFrequency, paramHpfQ), { nLast });
+        nLast = dsp.add(new graph::filter_node<rbj_filter<false>>(vLpf.data(), nChans, nSampleRate, paramLpfFrequency, paramLpfQ), { nLast });
+    }
+    dsp.set_output(nLast);
+    dsp.commit();
+
+    vOut.assign(nFrames * nChans, 0.0);
+    for (int i = 0; i < nFrames; i += nBlockFrames)
+        dsp.process(std::min(nBlockFrames, nFrames - i), &vOut[i * nChans], i / (FTYPE)nSampleRate);
+}
+
+#endif
+
+void render_case(const test_case& t, std::vector<FTYPE>& vOut)
+{
+    sine_voice instrument;
+    std::vector<FTYPE> vDry;
+    render_voices(instrument, (int)(dSeconds * nSampleRate), vDry);
+    if (t.bMonoDelay || t.bPingPong || t.bFilters)
+        render_chain(t, vDry, vOut);
+    else
+        vOut = vDry;
+}
+
+
+int main(int argc, char** argv)
+{
+    bool bUpdate = false;
+    std::string sDir = "tests/golden";
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string(argv[i]) == "--update")
+            bUpdate = true;
+        else
+            sDir = argv[i];
+    }
+
+    std::vector<test_case> vCases = {
+        { "voices", 1, false, false, false },
+        { "mono_delay", 1, true, false, false },
+        { "ping_pong", 2, false, true, false },
+        { "filter_chain", 2, true, true, true },
+    };
+
+    int nFailed = 0;
+    for (const test_case& t : vCases)
+    {
+        std::string sPath = sDir + "/" + t.name + ".gold";
+        std::vector<FTYPE> vOut;
+        render_case(t, vOut);
+
+        if (bUpdate)
+        {
+            bool bOk = golden::save(sPath, vOut, nSampleRate, t.nChannels);
+            printf("%-24s %s\n", t.name.c_str(), bOk ? "written" : "could not write");
+            nFailed += bOk ? 0 : 1;
+            continue;
+        }
+
+        std::vector<double> vReference;
+        int nRate = 0, nChannels = 0;
+        if (!golden::load(sPath, vReference, nRate, nChannels) || nRate != nSampleRate || nChannels != t.nChannels)
+        {
+            printf("%-24s FAIL could not load %s\n", t.name.c_str(), sPath.c_str());
+            nFailed++;
+            continue;
+        }
+        golden::report r = golden::compare(vReference, vOut);
+        printf("%-24s %s max error %.3e, snr %.1f dB, spectrum %.3f dB%s\n", t.name.c_str(), r.bPass ? "ok  " : "FAIL",
+            r.dMaxAbsError, r.dSnrDb, r.dSpectralDb, r.bLengthMatch ? "" : ", length differs");
+        nFailed += r.bPass ? 0 : 1;
+    }
+
+#ifndef GOLDEN_BASELINE
+    // sizes through every fft path: radix-2, the screen widths through mixed radix and a prime through bluestein
+    for (int nSize : { 256, 1024, 4096, 1280, 2560, 3000, 4801 })
+    {
+        double dError = golden::check_fft_magnitude(nSize);
+        bool bPass = dError <= dMaxFFTError;
+        printf("fft %-20d %s %s, max relative error %.3e\n", nSize, bPass ? "ok  " : "FAIL", fft_algorithm_name(fft_get_plan(nSize).eAlgorithm), dError);
+        nFailed += bPass ? 0 : 1;
+    }
+#endif
+
+    printf("%s, %d failed\n", nFailed == 0 ? "passed" : "FAILED", nFailed);
+    return nFailed == 0 ? 0 : 1;
+}
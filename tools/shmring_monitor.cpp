@@ -0,0 +1,103 @@
+/*
+    Test consumer for the shared memory output of olcSynthVisualizer.
+
+    Attaches to the ring (default name "olcsynth"), reads it with the zero
+    copy interface and prints the peak and RMS of every channel once a
+    second, along with the frames read, the writer's block counter and any
+    frames lost to overruns. Stops when the writer closes the ring or after
+    the given number of seconds.
+
+    shmring_monitor [name] [seconds]
+*/
+
+#include "shmring.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+int main(int argc, char* argv[])
+{
+    std::string sName = argc > 1 ? argv[1] : "olcsynth";
+    double dSeconds = argc > 2 ? atof(argv[2]) : 0.0;
+
+    shmring::reader ring;
+    if (!ring.open(sName))
+    {
+        fprintf(stderr, "no ring called %s\n", sName.c_str());
+        return 1;
+    }
+    int nChans = ring.channels();
+    printf("%s: %d channels, %d Hz, %d frames\n", sName.c_str(), nChans, ring.sample_rate(), ring.capacity());
+
+    using clock = std::chrono::steady_clock;
+    auto tStart = clock::now();
+    auto tReport = tStart;
+    std::vector<double> vPeak(nChans), vSquares(nChans);
+    std::vector<double> vBlockPeak(nChans), vBlockSquares(nChans);
+    uint64_t nFrames = 0;
+    uint64_t nTotal = 0;
+
+    while (!ring.closed())
+    {
+        shmring::reader::view v;
+        if (ring.acquire(v, 4096) == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        else
+        {
+            // sums go into locals first, they only count if release() says the frames were intact
+            std::fill(vBlockPeak.begin(), vBlockPeak.end(), 0.0);
+            std::fill(vBlockSquares.begin(), vBlockSquares.end(), 0.0);
+            for (int part = 0; part < 2; part++)
+            {
+                const float* p = part == 0 ? v.pFirst : v.pSecond;
+                int n = part == 0 ? v.nFirst : v.nSecond;
+                for (int i = 0; i < n; i++)
+                    for (int c = 0; c < nChans; c++)
+                    {
+                        double s = p[i * nChans + c];
+                        vBlockPeak[c] = std::max(vBlockPeak[c], std::fabs(s));
+                        vBlockSquares[c] += s * s;
+                    }
+            }
+            if (ring.release(v))
+            {
+                for (int c = 0; c < nChans; c++)
+                {
+                    vPeak[c] = std::max(vPeak[c], vBlockPeak[c]);
+                    vSquares[c] += vBlockSquares[c];
+                }
+                nFrames += v.frames();
+            }
+        }
+
+        auto tNow = clock::now();
+        if (tNow - tReport >= std::chrono::seconds(1))
+        {
+            nTotal += nFrames;
+            printf("frames %llu blocks %llu lost %llu |", (unsigned long long)nTotal, (unsigned long long)ring.blocks(), (unsigned long long)ring.lost());
+            for (int c = 0; c < nChans; c++)
+            {
+                double dRms = nFrames > 0 ? std::sqrt(vSquares[c] / nFrames) : 0.0;
+                printf(" ch%d peak %.3f rms %.3f", c, vPeak[c], dRms);
+                vPeak[c] = 0.0;
+                vSquares[c] = 0.0;
+            }
+            printf("\n");
+            fflush(stdout);
+            nFrames = 0;
+            tReport = tNow;
+        }
+        if (dSeconds > 0.0 && std::chrono::duration<double>(tNow - tStart).count() >= dSeconds)
+            break;
+    }
+
+    printf("done, %llu frames read, %llu lost\n", (unsigned long long)(nTotal + nFrames), (unsigned long long)ring.lost());
+    return 0;
+}
@@ -0,0 +1,162 @@
+/*
+    Offline visualiser video export.
+
+    Reads a wav file (a recording from the synth, for instance) and renders
+    the oscilloscope or spectrum view of it at a fixed frame rate, with the
+    same drawing code and layout as the live window. Frames are rendered in
+    parallel, each from the audio window that ends at its own timestamp, and
+    written in order as a PPM image sequence or as raw rgb24 video on stdout:
+
+    visualizer_export in.wav frames/f_ --fps 60
+    visualizer_export in.wav - --size 1920x1080 | ffmpeg -f rawvideo -pix_fmt rgb24 -s 1920x1080 -r 60 -i - -i in.wav -shortest out.mp4
+
+    options: --fps N, --size WxH, --mode scope|fft, --span seconds (scope),
+    --bands none|third|twelfth (fft), --threads N
+*/
+
+#include "wav.h"
+#include "fft.h"
+#include "frames.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+
+struct worker_state
+{
+    std::vector<float> vMin, vMax;
+    std::vector<double> vWindow, vMagnitude, vValues;
+    spectrum::column_map columns;
+    spectrum::band_map bands;
+};
+
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "visualizer_export in.wav out_prefix|- [--fps N] [--size WxH] [--mode scope|fft] [--span s] [--bands none|third|twelfth] [--threads N]\n");
+        return 1;
+    }
+    std::string sInput = argv[1];
+    std::string sOutput = argv[2];
+    double dFps = 60.0;
+    int nWidth = 1280, nHeight = 720;
+    bool bScope = true;
+    double dSpan = 0.029;
+    spectrum::bands eBands = spectrum::bands::none;
+    int nThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 3; i + 1 < argc; i += 2)
+    {
+        std::string sOption = argv[i];
+        const char* sValue = argv[i + 1];
+        if (sOption == "--fps") dFps = atof(sValue);
+        else if (sOption == "--size") sscanf(sValue, "%dx%d", &nWidth, &nHeight);
+        else if (sOption == "--mode") bScope = strcmp(sValue, "fft") != 0;
+        else if (sOption == "--span") dSpan = atof(sValue);
+        else if (sOption == "--bands") eBands = strcmp(sValue, "third") == 0 ? spectrum::bands::third_octave : strcmp(sValue, "twelfth") == 0 ? spectrum::bands::twelfth_octave : spectrum::bands::none;
+        else if (sOption == "--threads") nThreads = atoi(sValue);
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", sOption.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<std::vector<double>> vAudio;
+    int nSampleRate = 0;
+    if (!wav::read(sInput, vAudio, nSampleRate) || vAudio.empty() || vAudio[0].empty() || nWidth <= 0 || nHeight <= 0 || dFps <= 0.0)
+    {
+        fprintf(stderr, "could not read %s\n", sInput.c_str());
+        return 1;
+    }
+    int nChans = (int)vAudio.size();
+    int64_t nLength = (int64_t)vAudio[0].size();
+    int nFrames = (int)(nLength * dFps / nSampleRate) + 1;
+    int nFFTSize = nWidth * 2;      // as in the window, one bin pair per column
+
+    bool bPipe = sOutput == "-";
+#ifdef _WIN32
+    if (bPipe)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    std::vector<worker_state> vStates(std::max(1, nThreads));
+    auto render = [&](int nFrame, int nWorker, frames::canvas& img)
+    {
+        worker_state& s = vStates[nWorker];
+        img.clear(frames::BLACK);
+
+        // the window ends at the frame's timestamp, silence before the start of the file
+        int64_t nEnd = (int64_t)(nFrame * (double)nSampleRate / dFps);
+        int64_t nWindow = bScope ? std::max<int64_t>(1, (int64_t)(dSpan * nSampleRate)) : nFFTSize;
+        s.vWindow.resize(nWindow);
+
+        for (int c = 0; c < nChans; c++)
+        {
+            const std::vector<double>& vChannel = vAudio[c];
+            for (int64_t i = 0; i < nWindow; i++)
+            {
+                int64_t n = nEnd - nWindow + i;
+                s.vWindow[i] = n >= 0 && n < nLength ? vChannel[n] : 0.0;
+            }
+
+            // same layout as olcSynthVisualizer
+            int yScale = nHeight / nChans - 50;
+            int yOffset = (c + 1) * yScale - yScale / 2 + 100;
+            if (bScope)
+            {
+                s.vMin.resize(nWidth);
+                s.vMax.resize(nWidth);
+                double dPerColumn = (double)nWindow / nWidth;
+                for (int x = 0; x < nWidth; x++)
+                {
+                    int64_t i0 = (int64_t)(x * dPerColumn);
+                    int64_t i1 = std::max(i0 + 1, (int64_t)((x + 1) * dPerColumn));
+                    float lo = (float)s.vWindow[i0], hi = lo;
+                    for (int64_t i = i0 + 1; i < i1 && i < nWindow; i++)
+                    {
+                        lo = std::min(lo, (float)s.vWindow[i]);
+                        hi = std::max(hi, (float)s.vWindow[i]);
+                    }
+                    s.vMin[x] = lo;
+                    s.vMax[x] = hi;
+                }
+                frames::draw_scope(img, s.vMin.data(), s.vMax.data(), nWidth, yOffset, yScale, frames::YELLOW);
+            }
+            else
+            {
+                s.vMagnitude.resize(nFFTSize / 2);
+                fft_magnitude(s.vWindow.data(), s.vMagnitude.data(), nFFTSize);
+                frames::draw_spectrum(img, s.vMagnitude.data(), nFFTSize, (double)nSampleRate, nWidth, yOffset + c * 15 + 60, yScale, frames::RED,
+                    spectrum::aggregate::max, eBands, s.columns, s.bands, s.vValues);
+            }
+        }
+    };
+
+    auto tStart = std::chrono::steady_clock::now();
+    auto write = [&](int nFrame, const frames::canvas& img)
+    {
+        if (bPipe)
+            return frames::write_raw(stdout, img);
+        char sName[32];
+        snprintf(sName, sizeof(sName), "%06d.ppm", nFrame);
+        if (nFrame % 100 == 0)
+            fprintf(stderr, "\rframe %d/%d", nFrame, nFrames);
+        return frames::write_ppm(sOutput + sName, img);
+    };
+
+    bool bOk = frames::render_parallel(nFrames, nWidth, nHeight, (int)vStates.size(), render, write);
+    double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+    fprintf(stderr, "\r%s %d frames %dx%d at %g fps in %.2fs (%.1f frames/s, %d threads)\n",
+        bOk ? "wrote" : "failed after", nFrames, nWidth, nHeight, dFps, dSeconds, nFrames / std::max(dSeconds, 1e-9), (int)vStates.size());
+    return bOk ? 0 : 1;
+}